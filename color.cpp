@@ -20,6 +20,7 @@
 
 #include <string>
 #include <algorithm>
+#include <array>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <atomic>
@@ -38,41 +39,89 @@ std::string get_env(const std::string & name)
 
 std::atomic_bool color::g_no_color;
 
-bool is_no_color()
-{
-    static int is_no_color_cache = -1;
-    if (is_no_color_cache != -1) {
-        return is_no_color_cache;
-    }
+namespace {
+    // 6x6x6 color cube of the xterm 256-color palette, index 16 + 36r + 6g + b
+    constexpr int palette_size = 216;
+    constexpr std::size_t escape_max_length = sizeof("\033[38;5;231m") - 1;
 
-    auto color_env = get_env("COLOR");
-    std::ranges::transform(color_env, color_env.begin(), ::tolower);
+    struct escape_storage_t {
+        char str[palette_size][escape_max_length + 1];
+        std::size_t len[palette_size];
+    };
 
-    if (color_env == "always")
+    constexpr escape_storage_t make_escape_storage(const char layer /* '3' fg, '4' bg */)
     {
-        is_no_color_cache = 0;
-        return false;
+        escape_storage_t storage{};
+        for (int i = 0; i < palette_size; i++)
+        {
+            const int scale = 16 + i;
+            char * p = storage.str[i];
+            std::size_t n = 0;
+            for (const char c : { '\033', '[', layer, '8', ';', '5', ';' }) {
+                p[n++] = c;
+            }
+            if (scale >= 100) p[n++] = static_cast<char>('0' + scale / 100);
+            if (scale >= 10) p[n++] = static_cast<char>('0' + scale / 10 % 10);
+            p[n++] = static_cast<char>('0' + scale % 10);
+            p[n++] = 'm';
+            storage.len[i] = n;
+        }
+        return storage;
     }
 
-    const bool no_color_from_env = color_env == "never" || color_env == "none" || color_env == "off"
-                            || color_env == "no" || color_env == "n" || color_env == "0" || color_env == "false";
-    bool is_terminal = false;
-    struct stat st{};
-    if (fstat(STDOUT_FILENO, &st) == -1)
+    constexpr escape_storage_t fg_storage = make_escape_storage('3');
+    constexpr escape_storage_t bg_storage = make_escape_storage('4');
+
+    constexpr std::array<std::string_view, palette_size> make_palette(const escape_storage_t & storage)
     {
-        is_no_color_cache = true;
+        std::array<std::string_view, palette_size> palette{};
+        for (int i = 0; i < palette_size; i++) {
+            palette[i] = std::string_view(storage.str[i], storage.len[i]);
+        }
+        return palette;
     }
 
-    if (isatty(STDOUT_FILENO))
+    constexpr std::array<std::string_view, palette_size> fg_palette = make_palette(fg_storage);
+    constexpr std::array<std::string_view, palette_size> bg_palette = make_palette(bg_storage);
+    static_assert(fg_palette[0] == "\033[38;5;16m");
+    static_assert(bg_palette[palette_size - 1] == "\033[48;5;231m");
+
+    constexpr int palette_index(const int r, const int g, const int b)
     {
-        is_terminal = true;
+        auto constrain = [](const int var)->int { return std::min(std::max(var, 0), 5); };
+        return 36 * constrain(r) + 6 * constrain(g) + constrain(b);
     }
+}
+
+// decided once, on first use
+bool is_no_color()
+{
+    static const bool is_no_color_cache = []()->bool
+    {
+        auto color_env = get_env("COLOR");
+        std::ranges::transform(color_env, color_env.begin(), ::tolower);
+
+        if (color_env == "always")
+        {
+            return false;
+        }
+
+        const bool no_color_from_env = color_env == "never" || color_env == "none" || color_env == "off"
+                                || color_env == "no" || color_env == "n" || color_env == "0" || color_env == "false";
+        struct stat st{};
+        if (fstat(STDOUT_FILENO, &st) == -1)
+        {
+            return true;
+        }
+
+        const bool is_terminal = isatty(STDOUT_FILENO);
+        return no_color_from_env || !is_terminal || color::g_no_color;
+    }();
 
-    is_no_color_cache = no_color_from_env || !is_terminal || color::g_no_color;
     return is_no_color_cache;
 }
 
-std::string color::no_color()
+std::string_view color::no_color()
 {
     if (!is_no_color())
     {
@@ -89,49 +138,27 @@ std::string color::color(const int r, const int g, const int b, const int br, co
         return "";
     }
 
-    return color(r, g, b) + bg_color(br, bg, bb);
+    std::string ret(color(r, g, b));
+    ret += bg_color(br, bg, bb);
+    return ret;
 }
 
-std::string color::color(int r, int g, int b)
+std::string_view color::color(const int r, const int g, const int b)
 {
     if (is_no_color())
     {
         return "";
     }
 
-    auto constrain = [](int var, const int min, const int max)->int
-    {
-        var = std::max(var, min);
-        var = std::min(var, max);
-        return var;
-    };
-
-    r = constrain(r, 0, 5);
-    g = constrain(g, 0, 5);
-    b = constrain(b, 0, 5);
-
-    const int scale = 16 + 36 * r + 6 * g + b;
-    return "\033[38;5;" + std::to_string(scale) + "m";
+    return fg_palette[palette_index(r, g, b)];
 }
 
-std::string color::bg_color(int r, int g, int b)
+std::string_view color::bg_color(const int r, const int g, const int b)
 {
     if (is_no_color())
     {
         return "";
     }
 
-    auto constrain = [](int var, const int min, const int max)->int
-    {
-        var = std::max(var, min);
-        var = std::min(var, max);
-        return var;
-    };
-
-    r = constrain(r, 0, 5);
-    g = constrain(g, 0, 5);
-    b = constrain(b, 0, 5);
-
-    const int scale = 16 + 36 * r + 6 * g + b;
-    return "\033[48;5;" + std::to_string(scale) + "m";
+    return bg_palette[palette_index(r, g, b)];
 }
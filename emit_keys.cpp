@@ -3,19 +3,62 @@
 #include <linux/uinput.h>
 #include <cstdint>
 #include <cstring>
+#include <cstdio>
+#include <map>
 #include <fcntl.h>
 #include "map_reader.h"
 #include <ranges>
 #include "emit_keys.h"
+#include "metrics.h"
+
+static std::map<int, std::string> trace_devices;
+
+void emit_trace_device(const int fd, const std::string & device_name)
+{
+    trace_devices[fd] = device_name;
+}
 
 void emit(const int fd, const uint16_t type, const uint16_t code, const int32_t value)
 {
+    if (!trace_devices.empty())
+    {
+        if (const auto it = trace_devices.find(fd); it != trace_devices.end())
+        {
+            char line[64];
+            const int len = snprintf(line, sizeof(line), "%s %u %u %d\n", it->second.c_str(), type, code, value);
+            assert_throw(write(fd, line, len) == len);
+            return;
+        }
+    }
+
     input_event ev{};
     ev.type = type;
     ev.code = code;
     ev.value = value;
     gettimeofday(&ev.time, nullptr);
     assert_throw(write(fd, &ev, sizeof(ev)) == sizeof(ev));
+    metrics::add(metrics::UINPUT_WRITES);
+    metrics::add(metrics::UINPUT_BYTES, sizeof(ev));
+}
+
+void emit_events(const int fd, const std::span < const input_event > events)
+{
+    if (events.empty()) {
+        return;
+    }
+
+    if (!trace_devices.empty() && trace_devices.contains(fd))
+    {
+        for (const auto & ev : events) {
+            emit(fd, ev.type, ev.code, ev.value);
+        }
+        return;
+    }
+
+    const auto bytes = static_cast<ssize_t>(events.size_bytes());
+    assert_throw(write(fd, events.data(), bytes) == bytes);
+    metrics::add(metrics::UINPUT_WRITES);
+    metrics::add(metrics::UINPUT_BYTES, bytes);
 }
 
 int init_linux_input(const kbd_map & key_map)
@@ -59,7 +102,6 @@ int init_linux_input(const kbd_map & key_map)
     usetup.id.version = 0x1;
     assert_throw(ioctl(fd, UI_DEV_SETUP, &usetup) != -1);
     assert_throw(ioctl(fd, UI_DEV_CREATE) != -1);
-    usleep(5000);
     return fd;
 }
 
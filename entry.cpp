@@ -1,83 +1,45 @@
-// This file uses unnecessarily complicated methods for key emissions because my Yogabook is too old to use "normal"
-// methods, and these are workarounds to bypass certain issues (like sticky keys, etc.)
-
 #include <algorithm>
 #include "log.hpp"
 #include "map_reader.h"
 #include "emit_keys.h"
+#include "halo_clock.h"
 #include <fcntl.h>
 #include <linux/uinput.h>
 #include <csignal>
-#include <mutex>
 #include <unistd.h>
 #include <chrono>
+#include <limits>
+#include <mutex>
 #include <thread>
 #include <libinput.h>
 #include <libudev.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
 #include <iostream>
 #include <ranges>
-#include <functional>
 #include <key_id.h>
-#include "execute_command.h"
 #include <filesystem>
-#include "libmod.h"
+#include "execute_command.h"
+#include "session.h"
+#include "worker_pool.h"
+#include "module_chain.h"
+#include "module_host.h"
+#include "latency.h"
+#include "metrics.h"
+#include "touch_record.h"
+#include "readiness.h"
+#include "handover.h"
+#include "realtime.h"
+
+static_assert(LIBINPUT_EVENT_TOUCH_DOWN == TOUCH_DOWN && LIBINPUT_EVENT_TOUCH_UP == TOUCH_UP
+    && LIBINPUT_EVENT_TOUCH_MOTION == TOUCH_MOTION, "touch_event_t::type stores libinput_event_type values");
 
-constexpr unsigned int long_press_interval_ms = 80;
 volatile std::atomic_int ctrl_c = 0;
 volatile std::atomic_int halo_device_fd = -1;
-namespace fs = std::filesystem;
-using key_id_t = unsigned int;
-struct key_state_t {
-    bool normal_press_handled = false;
-    bool press_down = false;
-    std::chrono::time_point<std::chrono::high_resolution_clock> press_event_reg_time;
-};
-
-std::mutex g_mutex;
-std::map < key_id_t, key_state_t > pressed_key;
 std::atomic_int vkbd_fd (-1);
-std::atomic_bool fnlock_enabled = false;
-std::atomic_bool release_all_keys = false;
-
-typedef void(*inverted_key_map_handler)(key_id_t);
-void fn_lock(key_id_t);
-extern "C" void normal_key_emit(key_id_t);
-void settings(key_id_t);
-void airplane_mode(key_id_t);
-
-std::map < key_id_t, std::pair <key_id_t, inverted_key_map_handler> >
-fn_key_invert_handler_map = {
-    { KEY_ID_ESC, {INVERTED_KEY_FNLOCK,         fn_lock} },
-    { KEY_ID_F1,  {INVERTED_KEY_MUTE,           normal_key_emit} },
-    { KEY_ID_F2,  {INVERTED_KEY_VOLUMEDOWN,     normal_key_emit} },
-    { KEY_ID_F3,  {INVERTED_KEY_VOLUMEUP,       normal_key_emit} },
-    { KEY_ID_F4,  {INVERTED_KEY_AIRPLANEMODE,   airplane_mode} },
-    { KEY_ID_F5,  {INVERTED_KEY_BRIGHTNESSDOWN, normal_key_emit} },
-    { KEY_ID_F6,  {INVERTED_KEY_BRIGHTNESSUP,   normal_key_emit} },
-    { KEY_ID_F7,  {INVERTED_KEY_SEARCH,         normal_key_emit} },
-    { KEY_ID_F8,  {INVERTED_KEY_SETTINGS,       settings} },
-    { KEY_ID_F9,  {INVERTED_KEY_PREVIOUSSONG,   normal_key_emit} },
-    { KEY_ID_F10, {INVERTED_KEY_PLAYPAUSE,      normal_key_emit} },
-    { KEY_ID_F11, {INVERTED_KEY_NEXTSONG,       normal_key_emit} },
-    { KEY_ID_F12, {INVERTED_KEY_PRINT,          normal_key_emit} },
-};
-
-const std::map < int, key_id_t > offset_map = {
-    { 0, INVERTED_KEY_FNLOCK },
-    { 1, INVERTED_KEY_MUTE },
-    { 2, INVERTED_KEY_VOLUMEDOWN },
-    { 3, INVERTED_KEY_VOLUMEUP },
-    { 4, INVERTED_KEY_AIRPLANEMODE },
-    { 5, INVERTED_KEY_BRIGHTNESSDOWN },
-    { 6, INVERTED_KEY_BRIGHTNESSUP },
-    { 7, INVERTED_KEY_SEARCH },
-    { 8, INVERTED_KEY_SETTINGS },
-    { 9, INVERTED_KEY_PREVIOUSSONG },
-    { 0, INVERTED_KEY_PLAYPAUSE },
-    { 11, INVERTED_KEY_NEXTSONG },
-    { 12, INVERTED_KEY_PRINT },
-};
+namespace fs = std::filesystem;
 
 void sigint_handler(int)
 {
@@ -89,393 +51,525 @@ void sigint_handler(int)
     }
 }
 
-inline std::string key_id_translate(const key_id_t key)
+void sigusr1_handler(int)
 {
-    const auto it = key_id_to_str_translation_table.find(key);
-    if (it == key_id_to_str_translation_table.end()) {
-        return "Unknown";
-    }
+    latency::dump_requested = true;
+}
 
-    return it->second;
+// SIGUSR2: start a new instance of the binary, which takes the devices over (see handover.h)
+std::atomic_bool upgrade_requested = false;
+
+void sigusr2_handler(int)
+{
+    upgrade_requested = true;
 }
 
-template < typename Type > requires (!std::is_integral_v<Type>)
-std::vector < std::string > key_id_translate(const Type & keys)
+// called by Fn key modules, from a worker thread: one write(), so the tap never interleaves with the loop's batches.
+// Modules are C code, no exception may leave this or module_emit_batch
+extern "C"
+void normal_key_emit(const key_id_t key_id) noexcept
 {
-    std::vector < std::string > ret;
-    ret.reserve(keys.size());
-    for (const auto & key : keys) {
-        static_assert(std::is_same_v < decltype(key), const key_id_t & >,
-            "Decompressed element does not speaking the type `key_id_t`");
-        ret.push_back(key_id_translate(key));
-    }
+    const auto event = [](const uint16_t type, const uint16_t code, const int32_t value) {
+        input_event ev{};
+        ev.type = type;
+        ev.code = code;
+        ev.value = value;
+        return ev;
+    };
+    const input_event events[] = {
+        event(EV_KEY, key_id /* key code */, 1 /* press down */),
+        event(EV_SYN, SYN_REPORT, 0), // sync
+        event(EV_KEY, key_id /* key code */, 0 /* release */),
+        event(EV_SYN, SYN_REPORT, 0), // sync
+    };
 
-    return ret;
+    try {
+        emit_events(vkbd_fd, events);
+    } catch (const std::exception & e) {
+        print_log(ERROR_LOG, "Cannot write the key a module emitted: ", e.what(), "\n");
+    }
 }
 
-void fn_lock(const key_id_t)
+// version 2 modules: a frame of press/release events, one SYN_REPORT each, with a single write()
+extern "C"
+int module_emit_batch(const halo_module_key_event * events, const size_t count) noexcept
 {
-    fnlock_enabled = !fnlock_enabled;
-    print_log(DEBUG_LOG, "Fn ", fnlock_enabled ? "" : "Un", "locked\n");
+    if (events == nullptr || count == 0 || count > HALO_MODULE_BATCH_MAX) {
+        return -1;
+    }
+
+    input_event frame[HALO_MODULE_BATCH_MAX * 2] { };
+    for (size_t i = 0; i < count; i++)
+    {
+        if (events[i].key_id >= KEY_CNT || events[i].value < 0 || events[i].value > 2) {
+            return -1;
+        }
+
+        frame[i * 2].type = EV_KEY;
+        frame[i * 2].code = static_cast<uint16_t>(events[i].key_id);
+        frame[i * 2].value = events[i].value;
+        frame[i * 2 + 1].type = EV_SYN;
+        frame[i * 2 + 1].code = SYN_REPORT;
+    }
+
+    try {
+        emit_events(vkbd_fd, std::span(frame, count * 2));
+    } catch (const std::exception & e) {
+        print_log(ERROR_LOG, "Cannot write the keys a module emitted: ", e.what(), "\n");
+        return -1;
+    }
+    return 0;
 }
 
-extern "C"
-void normal_key_emit(const key_id_t key_id)
+// slow Fn key side effects (launching programs, module handlers) run here, never on the driver loop
+worker_pool fn_workers(2, 8, "FnWorker");
+constexpr std::chrono::seconds command_timeout(30);
+
+// queues `action` for the Fn key `key`, a press while the previous one still waits is dropped
+template < typename Action >
+void run_fn_action(const key_id_t key, Action && action)
 {
-    emit(vkbd_fd, EV_KEY, key_id /* key code */, 1 /* press down */);
-    emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
-    emit(vkbd_fd, EV_KEY, key_id /* key code */, 0 /* release */);
-    emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
+    // the job and its queue entry are the only allocations a key press may make, and only for these keys
+    const realtime::allocations_allowed_t allowed;
+    const auto result = fn_workers.submit(key, [key, action = std::forward<Action>(action)] {
+        metrics::add(metrics::FN_ACTIONS);
+        print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(key)), "Running Fn action ", key_id_translate(key), "\n");
+        action();
+    });
+
+    if (result == worker_pool::COALESCED)
+    {
+        metrics::add(metrics::FN_ACTIONS_COALESCED);
+        print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(key)), "Fn action ", key_id_translate(key), " already pending\n");
+    }
+    else if (result == worker_pool::REJECTED)
+    {
+        metrics::add(metrics::FN_ACTIONS_REJECTED);
+        print_log(WARNING_LOG, JOURNAL_KEY(key_id_translate(key)), "[WARNING] Fn action queue full, ", key_id_translate(key), " dropped\n");
+    }
 }
 
-std::vector<std::thread> xdg_thread_pool;
-std::mutex xdg_thread_pool_mutex;
+// the epoll set of the driver loop: halo_device_fd, and the session helper connection
+int loop_epoll_fd = -1;
+
+// programs for the desktop session go through halo_session, connected on first use
+session::client session_helper(session::socket_path(1000));
+
+// starts `argv` in the user's session, through the session helper when it runs (worker threads)
+void launch_in_session(const std::vector<std::string> & argv)
+{
+    if (session_helper.launch(argv)) {
+        return;
+    }
+
+    // no helper: build the user's session environment by hand, hundreds of milliseconds per launch
+    std::string command = "/usr/bin/machinectl shell "
+        "--uid=1000 --setenv=XDG_RUNTIME_DIR=/run/user/1000 "
+        "--setenv=WAYLAND_DISPLAY=wayland-0 "
+        "--setenv=DBUS_SESSION_BUS_ADDRESS=unix:path=/run/user/1000/bus "
+        "--setenv=KDE_SESSION_VERSION=6 "
+        "--setenv=KDE_FULL_SESSION=true \"$(id -un 1000)\"@";
+    for (const auto & arg : argv) {
+        command += " " + arg;
+    }
+
+    if (const auto status = exec_command_async(command_timeout, "/usr/bin/env", "", "bash", "-c", command + " &").wait();
+        status.exit_status != 0) {
+        print_log(WARNING_LOG, "[WARNING] ", argv.front(), " failed to start (", status.exit_status, "): ", status.fd_stderr, "\n");
+    }
+}
 
-void settings(const key_id_t)
+void settings(const key_id_t key)
 {
 #ifdef __KDE__
     print_log(DEBUG_LOG, "Launch System Settings\n");
-    auto xdg_launch_settings = []()->void
-    {
-        pthread_setname_np(pthread_self(), "LaunchSettings");
-        exec_command("/usr/bin/env", "", "bash", "-c",
-            "/usr/bin/machinectl shell "
-            "--uid=1000 --setenv=XDG_RUNTIME_DIR=/run/user/1000 "
-            "--setenv=WAYLAND_DISPLAY=wayland-0 "
-            "--setenv=DBUS_SESSION_BUS_ADDRESS=unix:path=/run/user/1000/bus "
-            "--setenv=KDE_SESSION_VERSION=6 "
-            "--setenv=KDE_FULL_SESSION=true \"$(id -un 1000)\"@ "
-            "/usr/bin/systemsettings &");
-    };
-
-    std::lock_guard<std::mutex> lock(xdg_thread_pool_mutex);
-    xdg_thread_pool.emplace_back(xdg_launch_settings);
+    run_fn_action(key, [] { launch_in_session({ "/usr/bin/systemsettings" }); });
 #endif // __KDE__
 }
 
-void airplane_mode(const key_id_t)
+// the loaded module chain, only touched by the driver loop: version 2 modules get their keys through
+// write_output(), the handler of a version 1 module runs on the worker pool like the built-in actions,
+// and each queued call holds its module, so a module swapped out by a reload is unloaded after its last call
+std::shared_ptr < module_chain > modules;
+std::vector < module_chain::spec_t > module_specs;
+std::atomic_bool module_reload_requested = false;
+
+// what a reload swapped out is let go on a thread of its own: tearing down a chain joins its demoted modules'
+// threads, a module host waits for its process. The queue is unbounded, so a retirement is never turned
+// away back onto the driver loop, and it never takes a slot from the Fn actions
+worker_pool reaper(1, std::numeric_limits<std::size_t>::max(), "Reaper");
+uint64_t retired_count = 0;
+
+void retire(std::shared_ptr < void > retired)
 {
-    print_log(DEBUG_LOG, "XDG setting Airplane Mode\n");
-    print_log(WARNING_LOG, "[WARNING] Toggling Airplane Mode not implemented and possibly never plan to. This key lacks practical purpose.\n");
+    reaper.submit(retired_count++, [retired = std::move(retired)] { });
 }
 
-void emit_key_thread()
+// a chain reload_module() loads on the reaper thread, so dlopen() and the modules' module_init never stall
+// the driver loop. The loader fills it in and writes module_chain_loaded_fd (registered under its address),
+// check_module_chain_load() swaps the chain in. A reload while one is loading starts over
+struct module_chain_load_t
+{
+    std::mutex mutex;
+    bool done = false;
+    std::shared_ptr < module_chain > chain;
+    std::string error;
+};
+std::shared_ptr < module_chain_load_t > module_chain_loading;
+int module_chain_loaded_fd = -1;
+
+// HALO_MODULE_HOST: the modules run in a halo_modhost process instead, `modules` stays empty.
+// Its epoll registrations are tagged with the addresses of the two tags below.
+std::shared_ptr < module_host > modhost;
+std::string module_host_path, module_list;
+std::chrono::steady_clock::time_point modhost_started;
+char modhost_notify_tag, modhost_exit_tag;
+
+// the host a restart started, swapped in by check_module_host_start() once its modules are loaded,
+// so a module that takes long to load never stalls the driver loop. Registered under modhost_starting_tag
+std::shared_ptr < module_host > modhost_starting;
+std::chrono::steady_clock::time_point modhost_start_deadline;
+char modhost_starting_tag;
+
+// the epoll registration of a handover connection whose request has not arrived yet
+char handover_connection_tag;
+
+// (un)registers the fds of the module host with the driver loop, if it runs one
+void watch_module_host(const int op)
 {
-    pthread_setname_np(pthread_self(), "VirKbd");
+    if (!modhost || loop_epoll_fd == -1) {
+        return;
+    }
 
-    struct long_press_struct {
-        std::unique_ptr < std::atomic_bool > running;
-        std::thread thread;
-        key_id_t key{};
-    };
-    thread_local std::vector < long_press_struct > long_pressed_keys;
-    std::atomic_bool no_key_pressed_after_win = false;
-    std::vector < unsigned int > combination_sp_keys;
-    std::mutex combination_sp_keys_mutex_;
+    epoll_event notify { .events = EPOLLIN, .data = { .ptr = &modhost_notify_tag } };
+    epoll_event exit { .events = EPOLLIN, .data = { .ptr = &modhost_exit_tag } };
+    assert_throw(epoll_ctl(loop_epoll_fd, op, modhost->notify_fd(), &notify) == 0);
+    if (modhost->running()) {
+        assert_throw(epoll_ctl(loop_epoll_fd, op, modhost->exit_fd(), &exit) == 0);
+    }
+}
 
-    auto press_keys_once = [&](const key_id_t pressed_key)->void
-    {
-        std::lock_guard<std::mutex> lock(combination_sp_keys_mutex_);
-        if (fn_key_invert_handler_map.contains(pressed_key))
-        {
-            print_log(DEBUG_LOG, "Fn governed key ", key_id_translate(pressed_key), " pressed, Fn is ",
-                (std::ranges::find(combination_sp_keys, KEY_ID_FN) != combination_sp_keys.end() ? "" : "NOT "),
-                "present within the key combination\n");
-            // check if Fn Lock and Fn key presence within combinations
-            bool do_i_invert = fnlock_enabled;
-            do_i_invert = std::ranges::find(combination_sp_keys, KEY_ID_FN) != combination_sp_keys.end()
-                ? !do_i_invert : do_i_invert;
-
-            print_log(DEBUG_LOG, "Invert = ", do_i_invert, "\n");
-
-            if (do_i_invert) {
-                const auto [inverted_key_id, handler] = fn_key_invert_handler_map.at(pressed_key);
-                print_log(DEBUG_LOG, "Pressing down ", key_id_translate(inverted_key_id), "\n");
-                handler(inverted_key_id);
-            } else { // just press the corresponding key
-                print_log(DEBUG_LOG, "Pressing down ", key_id_translate(pressed_key), "\n");
-                emit(vkbd_fd, EV_KEY, pressed_key /* key code */, 1 /* press down */);
-                emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
-                emit(vkbd_fd, EV_KEY, pressed_key /* key code */, 0 /* release */);
-                emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
-            }
-        }
-        else
-        {
-            print_log(DEBUG_LOG, "Executing key press cb:", key_id_translate(combination_sp_keys),
-                    " & ch:", key_id_translate(pressed_key), ", fn:", fnlock_enabled, "\n");
+// wakes the driver loop once the starting host is ready or gone
+void watch_starting_module_host(const int op)
+{
+    if (!modhost_starting || loop_epoll_fd == -1) {
+        return;
+    }
 
-            // release all functional key
-            for (const auto key_id : combination_sp_keys) {
-                emit(vkbd_fd, EV_KEY, key_id /* key code */, 0 /* release */);
-            }
-            emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
+    epoll_event notify { .events = EPOLLIN, .data = { .ptr = &modhost_starting_tag } };
+    epoll_event exit { .events = EPOLLIN, .data = { .ptr = &modhost_starting_tag } };
+    assert_throw(epoll_ctl(loop_epoll_fd, op, modhost_starting->notify_fd(), &notify) == 0);
+    assert_throw(epoll_ctl(loop_epoll_fd, op, modhost_starting->exit_fd(), &exit) == 0);
+}
 
-            // press again
-            for (const auto key_id : combination_sp_keys) {
-                emit(vkbd_fd, EV_KEY, key_id /* key code */, 1 /* press down */);
-            }
-            emit(vkbd_fd, EV_KEY, pressed_key /* key code */, 1 /* press down */);
-            emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
+void sighup_handler(int)
+{
+    module_reload_requested = true;
+}
 
-            // release again
-            for (const auto key_id : combination_sp_keys) {
-                emit(vkbd_fd, EV_KEY, key_id /* key code */, 0 /* release */);
-            }
-            emit(vkbd_fd, EV_KEY, pressed_key /* key code */, 0 /* release */);
-            emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
+void module_key(const key_id_t key)
+{
+    if (modhost) {
+        modhost->queue_fn_key(key);
+        return;
+    }
 
-            // press down again, until it's released by a "pressure gone" signal
-            for (const auto key_id : combination_sp_keys) {
-                if (key_id != KEY_ID_WIN) { // ignore Win, it only serves as combination in my case
-                    emit(vkbd_fd, EV_KEY, key_id /* key code */, 1 /* press down */);
-                }
-            }
-            emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
-        }
-    };
+    const auto module = modules->fn_owner(key);
+    if (module->api().abi_version != 1) {
+        module->queue_fn_key(key);
+        return;
+    }
+
+    run_fn_action(key, [key, module] { module->api().fn_key_handler_vector(key); });
+}
+
+void airplane_mode(const key_id_t)
+{
+    print_log(DEBUG_LOG, "XDG setting Airplane Mode\n");
+    print_log(WARNING_LOG, "[WARNING] Toggling Airplane Mode not implemented and possibly never plan to. This key lacks practical purpose.\n");
+}
+
+// points the Fn slots at the built-in actions, and the slots in `module_slots` at the modules
+void redirect_fn_keys(halo::core & core, const std::vector<bool> & module_slots)
+{
+    for (const auto key : offset_map | std::views::values) {
+        core.redirect_fn_key(key, nullptr);
+    }
 
-    while (!ctrl_c)
+    core.redirect_fn_key(INVERTED_KEY_AIRPLANEMODE, airplane_mode);
+    core.redirect_fn_key(INVERTED_KEY_SETTINGS, settings);
+    for (std::size_t i = 0; i < module_slots.size(); i++)
     {
+        if (module_slots[i])
         {
-            std::vector<unsigned int> invalid_keys;
-            std::lock_guard guard(g_mutex);
+            const auto key = offset_map.at(static_cast<int>(i));
+            print_log(INFO_LOG, JOURNAL_KEY(key_id_translate(key)), "Redirect fn key ", key_id_translate(key), " towards external mod\n");
+            core.redirect_fn_key(key, module_key);
+        }
+    }
+}
 
-            //////////////////////////////
-            /// FORCE RELEASE ALL KEYS ///
-            //////////////////////////////
-            if (release_all_keys)
-            {
-                print_log(DEBUG_LOG, "Force releasing all keys\n");
-                for (const auto& key_id : pressed_key | std::views::keys)
-                {
-                    emit(vkbd_fd, EV_KEY, key_id /* key code */, 0 /* release */);
-                    emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
-                }
+// SIGHUP: loads the module chain again off the driver loop, check_module_chain_load() swaps it in between two frames,
+// the devices and the core keep their state. A module that fails to load leaves the running chain in place.
+void reload_module(halo::core & core)
+{
+    if (module_specs.empty())
+    {
+        print_log(WARNING_LOG, "[WARNING] No Fn key module loaded, nothing to reload\n");
+        return;
+    }
 
-                invalid_keys.clear();
-                {
-                    std::lock_guard<std::mutex> lock(combination_sp_keys_mutex_);
-                    combination_sp_keys.clear();
-                }
-                no_key_pressed_after_win = false;
-                for (auto & thread : long_pressed_keys)
-                {
-                    thread.running->store(false);
-                    if (thread.thread.joinable()) {
-                        thread.thread.join();
-                    }
-                }
-                pressed_key.clear();
-                release_all_keys = false;
-            }
+    if (!module_host_path.empty())
+    {
+        // a restart while the previous one is still loading starts over
+        if (modhost_starting)
+        {
+            watch_starting_module_host(EPOLL_CTL_DEL);
+            retire(std::exchange(modhost_starting, nullptr));
+        }
 
-            for (auto & [key_id, state] : pressed_key)
-            {
-                ///////////////////////////////////
-                /// KEY PRESS PROCESSING REGION ///
-                ///////////////////////////////////
-                if (!state.normal_press_handled)
-                {
-                    if (state.press_down && SpecialKeys.contains(key_id))
-                    {
-                        const auto sp_key_id = SpecialKeys.at(key_id);
-                        if (sp_key_id == KEY_COMBINATION_ONLY)
-                        {
-                            combination_sp_keys.push_back(key_id);
-                            emit(vkbd_fd, EV_KEY, key_id /* key code */, 1 /* press down */);
-                            emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
-                            state.normal_press_handled = true;
-                            print_log(DEBUG_LOG, "Functional key ", key_id_translate(key_id), " registered\n");
-                        }
-                    }
-                    /////////////////
-                    /// PRESS KEY ///
-                    /////////////////
-                    else if (state.press_down)
-                    {
-                        if (key_id == KEY_ID_WIN) {
-                            std::lock_guard local_guard(combination_sp_keys_mutex_);
-                            combination_sp_keys.push_back(KEY_ID_WIN);
-                            no_key_pressed_after_win = true;
-                            print_log(DEBUG_LOG, "Clear Win key state registered\n");
-                        } else {
-                            if (no_key_pressed_after_win) {
-                                print_log(DEBUG_LOG, "Clear Win key state damaged\n");
-                                no_key_pressed_after_win = false;
-                            }
-                            press_keys_once(key_id);
-                        }
-                        state.normal_press_handled = true;
-                    }
-                    ///////////////////
-                    /// RELEASE KEY ///
-                    ///////////////////
-                    else if(!state.press_down)
-                    {
-                        // remove key
-                        // is the key being long pressed?
-                        const auto it = std::ranges::find_if(long_pressed_keys,
-                            [&](const long_press_struct & ins_state)->bool { return ins_state.key == key_id; });
-                        if (it != long_pressed_keys.end()) { // found thread
-                            *it->running = false;
-                            if (it->thread.joinable()) {
-                                it->thread.join();
-                            }
-
-                            // !! delete reference !!, it is now INVALID
-                            std::erase_if(long_pressed_keys,
-                                [&](const long_press_struct & ins_state)->bool { return ins_state.key == key_id; });
-                        }
+        try {
+            modhost_starting = std::make_shared<module_host>(module_host_path, module_list);
+        } catch (const std::exception & e) {
+            print_log(ERROR_LOG, "Restarting the module host failed, keeping the running one: ", e.what(), "\n");
+            return;
+        }
 
-                        if (key_id == KEY_ID_WIN && no_key_pressed_after_win) {
-                            print_log(DEBUG_LOG, "Clear Win key press on release, executing it NOW\n");
-                            emit(vkbd_fd, EV_KEY, key_id /* key code */, 1 /* press down */);
-                            emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
-                            emit(vkbd_fd, EV_KEY, key_id /* key code */, 0 /* release */);
-                            emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
-                            no_key_pressed_after_win = false;
-                        }
+        modhost_start_deadline = std::chrono::steady_clock::now() + module_host::start_timeout;
+        watch_starting_module_host(EPOLL_CTL_ADD);
+        return;
+    }
 
-                        std::lock_guard<std::mutex> lock(combination_sp_keys_mutex_);
-                        if (std::ranges::find(combination_sp_keys, key_id) != combination_sp_keys.end()) // if this is a functional key
-                        {
-                            print_log(DEBUG_LOG, "Functional key ", key_id_translate(key_id), " released\n");
-                            emit(vkbd_fd, EV_KEY, key_id /* key code */, 0 /* release */);
-                            emit(vkbd_fd, EV_SYN, SYN_REPORT, 0); // sync
-                        }
-                        std::erase(combination_sp_keys, key_id); // this will delete WIN as well
-                        invalid_keys.push_back(key_id);
-                        state.normal_press_handled = true;
-                        print_log(DEBUG_LOG, "Key ", key_id_translate(key_id), " released\n");
-                    }
-                }
+    // a load still in flight finishes on the reaper thread and is let go there
+    module_chain_loading = std::make_shared<module_chain_load_t>();
+    reaper.submit(retired_count++, [load = module_chain_loading, specs = module_specs]
+    {
+        std::shared_ptr < module_chain > chain;
+        std::string error;
+        try {
+            chain = std::make_shared<module_chain>(specs);
+        } catch (const std::exception & e) {
+            error = e.what();
+        }
 
-                ////////////////////////////////////
-                /// LONG PRESS PROCESSING REGION ///
-                ////////////////////////////////////
-                if (const auto time_now = std::chrono::high_resolution_clock::now();
-                    // is the initial key press already handled and still being pressed down?
-                    state.normal_press_handled && state.press_down
-                    // does this key actually support long press?
-                    && std::ranges::find(keys_supporting_long_press, key_id) != keys_supporting_long_press.end()
-                    // no handler actively running for this key
-                    && std::ranges::find_if(long_pressed_keys,
-                        [&](const long_press_struct & ins_state)->bool { return ins_state.key == key_id; }) == long_pressed_keys.end()
-                    // key pressed and escalated for more than 500ms?
-                    && (time_now - state.press_event_reg_time) > std::chrono::milliseconds(500))
-                {
-                    auto long_press_event_handler = [&](const std::atomic_bool * should_i_be_running)->void
-                    {
-                        if constexpr (DEBUG) pthread_setname_np(pthread_self(), ("Long Press " + key_id_translate(key_id)).c_str());
-                        else pthread_setname_np(pthread_self(), "Long Press");
-                        while (*should_i_be_running)
-                        {
-                            press_keys_once(key_id);
-                            std::this_thread::sleep_for(std::chrono::milliseconds(long_press_interval_ms));
-                        }
-                    };
+        {
+            std::lock_guard lock(load->mutex);
+            load->chain = std::move(chain);
+            load->error = std::move(error);
+            load->done = true;
+        }
 
-                    long_pressed_keys.emplace_back((long_press_struct){
-                        .running = std::make_unique<std::atomic_bool>(true),
-                        .key = key_id,
-                    });
+        if (module_chain_loaded_fd != -1)
+        {
+            constexpr uint64_t one = 1;
+            [[maybe_unused]] const auto ignored = write(module_chain_loaded_fd, &one, sizeof(one));
+        }
+    });
+}
 
-                    // create thread:
-                    long_pressed_keys.back().thread = std::thread(long_press_event_handler,
-                        long_pressed_keys.back().running.get());
-                    print_log(DEBUG_LOG, "Created thread for long press key ", key_id_translate(key_id), "\n");
-                }
-            }
+// swaps in the chain reload_module() started loading once it is done
+void check_module_chain_load(halo::core & core)
+{
+    if (!module_chain_loading) {
+        return;
+    }
 
-            for (const auto & inv_slot : invalid_keys) {
-                pressed_key.erase(inv_slot);
-            }
+    std::shared_ptr < module_chain > replacement;
+    {
+        std::lock_guard lock(module_chain_loading->mutex);
+        if (!module_chain_loading->done) {
+            return;
         }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (!module_chain_loading->error.empty()) {
+            print_log(ERROR_LOG, "Reloading Fn key modules failed, keeping the loaded ones: ", module_chain_loading->error, "\n");
+        }
+        replacement = std::move(module_chain_loading->chain);
     }
+    module_chain_loading.reset();
 
-    print_log(INFO_LOG, "Shutting down virtual keyboard...");
-    // shut down any unfinished threads
-    for (auto & thread : long_pressed_keys)
+    if (module_chain_loaded_fd != -1)
     {
-        *thread.running = false;
-        if (thread.thread.joinable()) {
-            thread.thread.join();
-        }
+        uint64_t count = 0;
+        [[maybe_unused]] const auto ignored = read(module_chain_loaded_fd, &count, sizeof(count));
+    }
+
+    if (!replacement) {
+        return;
+    }
+
+    // the old chain may still be draining a demoted module
+    retire(std::exchange(modules, std::move(replacement)));
+    redirect_fn_keys(core, modules->fn_slots());
+    print_log(INFO_LOG, "Reloaded ", module_specs.size(), " Fn key module(s)\n");
+}
+
+// swaps in the host reload_module() started once it is ready, gives up on it if it failed or did not answer in time
+void check_module_host_start(halo::core & core)
+{
+    if (!modhost_starting) {
+        return;
     }
 
+    try
     {
-        std::lock_guard<std::mutex> lock(xdg_thread_pool_mutex);
-        for (auto & thread : xdg_thread_pool)
+        if (!modhost_starting->poll_ready())
         {
-            if (thread.joinable()) {
-                thread.join();
+            if (std::chrono::steady_clock::now() < modhost_start_deadline) {
+                return;
             }
+            throw std::runtime_error("Module host failed to start: no answer");
         }
     }
+    catch (const std::exception & e)
+    {
+        print_log(ERROR_LOG, "Restarting the module host failed, keeping the running one: ", e.what(), "\n");
+        watch_starting_module_host(EPOLL_CTL_DEL);
+        retire(std::exchange(modhost_starting, nullptr));
+        return;
+    }
+
+    watch_starting_module_host(EPOLL_CTL_DEL);
+    watch_module_host(EPOLL_CTL_DEL);
+    // stopping the old host waits for it to exit
+    retire(std::exchange(modhost, std::exchange(modhost_starting, nullptr)));
+    modhost_started = std::chrono::steady_clock::now();
+    watch_module_host(EPOLL_CTL_ADD);
+    redirect_fn_keys(core, modhost->fn_slots());
+    print_log(INFO_LOG, "Restarted the module host on ", module_list, "\n");
+}
+
+// HALO_RT_CHECK_ALLOCS: the core and the device writes must not allocate, which debug builds check.
+// Opt-in, the check only holds for a core that does not allocate per key stroke (see halo_bench)
+bool hot_path_checked = false;
 
-    print_log(INFO_LOG, "done.\n");
+// the driver side of halo::core: its output goes through the module filters to the virtual devices,
+// returns the keyboard frame as written
+std::span < const input_event > emit_output(const halo::output_t & output, const int mouse_fd, const uint64_t now_usec)
+{
+    const auto keyboard = modules ? modules->filter(output.keyboard, now_usec) : output.keyboard;
+    realtime::no_allocations_t guard(hot_path_checked);
+    emit_events(vkbd_fd, keyboard);
+    emit_events(mouse_fd, output.touchpad);
+    return keyboard;
+}
+
+// emit_output(), then the written frame goes to the modules
+void write_output(const halo::output_t & output, const int mouse_fd, const uint64_t now_usec)
+{
+    const auto keyboard = emit_output(output, mouse_fd, now_usec);
+    if (modules) {
+        modules->dispatch(keyboard, now_usec);
+    } else if (modhost) {
+        modhost->dispatch(keyboard, now_usec);
+    }
 }
 
-void touchpad_mouse_handler(const kbd_map & map,
-    const double x, const double y,
-    const unsigned int determined_key,
-    const int mouse_fd,
-    const libinput_event_type type,
-    const int slot,
-    const double touchpad_width, const double touchpad_height,
-    int & next_id)
+// runs one touch through the core, recording latency for touches that typed something
+void handle_touch(halo::core & core, const touch_event_t & touch,
+    const latency::stamp_t ingest_time, const uint64_t now_usec, const int mouse_fd)
 {
-    if (type == LIBINPUT_EVENT_TOUCH_DOWN && (determined_key == BTN_LEFT || determined_key == BTN_RIGHT))
+    const auto output = [&] {
+        realtime::no_allocations_t guard(hot_path_checked);
+        return core.touch(touch, now_usec);
+    }();
+    const auto decision_time = latency::now();
+    const auto keyboard = emit_output(output, mouse_fd, now_usec);
+
+    if (!output.keyboard.empty())
     {
-        emit(mouse_fd, EV_ABS, ABS_MT_SLOT, slot);
-        emit(mouse_fd, EV_KEY, determined_key, 1);
-        emit(mouse_fd, EV_SYN, SYN_REPORT, 0); // sync
-        emit(mouse_fd, EV_KEY, determined_key, 0);
-        emit(mouse_fd, EV_SYN, SYN_REPORT, 0); // sync
-        print_log(DEBUG_LOG, "TouchPad ", key_id_translate(determined_key), " key pressed\n");
-    }
-    else if (determined_key == 512 || type == LIBINPUT_EVENT_TOUCH_UP)
+        const auto touch_time = latency::from_usec(touch.time_usec);
+        const auto emit_time = latency::now();
+        latency::record(latency::STAGE_INGEST, touch_time, ingest_time);
+        latency::record(latency::STAGE_DECISION, ingest_time, decision_time);
+        latency::record(latency::STAGE_EMIT, decision_time, emit_time);
+        latency::record(latency::STAGE_TOTAL, touch_time, emit_time);
+    }
+
+    // modules see the frame after it was typed, outside of the measured latency
+    if (modules) {
+        modules->dispatch(keyboard, now_usec);
+    } else if (modhost) {
+        modhost->dispatch(keyboard, now_usec);
+    }
+}
+
+// pushes a recorded touch stream through the key resolution code,
+// writing a text trace of the generated events instead of touching /dev/uinput
+int replay_touch_stream(halo::core & core, const std::string & recording)
+{
+    const auto records = read_touch_records(recording);
+
+    std::string mode = "realtime";
+    if (const auto mode_env = std::getenv("HALO_REPLAY_MODE"); mode_env != nullptr) {
+        mode = mode_env;
+    }
+
+    if (mode != "realtime" && mode != "fast") {
+        print_log(ERROR_LOG, "Unknown replay mode \"", mode, "\", expected realtime or fast\n");
+        throw std::runtime_error("Unknown replay mode");
+    }
+
+    std::string trace_path = "/dev/null";
+    if (const auto trace_env = std::getenv("HALO_REPLAY_TRACE"); trace_env != nullptr) {
+        trace_path = trace_env;
+    }
+
+    const int trace_fd = open(trace_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        throw std::runtime_error("Unable to open replay trace " + trace_path);
+    }
+    const int mouse_fd = dup(trace_fd);
+    emit_trace_device(trace_fd, "kbd");
+    emit_trace_device(mouse_fd, "mouse");
+    vkbd_fd = trace_fd;
+
+    print_log(INFO_LOG, "Replaying ", records.size(), " touch events from ", recording, " (", mode, ") into ", trace_path, "\n");
+
+    // fast replays run the core on the recorded timeline without waiting for it
+    halo::monotonic_clock monotonic;
+    const uint64_t replay_start_usec = monotonic.now_usec();
+    halo::virtual_clock timeline(replay_start_usec);
+    halo::clock & clock = mode == "fast" ? static_cast<halo::clock &>(timeline) : monotonic;
+    const auto sink = [mouse_fd, &clock](const halo::output_t & output) { write_output(output, mouse_fd, clock.now_usec()); };
+
+    const uint64_t first_usec = records.empty() ? 0 : records.front().time_usec;
+    for (auto touch : records)
     {
-        const auto new_y = std::max(800 - static_cast<int>((x - map.at(512).key_pixel_top_left_x)
-            / static_cast<double>(touchpad_width) * 800), 0);
-        const auto new_x = std::max(static_cast<int>((y - map.at(512).key_pixel_top_left_y)
-            / static_cast<double>(touchpad_height) * 1280), 0);
-
-        /* 0. choose slot FIRST (always, even if it stays 0) */
-        emit(mouse_fd, EV_ABS, ABS_MT_SLOT, slot);
-
-        /* 1. contact bookkeeping */
-        if (type == LIBINPUT_EVENT_TOUCH_DOWN) {
-            emit(mouse_fd, EV_ABS, ABS_MT_TRACKING_ID, next_id++);
-            emit(mouse_fd, EV_KEY, BTN_TOUCH,          1);
-            emit(mouse_fd, EV_KEY, BTN_TOOL_FINGER,    1);
-            emit(mouse_fd, EV_ABS, ABS_MT_PRESSURE, 128);
-        } else if (type == LIBINPUT_EVENT_TOUCH_UP) {
-            emit(mouse_fd, EV_ABS, ABS_MT_PRESSURE, 0);
-            emit(mouse_fd, EV_ABS, ABS_MT_TRACKING_ID, -1);
-            emit(mouse_fd, EV_KEY, BTN_TOUCH,          0);
-            emit(mouse_fd, EV_KEY, BTN_TOOL_FINGER,    0);
-        }
-
-        /* 2. coordinates while finger is down */
-        if (type != LIBINPUT_EVENT_TOUCH_UP) {
-            emit(mouse_fd, EV_ABS, ABS_MT_POSITION_X, new_x);
-            emit(mouse_fd, EV_ABS, ABS_MT_POSITION_Y, new_y);
-
-            /* mirror slot-0 to single-touch axes */
-            if (slot == 0) {
-                emit(mouse_fd, EV_ABS, ABS_X, new_x);
-                emit(mouse_fd, EV_ABS, ABS_Y, new_y);
-            }
+        if (ctrl_c) {
+            break;
         }
 
-        /* 3. flush the packet */
-        emit(mouse_fd, EV_SYN, SYN_REPORT, 0);
-        print_log(DEBUG_LOG, "TouchPad movement (", x, ", ", y, ") mapped to (", new_x, ", ", new_y, "), slot=", slot, "\n");
+        if (module_reload_requested.exchange(false)) {
+            reload_module(core);
+        }
+        check_module_host_start(core);
+        check_module_chain_load(core);
+
+        // rebase the recorded kernel timestamps onto this run, so latency stays meaningful
+        const uint64_t touch_usec = touch.time_usec - first_usec + replay_start_usec;
+        halo::run_until(core, clock, touch_usec, sink);
+
+        const auto ingest_time = latency::now();
+        touch.time_usec = mode == "fast" ? ingest_time / 1000 : touch_usec;
+        handle_touch(core, touch, ingest_time, clock.now_usec(), mouse_fd);
+        if (modhost) {
+            modhost->service(vkbd_fd);
+        }
     }
+
+    const auto elapsed_us = monotonic.now_usec() - replay_start_usec;
+    print_log(INFO_LOG, "Replayed ", records.size(), " touch events in ", elapsed_us, "us\n");
+    fn_workers.stop();
+    modules.reset();
+    modhost.reset();
+    modhost_starting.reset();
+    module_chain_loading.reset();
+    reaper.stop();
+    latency::dump();
+    close(mouse_fd);
+    close(trace_fd);
+    return EXIT_SUCCESS;
 }
 
 static int open_restricted(const char *path, int flags, void *user_data) {
@@ -492,10 +586,60 @@ static const libinput_interface interface =
     .close_restricted = close_restricted,
 };
 
-const fs::path LockFilePath = "/tmp/.HaloKeyboard.lock";
+// a disabled device is closed by libinput, so its touches do not even wake the driver loop
+void set_device_enabled(libinput_device * device, const bool enabled)
+{
+    if (libinput_device_config_send_events_set_mode(device,
+            enabled ? LIBINPUT_CONFIG_SEND_EVENTS_ENABLED : LIBINPUT_CONFIG_SEND_EVENTS_DISABLED) != LIBINPUT_CONFIG_STATUS_SUCCESS)
+    {
+        print_log(WARNING_LOG, "[WARNING] libinput cannot turn ", libinput_device_get_name(device), enabled ? " on" : " off",
+            ", its touches are dropped instead\n");
+    }
+}
+
+bool is_halo_panel(libinput_device * device)
+{
+    return libinput_device_get_id_vendor(device) == 1046 && libinput_device_get_id_product(device) == 9110;
+}
+
+// one driver per panel: an flock(2) on the lock file, held by its open file, so the kernel drops it
+// however the process ends and a successor taking over the devices gets it along with them
+int lock_fd = -1;
+
+// only informative, the lock is the flock
+void write_lock_owner(const int fd)
+{
+    const auto pid = std::to_string(getpid()) + "\n";
+    if (ftruncate(fd, 0) == -1 || pwrite(fd, pid.data(), pid.size(), 0) == -1) {
+        print_log(WARNING_LOG, "[WARNING] Cannot write pid to the lock file\n");
+    }
+}
+
+int acquire_instance_lock(const fs::path & path)
+{
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("Cannot open lock file " + path.string() + ": " + strerror(errno));
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+    {
+        char owner[32] { };
+        [[maybe_unused]] const auto ignored = pread(fd, owner, sizeof(owner) - 1, 0);
+        close(fd);
+        print_log(ERROR_LOG, "\n[ERROR] Another instance (pid=", std::strtol(owner, nullptr, 10), ") holds ", path.string(), "\n");
+        throw std::runtime_error("Another instance is running");
+    }
+
+    write_lock_owner(fd);
+    return fd;
+}
 
 int main(int argc, char** argv)
 {
+    const auto start_time = std::chrono::steady_clock::now();
     try
     {
         print_log(INFO_LOG, "Halo Keyboard and TouchPad userspace driver [BuildID=", BUILD_ID, ", BuildTime=", BUILD_TIME, "] version " VERSION "\n");
@@ -516,36 +660,41 @@ int main(int argc, char** argv)
             }
         };
 
-        std::unique_ptr <Module> fnmod;
         auto remap_fn_keys = [&]()->void
         {
-            std::string mod_path = argv[3];
-            std::vector <bool> modMap;
-            fnmod = std::make_unique<Module>(mod_path, modMap);
-            print_log(INFO_LOG, "Loaded Fn Key handler ", mod_path, "\n");
+            uint64_t budget_usec = 200;
+            if (const auto budget_env = std::getenv("HALO_MODULE_BUDGET_US"); budget_env != nullptr) {
+                budget_usec = std::strtoull(budget_env, nullptr, 10);
+            }
 
-            auto redirect = [&](const key_id_t redirect_key)-> void
+            module_specs = module_chain::parse(argv[3], budget_usec);
+            if (const auto host_env = std::getenv("HALO_MODULE_HOST"); host_env != nullptr && *host_env != '\0')
             {
-                for (auto & [key, handler] : fn_key_invert_handler_map | std::views::values)
-                {
-                    if (key != INVERTED_KEY_FNLOCK && key == redirect_key) // cannot override internal fn_lock logic
-                    {
-                        handler = (inverted_key_map_handler)(dlsym(fnmod->get_handler(), "fn_key_handler_vector"));
-                        assert_throw(handler != nullptr);
-                    }
-                }
-            };
+                module_host_path = host_env;
+                module_list = argv[3];
+                // startup may wait, the driver loop is not running yet
+                const auto host = std::make_shared<module_host>(module_host_path, module_list);
+                host->wait_ready(module_host::start_timeout);
+                modhost = host;
+                modhost_started = std::chrono::steady_clock::now();
+                print_log(INFO_LOG, "Loaded Fn Key handler ", argv[3], " in module host ", module_host_path, "\n");
+                return;
+            }
+
+            modules = std::make_shared<module_chain>(module_specs);
+            print_log(INFO_LOG, "Loaded Fn Key handler ", argv[3], "\n");
+        };
 
-            for (int i = 0; i < modMap.size(); i++)
+        // Fn lock state and Fn key handlers of the driver, applied once the core exists
+        auto configure_core = [&](halo::core & core)->void
+        {
+            if (fn_press)
             {
-                if (modMap.at(i))
-                {
-                    const auto key = offset_map.at(i);
-                    print_log(INFO_LOG, "Redirect fn key ", key_id_translate(key), " towards external mod\n");
-                    redirect(key);
-                }
+                print_log(DEBUG_LOG, "Fn has initialization condition as pressed\n");
+                core.set_fn_lock(true);
             }
 
+            redirect_fn_keys(core, modules ? modules->fn_slots() : modhost ? modhost->fn_slots() : std::vector<bool>());
         };
 
         if (argc == 3)
@@ -563,23 +712,70 @@ int main(int argc, char** argv)
             return EXIT_FAILURE;
         }
 
-        print_log(INFO_LOG, "Creating lock file...");
-        if (fs::exists(LockFilePath)) {
-            print_log(ERROR_LOG, "\n[ERROR] Lock file exists. If you believe this is an error, remove the file /tmp/.HaloKeyboard.lock\n");
-            throw std::runtime_error("Lock file exists");
-        }
-        else
+        const auto realtime_config = realtime::from_env();
+        const char * replay_path = std::getenv("HALO_REPLAY");
+        if (replay_path != nullptr)
         {
-            std::ofstream ofs(LockFilePath);
-            if (!ofs) {
-                print_log(ERROR_LOG, "Failed to create lock file\n");
-                throw std::runtime_error("Lock file exists");
+            std::signal(SIGINT, sigint_handler);
+            std::signal(SIGUSR1, sigusr1_handler);
+            std::signal(SIGHUP, sighup_handler);
+            std::ifstream ifs(argv[1]);
+            if (!ifs.is_open()) {
+                print_log(ERROR_LOG, "Unable to open file\n");
+                throw std::runtime_error("Unable to open file");
+            }
+            const auto map = read_key_map(ifs);
+            halo::core core(map);
+            configure_core(core);
+            if (realtime_config.policy != realtime::OFF)
+            {
+                realtime::enter(realtime_config);
+                hot_path_checked = realtime_config.check_allocations;
             }
-            ofs.close();
+            return replay_touch_stream(core, replay_path);
+        }
+
+        // HALO_HANDOVER=1: the lock belongs to the instance handing over, it is ours once it did
+        const char * handover_env = std::getenv("HALO_HANDOVER");
+        const bool takeover = handover_env != nullptr && std::string(handover_env) == "1";
+
+        fs::path lock_path = "/run/halo_kbd/halo_kbd.lock";
+        if (const auto lock_env = std::getenv("HALO_LOCK_FILE"); lock_env != nullptr) {
+            lock_path = lock_env;
+        }
+
+        print_log(INFO_LOG, "Acquiring instance lock...");
+        if (takeover) {
+            print_log(INFO_LOG, "skipped, it comes with the devices.\n");
+        } else {
+            lock_fd = acquire_instance_lock(lock_path);
             print_log(INFO_LOG, "done.\n");
         }
 
         std::signal(SIGINT, sigint_handler);
+        std::signal(SIGUSR1, sigusr1_handler);
+        std::signal(SIGUSR2, sigusr2_handler);
+        std::signal(SIGHUP, sighup_handler);
+
+        // sockets from systemd socket activation: "handover" (halo_vkbd.socket), "metrics" (halo_vkbd-metrics.socket)
+        const auto activated_fds = readiness::listen_fds();
+
+        std::string metrics_path = "/run/halo_kbd/metrics";
+        if (const auto metrics_env = std::getenv("METRICS_FILE"); metrics_env != nullptr) {
+            metrics_path = metrics_env;
+        }
+
+        if (!metrics_path.empty() && metrics_path != "none")
+        {
+            print_log(INFO_LOG, "Writing metrics to ", metrics_path, "\n");
+            metrics::start_writer(metrics_path, std::chrono::seconds(5));
+        }
+
+        if (const auto metrics_socket = activated_fds.find("metrics"); metrics_socket != activated_fds.end())
+        {
+            print_log(INFO_LOG, "Serving metrics on the socket passed by systemd\n");
+            metrics::start_server(metrics_socket->second);
+        }
 
         print_log(INFO_LOG, "Loading keymap...", '\n');
 
@@ -593,14 +789,25 @@ int main(int argc, char** argv)
         const auto map = read_key_map(ifs);
         print_log(INFO_LOG, "done.\n");
 
-        // init linux input
-        print_log(INFO_LOG, "Initializing Linux input interface for virtual keyboard...");
-        vkbd_fd = init_linux_input(map);
-        print_log(INFO_LOG, "done.\n");
+        std::unique_ptr<touch_recorder> recorder;
+        if (const auto record_env = std::getenv("HALO_RECORD"); record_env != nullptr)
+        {
+            print_log(INFO_LOG, "Recording touch stream to ", record_env, "\n");
+            recorder = std::make_unique<touch_recorder>(record_env);
+        }
 
-        print_log(INFO_LOG, "Initializing Linux input interface for virtual mouse...");
-        int mouse_fd = init_linux_mouse_input();
-        print_log(INFO_LOG, "done.\n");
+        // init linux input, unless the devices are taken over from the running instance further down
+        int mouse_fd = -1;
+        if (!takeover)
+        {
+            print_log(INFO_LOG, "Initializing Linux input interface for virtual keyboard...");
+            vkbd_fd = init_linux_input(map);
+            print_log(INFO_LOG, "done.\n");
+
+            print_log(INFO_LOG, "Initializing Linux input interface for virtual mouse...");
+            mouse_fd = init_linux_mouse_input();
+            print_log(INFO_LOG, "done.\n");
+        }
 
         // load keyboard touchpad
         libinput *li = nullptr;
@@ -612,7 +819,7 @@ int main(int argc, char** argv)
         li = libinput_udev_create_context(&interface, nullptr, udev);
         if (!li) {
             print_log(ERROR_LOG, "Failed to create libinput context\n");
-            return EXIT_FAILURE;
+            throw std::runtime_error("Failed to create libinput context");
         }
 
         // 2. assign seat
@@ -623,95 +830,237 @@ int main(int argc, char** argv)
         print_log(DEBUG_LOG, "    => File descriptor for device input is ", halo_device_fd, "\n");
         print_log(INFO_LOG, "done.\n");
 
-        // start virtual keyboard handling thread
         print_log(INFO_LOG, "Initializing virtual keyboard...");
-        std::thread virtual_kbd_worker(emit_key_thread);
+        halo::core core(map);
+        configure_core(core);
         print_log(INFO_LOG, "done.\n");
 
-        pollfd pfd = { halo_device_fd, POLLIN, 0 };
+        halo::monotonic_clock clock;
+        loop_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        assert_throw(loop_epoll_fd != -1);
+        {
+            epoll_event ev { .events = EPOLLIN, .data = { .ptr = nullptr } };
+            assert_throw(epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, halo_device_fd, &ev) == 0);
+        }
+        session_helper.watch(loop_epoll_fd, &session_helper);
+        watch_module_host(EPOLL_CTL_ADD);
+        if (modules)
+        {
+            module_chain_loaded_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            assert_throw(module_chain_loaded_fd != -1);
+            epoll_event ev { .events = EPOLLIN, .data = { .ptr = &module_chain_loaded_fd } };
+            assert_throw(epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, module_chain_loaded_fd, &ev) == 0);
+        }
 
-        print_log(INFO_LOG, "Main loop started, end handler by sending SIGINT(2) to current process (pid=", getpid(), ").\n");
+        // the running instance hands over once the panel is released, its touches are not handled again
+        uint64_t handover_cutoff_usec = 0;
+        if (takeover)
+        {
+            print_log(INFO_LOG, "Taking over the virtual devices from the running instance...");
+            const auto devices = handover::take_over(handover::socket_path(), std::chrono::seconds(10));
+            vkbd_fd = devices.vkbd_fd;
+            mouse_fd = devices.mouse_fd;
+            lock_fd = devices.lock_fd;
+            write_lock_owner(lock_fd);
+            core.restore({ .fn_lock = devices.state.fn_lock != 0, .next_tracking_id = devices.state.next_tracking_id });
+            handover_cutoff_usec = devices.state.last_touch_usec;
+            print_log(INFO_LOG, "done.\n");
+        }
+        else
+        {
+            // typed keys are lost until udev has set up the virtual devices
+            readiness::wait_for_uinput(udev, { vkbd_fd, mouse_fd }, std::chrono::seconds(2));
+        }
+
+        // a handover request waits for the panel to be released, for 2s at most
+        std::unique_ptr<handover::server> handover_server;
+        uint64_t handover_deadline_usec = halo::no_deadline;
+        uint64_t last_touch_usec = handover_cutoff_usec;
+        bool handed_over = false;
+        try
+        {
+            if (const auto activated = activated_fds.find("handover"); activated != activated_fds.end()) {
+                handover_server = std::make_unique<handover::server>(handover::socket_path(), activated->second);
+            } else {
+                handover_server = std::make_unique<handover::server>(handover::socket_path());
+            }
+            epoll_event ev { .events = EPOLLIN, .data = { .ptr = handover_server.get() } };
+            assert_throw(epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, handover_server->fd(), &ev) == 0);
+        } catch (const std::exception & e) {
+            print_log(WARNING_LOG, "[WARNING] ", e.what(), ", restarts will recreate the devices\n");
+            handover_server.reset();
+        }
+
+        // systemd learns the driver is up once libinput reported the panel, or after HALO_PANEL_TIMEOUT_MS
+        // without it, in which case typing starts whenever the panel shows up
+        uint64_t panel_timeout_ms = 5000;
+        if (const auto timeout_env = std::getenv("HALO_PANEL_TIMEOUT_MS"); timeout_env != nullptr) {
+            panel_timeout_ms = std::strtoull(timeout_env, nullptr, 10);
+        }
+        bool ready_notified = false;
+        const uint64_t panel_deadline_usec = clock.now_usec() + panel_timeout_ms * 1000;
+        const auto notify_ready = [&](const std::string & status)
+        {
+            const auto startup_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count();
+            print_log(INFO_LOG, status, " after ", startup_ms, "ms\n");
+            readiness::notify("READY=1\nSTATUS=" + status);
+            ready_notified = true;
+        };
 
-        std::map < key_id_t /* key */, std::chrono::time_point<std::chrono::high_resolution_clock> > time_of_the_last_press_event;
-        std::map < unsigned int /* slot */, key_id_t > slot_to_key_id_map;
-        int reset_key_counter = 0;
-        auto reset_counter = [&]()->void {
-            release_all_keys = false;
-            reset_key_counter = 0;
+        // folded into tablet mode, the panel faces away and every touch on it is a phantom key:
+        // what is held gets released, libinput stops reading the panel and the metrics writer stops waking up,
+        // so the process sleeps until the Yoga Book is unfolded. libinput reports a switch that is already on
+        // right after the switch device is added
+        libinput_device * halo_panel = nullptr;
+        bool tablet_mode = false;
+        const auto set_tablet_mode = [&](const bool folded)
+        {
+            if (folded == tablet_mode) {
+                return;
+            }
+
+            tablet_mode = folded;
+            if (folded) {
+                write_output(core.lift_all(), mouse_fd, clock.now_usec());
+            }
+            if (halo_panel != nullptr) {
+                set_device_enabled(halo_panel, !folded);
+            }
+            metrics::park_writer(folded);
+            print_log(INFO_LOG, folded ? "Folded into tablet mode, Halo keyboard off\n" : "Unfolded, Halo keyboard on\n");
         };
 
-        auto append_when_fit = [&](const key_id_t id)->void
+        // the worker, log and metrics threads are running by now and stay at normal priority
+        if (realtime_config.policy != realtime::OFF)
+        {
+            realtime::enter(realtime_config);
+            hot_path_checked = realtime_config.check_allocations;
+        }
+
+        print_log(INFO_LOG, "Main loop started, end handler by sending SIGINT(2) to current process (pid=", getpid(), ").\n");
+
+        while (!ctrl_c)
         {
-            bool fail = false;
-            switch (reset_key_counter)
+            if (latency::dump_requested.exchange(false)) {
+                latency::dump();
+            }
+
+            if (module_reload_requested.exchange(false)) {
+                reload_module(core);
+            }
+            check_module_host_start(core);
+            check_module_chain_load(core);
+
+            if (upgrade_requested.exchange(false))
             {
-            case 0:
-                {
-                    if (id == KEY_ID_LCTRL) {
-                        reset_key_counter++;
-                    } else {
-                        fail = true;
-                    }
+                if (const pid_t successor = handover::spawn_successor(argv, activated_fds); successor != -1) {
+                    print_log(INFO_LOG, "Started ", argv[0], " (pid=", successor, ") to take over\n");
                 }
-                break;
-            case 1:
-                {
-                    if (id == KEY_ID_LALT) {
-                        reset_key_counter++;
-                    } else {
-                        fail = true;
-                    }
-                }
-                break;
-            case 2:
+            }
+
+            if (handover_server) {
+                handover_server->expire_connection();
+            }
+
+            if (handover_server && handover_server->pending() && (core.idle() || clock.now_usec() >= handover_deadline_usec))
+            {
+                if (!core.idle())
                 {
-                    if (id == KEY_ID_TAB) {
-                        reset_key_counter++;
-                    } else {
-                        fail = true;
-                    }
+                    print_log(WARNING_LOG, "[WARNING] Panel still held, releasing everything before the handover\n");
+                    write_output(core.lift_all(), mouse_fd, clock.now_usec());
                 }
-                break;
-            default:
+
+                const auto snapshot = core.snapshot();
+                const handover::state_t state {
+                    .magic = handover::magic,
+                    .fn_lock = snapshot.fn_lock,
+                    .next_tracking_id = snapshot.next_tracking_id,
+                    .reserved = 0,
+                    .last_touch_usec = last_touch_usec,
+                };
+                if (handover_server->hand_over(vkbd_fd, mouse_fd, lock_fd, state, std::chrono::seconds(2)))
                 {
-                    fail = true;
+                    print_log(INFO_LOG, "Handed the virtual devices over to pid ", handover_server->successor(), ", exiting\n");
+                    // before exiting, or systemd would count the service as stopped
+                    readiness::notify("MAINPID=" + std::to_string(handover_server->successor()));
+                    handed_over = true;
+                    break;
                 }
-                break;
+
+                print_log(WARNING_LOG, "[WARNING] Handover was not confirmed, carrying on\n");
+                handover_deadline_usec = halo::no_deadline;
             }
 
-            if (fail)
-            {
-                reset_counter();
+            if (!ready_notified && clock.now_usec() >= panel_deadline_usec) {
+                notify_ready("Halo panel not found yet, running");
             }
 
-            if (reset_key_counter == 3)
+            // sleep until libinput_fd or the session helper is ready, or until the next long press repeat is due
+            uint64_t deadline_usec = std::min(core.next_deadline(), handover_deadline_usec);
+            if (!ready_notified) {
+                deadline_usec = std::min(deadline_usec, panel_deadline_usec);
+            }
+            if (modhost_starting)
             {
-                if constexpr (DEBUG) print_log(DEBUG_LOG, "===> [LCtrl+LAlt+Tab]: Key pressed for release ALL keys <===\n");
-                else print_log(INFO_LOG, "===> Combination for immediate reset keyboard (LCtrl+LAlt+Tab) invoked <===\n");
-                release_all_keys = true;
+                const auto left = std::chrono::duration_cast<std::chrono::microseconds>(modhost_start_deadline - std::chrono::steady_clock::now());
+                deadline_usec = std::min(deadline_usec, clock.now_usec() + static_cast<uint64_t>(std::max<int64_t>(left.count(), 0)));
+            }
+            if (handover_server && handover_server->connecting())
+            {
+                const auto left = std::chrono::duration_cast<std::chrono::microseconds>(handover_server->request_deadline() - std::chrono::steady_clock::now());
+                deadline_usec = std::min(deadline_usec, clock.now_usec() + static_cast<uint64_t>(std::max<int64_t>(left.count(), 0)));
+            }
+            const bool ready = clock.wait(loop_epoll_fd, deadline_usec);
+            const uint64_t now_usec = clock.now_usec();
+            const auto ticked = [&] {
+                realtime::no_allocations_t guard(hot_path_checked);
+                return core.tick(now_usec);
+            }();
+            write_output(ticked, mouse_fd, now_usec);
+            if (!ready || ctrl_c) {
+                continue;
             }
-        };
-
-        std::this_thread::sleep_for(std::chrono::milliseconds(500));
-
-        /*
-         * init key press conditions
-         */
-
-        if (fn_press)
-        {
-            print_log(DEBUG_LOG, "Fn has initialization condition as pressed\n");
-            fn_lock(0);
-        }
-
-        int next_id = 0;
-        const auto touchpad_width = map.at(512).key_pixel_bottom_right_x - map.at(512).key_pixel_top_left_x;
-        const auto touchpad_height = map.at(512).key_pixel_bottom_right_y - map.at(512).key_pixel_top_left_y;
 
-        while (!ctrl_c)
-        {
-            // wait until libinput_fd is ready
-            if (poll(&pfd, 1, -1) <= 0) {
+            // libinput is registered without a pointer, the session helper with its client
+            epoll_event ready_events[8];
+            const int ready_count = epoll_wait(loop_epoll_fd, ready_events, 8, 0);
+            bool touch_ready = false;
+            for (int i = 0; i < ready_count; i++)
+            {
+                if (ready_events[i].data.ptr == nullptr) {
+                    touch_ready = true;
+                } else if (ready_events[i].data.ptr == &session_helper) {
+                    session_helper.service();
+                } else if (handover_server && ready_events[i].data.ptr == handover_server.get()) {
+                    if (const int connection = handover_server->accept_connection(); connection != -1)
+                    {
+                        epoll_event ev { .events = EPOLLIN, .data = { .ptr = &handover_connection_tag } };
+                        assert_throw(epoll_ctl(loop_epoll_fd, EPOLL_CTL_ADD, connection, &ev) == 0);
+                    }
+                } else if (handover_server && ready_events[i].data.ptr == &handover_connection_tag) {
+                    // closing a dropped connection takes it off the loop, a pending one stays open
+                    if (const int connection = handover_server->connection_fd(); handover_server->read_request())
+                    {
+                        assert_throw(epoll_ctl(loop_epoll_fd, EPOLL_CTL_DEL, connection, nullptr) == 0);
+                        print_log(INFO_LOG, "Handover requested, waiting for the panel to be released\n");
+                        handover_deadline_usec = now_usec + 2000000;
+                    }
+                } else if (ready_events[i].data.ptr == &module_chain_loaded_fd) {
+                    check_module_chain_load(core);
+                } else if (ready_events[i].data.ptr == &modhost_starting_tag) {
+                    check_module_host_start(core);
+                } else if (ready_events[i].data.ptr == &modhost_notify_tag) {
+                    modhost->service(vkbd_fd);
+                } else if (ready_events[i].data.ptr == &modhost_exit_tag) {
+                    // a host that crashes right after its start is left down until the next SIGHUP
+                    print_log(WARNING_LOG, "[WARNING] Module host ", modhost->reap(), "\n");
+                    assert_throw(epoll_ctl(loop_epoll_fd, EPOLL_CTL_DEL, modhost->exit_fd(), nullptr) == 0);
+                    if (std::chrono::steady_clock::now() - modhost_started > std::chrono::seconds(5)) {
+                        reload_module(core);
+                    }
+                }
+            }
+            if (!touch_ready) {
                 continue;
             }
 
@@ -722,149 +1071,146 @@ int main(int argc, char** argv)
             while ((ev = libinput_get_event(li)))
             {
                 const auto type = libinput_event_get_type(ev);
-                if (type == LIBINPUT_EVENT_TOUCH_DOWN
+                if (type == LIBINPUT_EVENT_DEVICE_ADDED)
+                {
+                    // user data holds the metrics slot of the device, plus one
+                    libinput_device *dev = libinput_event_get_device(ev);
+                    const auto slot = metrics::register_device(libinput_device_get_name(dev));
+                    libinput_device_set_user_data(dev, reinterpret_cast<void *>(static_cast<uintptr_t>(slot) + 1));
+                    if (is_halo_panel(dev))
+                    {
+                        if (halo_panel == nullptr) {
+                            halo_panel = libinput_device_ref(dev);
+                        }
+                        if (tablet_mode) {
+                            set_device_enabled(halo_panel, false);
+                        }
+                        if (!ready_notified) {
+                            notify_ready("Halo panel ready");
+                        }
+                    }
+                }
+                else if (type == LIBINPUT_EVENT_DEVICE_REMOVED)
+                {
+                    libinput_device *dev = libinput_event_get_device(ev);
+                    if (dev == halo_panel) {
+                        libinput_device_unref(halo_panel);
+                        halo_panel = nullptr;
+                    }
+                    // without its switch, nothing would ever turn the keyboard back on
+                    if (libinput_device_has_capability(dev, LIBINPUT_DEVICE_CAP_SWITCH)
+                        && libinput_device_switch_has_switch(dev, LIBINPUT_SWITCH_TABLET_MODE) == 1) {
+                        set_tablet_mode(false);
+                    }
+                }
+                else if (type == LIBINPUT_EVENT_SWITCH_TOGGLE)
+                {
+                    libinput_event_switch *sev = libinput_event_get_switch_event(ev);
+                    if (libinput_event_switch_get_switch(sev) == LIBINPUT_SWITCH_TABLET_MODE) {
+                        set_tablet_mode(libinput_event_switch_get_switch_state(sev) == LIBINPUT_SWITCH_STATE_ON);
+                    }
+                }
+                else if (type == LIBINPUT_EVENT_TOUCH_DOWN
                     || type == LIBINPUT_EVENT_TOUCH_UP
                     || type == LIBINPUT_EVENT_TOUCH_MOTION)
                 {
+                    const latency::stamp_t ingest_time = latency::now();
                     libinput_event_touch *tev =
                         libinput_event_get_touch_event(ev);
 
                     libinput_device *dev = libinput_event_get_device(ev);
+                    metrics::add(metrics::TOUCH_EVENTS);
+                    if (const auto slot = reinterpret_cast<uintptr_t>(libinput_device_get_user_data(dev)); slot != 0) {
+                        metrics::add_device_event(static_cast<unsigned>(slot - 1));
+                    }
                     unsigned vendor = libinput_device_get_id_vendor(dev);
                     unsigned product = libinput_device_get_id_product(dev);
                     const char *name = libinput_device_get_name(dev);
                     if (vendor != 1046 || product != 9110) {
                         print_log(DEBUG_LOG, "Device ", name, " (", vendor, ":", product, ") not recognized as Halo keyboard, ignored\n");
+                        libinput_event_destroy(ev);
                         continue; // skipped the loop
                     }
 
-                    const int32_t slot = libinput_event_touch_get_seat_slot(tev);
-                    double x = 0.00f, y = 0.00f;
-                    if (type != LIBINPUT_EVENT_TOUCH_UP) {
-                        x = libinput_event_touch_get_x_transformed(tev, 1920);
-                        y = libinput_event_touch_get_y_transformed(tev, 2400);
+                    // queued before libinput let go of the panel, or libinput could not let go of it
+                    if (tablet_mode) {
+                        libinput_event_destroy(ev);
+                        continue;
                     }
 
-                    long determined_key = -1;
-                    // determine the key (fucking just iterate through)
-                    for (const auto & [key, location] : map)
-                    {
-                        if (is_this_within_key_location(x, y, location)) {
-                            determined_key = key;
-                            break;
-                        }
+                    touch_event_t touch {
+                        .time_usec = libinput_event_touch_get_time_usec(tev),
+                        .slot = libinput_event_touch_get_seat_slot(tev),
+                        .type = type,
+                        .x = 0.00f,
+                        .y = 0.00f,
+                    };
+                    if (type != LIBINPUT_EVENT_TOUCH_UP) {
+                        touch.x = libinput_event_touch_get_x_transformed(tev, 1920);
+                        touch.y = libinput_event_touch_get_y_transformed(tev, 2400);
                     }
 
-                    if (determined_key != -1 || type == LIBINPUT_EVENT_TOUCH_UP)
-                    {
-                        // mouse event
-                        if ((determined_key == KEY_ID_MOUSELEFT
-                            || determined_key == KEY_ID_MOUSERIGHT
-                            || determined_key == KEY_ID_TOUCHPAD)
-                            || (type == LIBINPUT_EVENT_TOUCH_UP && slot_to_key_id_map.contains(slot)
-                                && (slot_to_key_id_map.at(slot) == KEY_ID_MOUSELEFT
-                                    || slot_to_key_id_map.at(slot) == KEY_ID_MOUSERIGHT
-                                    || slot_to_key_id_map.at(slot) == KEY_ID_TOUCHPAD)
-                            ))
-                        {
-                            if (type == LIBINPUT_EVENT_TOUCH_UP) {
-                                if (slot_to_key_id_map.contains(slot)) slot_to_key_id_map.erase(slot);
-                            } else {
-                                slot_to_key_id_map.emplace(slot, determined_key);
-                            }
-                            touchpad_mouse_handler(map, x, y, determined_key, mouse_fd, type, slot, touchpad_width, touchpad_height, next_id);
-                        }
-                        // key release
-                        else if (type == LIBINPUT_EVENT_TOUCH_UP)
-                        {
-                            if (const auto key_id = slot_to_key_id_map.contains(slot) ? slot_to_key_id_map.at(slot) : -1; key_id != -1)
-                            {
-                                if (slot_to_key_id_map.contains(slot)) slot_to_key_id_map.erase(slot);
-                                print_log(DEBUG_LOG, "Key ", key_id_translate(key_id), " (", key_id, ") release registered, slot=", slot, "\n");
-
-                                std::lock_guard<std::mutex> lock(g_mutex);
-                                if (const auto it = pressed_key.find(key_id);
-                                    it != pressed_key.end())
-                                {
-                                    // reset "release all keys" counter
-                                    if (key_id == KEY_ID_LCTRL || key_id == KEY_ID_LALT || key_id == KEY_ID_TAB)
-                                    {
-                                        reset_counter();
-                                    }
-
-                                    it->second.normal_press_handled = false;
-                                    it->second.press_down = false;
-                                }
-                            }
-                        }
-                        else if (type == LIBINPUT_EVENT_TOUCH_DOWN)
-                        {
-                            // keyboard only cares about `LIBINPUT_EVENT_TOUCH_DOWN`
-                            if (time_of_the_last_press_event.contains(determined_key))
-                            {
-                                const auto now = std::chrono::high_resolution_clock::now();
-                                const auto interval_since_press_down =
-                                    now - time_of_the_last_press_event.at(determined_key);
-                                if (interval_since_press_down <
-                                    std::chrono::microseconds(50))
-                                {
-                                    continue; // ignore consecutive key press
-                                }
-                            }
-
-                            std::lock_guard guard(g_mutex);
-                            // avoid conflicting keys
-                            if (!pressed_key.contains(determined_key))
-                            {
-                                print_log(DEBUG_LOG, "Key ", key_id_translate(determined_key),
-                                        " (", determined_key, ") press registered, slot=", slot, ", coordinate=(", x, ", ", y, ")\n");
-                                append_when_fit(determined_key);
-                                time_of_the_last_press_event[determined_key] = std::chrono::high_resolution_clock::now();
-                                pressed_key[determined_key].normal_press_handled = false;
-                                pressed_key[determined_key].press_down = true;
-                                pressed_key[determined_key].press_event_reg_time = time_of_the_last_press_event[determined_key];
-                                slot_to_key_id_map[slot] = determined_key;
-                            }
-                        }
+                    if (touch.time_usec <= handover_cutoff_usec) {
+                        libinput_event_destroy(ev);
+                        continue;
                     }
-                    else {
-                        print_log(DEBUG_LOG, "Key pressed but no key associated with this location in key map. "
-                            "axisCoordinates=(1920x2400, ", x, ", ", y, ")\n");
+                    last_touch_usec = touch.time_usec;
+
+                    if (recorder) {
+                        recorder->append(touch);
                     }
+
+                    handle_touch(core, touch, ingest_time, clock.now_usec(), mouse_fd);
                 }
 
                 libinput_event_destroy(ev);
             }
         }
 
+        if (recorder) {
+            recorder->flush();
+        }
+
         // delete devices
+        if (halo_panel != nullptr) {
+            libinput_device_unref(halo_panel);
+        }
         libinput_unref(li);
         udev_unref(udev);
 
-        if (virtual_kbd_worker.joinable()) {
-            virtual_kbd_worker.join();
+        // the successor holds the devices and the lock now
+        if (!handed_over) {
+            readiness::notify("STOPPING=1");
         }
-
-        print_log(INFO_LOG, "Removing lock file...");
-        if (!fs::remove(LockFilePath)) {
-            print_log(WARNING_LOG, "\n[WARNING] Lock file cannot be removed or doesn't exist, ignored\n");
+        print_log(INFO_LOG, "Shutting down virtual keyboard...");
+        fn_workers.stop();
+        modules.reset();
+        modhost.reset();
+        modhost_starting.reset();
+        module_chain_loading.reset();
+        reaper.stop();
+        if (module_chain_loaded_fd != -1) {
+            close(module_chain_loaded_fd);
         }
+        close(loop_epoll_fd);
         print_log(INFO_LOG, "done.\n");
+
+        latency::dump();
+        metrics::stop_server();
+        metrics::stop_writer();
         return EXIT_SUCCESS;
     }
     catch (const std::exception &e)
     {
         print_log(ERROR_LOG, e.what(), '\n');
-        if (!fs::remove(LockFilePath)) {
-            print_log(WARNING_LOG, "\n[WARNING] Lock file cannot be removed or doesn't exist, ignored\n");
-        }
+        metrics::stop_server();
+        metrics::stop_writer();
         return EXIT_FAILURE;
     }
     catch (...)
     {
-        if (!fs::remove(LockFilePath)) {
-            print_log(WARNING_LOG, "\n[WARNING] Lock file cannot be removed or doesn't exist, ignored\n");
-        }
+        metrics::stop_server();
+        metrics::stop_writer();
         return EXIT_FAILURE;
     }
 }
@@ -1,8 +1,16 @@
 #include "execute_command.h"
 #include <unistd.h>
 #include <cstring>
+#include <ctime>
 #include <sstream>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <csignal>
+#include <utility>
 
 /* Since pipes are unidirectional, we need three pipes:
    1. Parent writes to child's stdin
@@ -16,8 +24,6 @@
 #define PARENT_READ_PIPE    1
 #define PARENT_ERR_PIPE     2
 
-int pipes[NUM_PIPES][2];
-
 /* Always in a pipe[], pipe[0] is for read and
    pipe[1] is for write */
 #define READ_FD  0
@@ -31,202 +37,359 @@ int pipes[NUM_PIPES][2];
 #define CHILD_WRITE_FD   ( pipes[PARENT_READ_PIPE][WRITE_FD]  )
 #define CHILD_ERR_FD     ( pipes[PARENT_ERR_PIPE][WRITE_FD]   )
 
+extern char ** environ;
+
 inline std::string get_errno_message(const std::string &prefix = "") {
     return prefix + std::strerror(errno);
 }
 
-cmd_status exec_command_(const std::string &cmd,
-    const std::vector<std::string> &args, const std::string &input)
+static uint64_t monotonic_usec()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000ull + static_cast<uint64_t>(ts.tv_nsec) / 1000ull;
+}
+
+int open_pidfd(const pid_t pid)
 {
-    cmd_status status = {"", "", 1}; // Default to failure
+#ifdef SYS_pidfd_open
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+cmd_handle::cmd_handle(cmd_handle && other) noexcept
+{
+    *this = std::move(other);
+}
 
-    // Initialize all required pipes
-    for (auto & i : pipes)
+cmd_handle & cmd_handle::operator=(cmd_handle && other) noexcept
+{
+    if (this != &other)
     {
-        if (pipe(i) == -1) {
-            status.fd_stderr += get_errno_message("pipe() failed: ");
-            status.exit_status = 1;
-            return status;
-        }
+        release();
+        child = std::exchange(other.child, -1);
+        pidfd = std::exchange(other.pidfd, -1);
+        epoll_fd = std::exchange(other.epoll_fd, -1);
+        stdin_fd = std::exchange(other.stdin_fd, -1);
+        stdout_fd = std::exchange(other.stdout_fd, -1);
+        stderr_fd = std::exchange(other.stderr_fd, -1);
+        input = std::move(other.input);
+        input_written = other.input_written;
+        deadline = other.deadline;
+        reaped = std::exchange(other.reaped, true);
+        result = std::move(other.result);
     }
 
-    pid_t pid = fork();
-    if (pid < 0)
+    return *this;
+}
+
+cmd_handle::~cmd_handle()
+{
+    release();
+}
+
+void cmd_handle::release() noexcept
+{
+    if (!reaped && child > 0)
     {
-        // Fork failed
-        status.fd_stderr += get_errno_message("fork() failed: ");
-        status.exit_status = 1;
-        // Close all pipes before returning
-        for (auto & pipe : pipes) {
-            close(pipe[READ_FD]);
-            close(pipe[WRITE_FD]);
-        }
-        return status;
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+        reaped = true;
     }
 
-    if (pid == 0)
-    {
-        // Child process
+    close_fd(stdin_fd);
+    close_fd(stdout_fd);
+    close_fd(stderr_fd);
+    close_fd(pidfd);
+    close_fd(epoll_fd);
+}
 
-        // Redirect stdin
-        if (dup2(CHILD_READ_FD, STDIN_FILENO) == -1) {
-            perror("dup2 stdin");
-            exit(EXIT_FAILURE);
-        }
+// closing also drops the fd from epoll_fd, nobody else holds the same file
+void cmd_handle::close_fd(int & fd)
+{
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+}
 
-        // Redirect stdout
-        if (dup2(CHILD_WRITE_FD, STDOUT_FILENO) == -1) {
-            perror("dup2 stdout");
-            exit(EXIT_FAILURE);
-        }
+void cmd_handle::feed_input()
+{
+    if (stdin_fd == -1) {
+        return;
+    }
 
-        // Redirect stderr
-        if (dup2(CHILD_ERR_FD, STDERR_FILENO) == -1) {
-            perror("dup2 stderr");
-            exit(EXIT_FAILURE);
-        }
+    // a child that exits without reading its stdin must not take the caller down with SIGPIPE:
+    // block it on this thread while writing and swallow the one the write raised
+    sigset_t pipe_set, old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
 
-        /* Close all pipe fds in the child */
-        for (auto & pipe : pipes)
+    while (input_written < input.size())
+    {
+        const ssize_t written = write(stdin_fd, input.data() + input_written, input.size() - input_written);
+        if (written == -1)
         {
-            close(pipe[READ_FD]);
-            close(pipe[WRITE_FD]);
+            if (errno == EINTR)
+                continue; // Retry on interrupt
+            if (errno == EAGAIN)
+                break; // pipe full, epoll says when there is room again
+            if (errno == EPIPE) {
+                constexpr timespec no_wait = {0, 0};
+                sigtimedwait(&pipe_set, nullptr, &no_wait);
+            } else {
+                result.fd_stderr += get_errno_message("write() to child stdin failed: ");
+            }
+            input_written = input.size(); // the child won't get the rest, what it printed is still worth reading
+            break;
         }
 
-        // Build argv for execv
-        std::vector<char *> argv;
-        argv.push_back(const_cast<char *>(cmd.c_str()));
-        for (const auto &arg : args) {
-            argv.push_back(const_cast<char *>(arg.c_str()));
-        }
-        argv.push_back(nullptr);
-        execv(cmd.c_str(), argv.data());
+        input_written += written;
+    }
 
-        // If execv fails
-        perror("execv");
-        exit(EXIT_FAILURE);
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+
+    // close the write end once everything is sent, the child sees EOF
+    if (input_written == input.size()) {
+        close_fd(stdin_fd);
     }
-    else
+}
+
+void cmd_handle::drain(int & fd, std::string & output)
+{
+    if (fd == -1) {
+        return;
+    }
+
+    char buffer[4096];
+    while (true)
     {
-        // Parent process
-        // Close unused pipe ends in the parent
-        close(CHILD_READ_FD);
-        close(CHILD_WRITE_FD);
-        close(CHILD_ERR_FD);
-
-        // Set the write end of the stdin pipe to non-blocking to handle potential write errors
-        // fcntl(PARENT_WRITE_FD, F_SETFL, O_NONBLOCK); // Optional: Depending on requirements
-
-        // Write to child's stdin
-        ssize_t total_written = 0;
-        auto input_size = static_cast<ssize_t>(input.size());
-        const char *input_cstr = input.c_str();
-        ssize_t bytes_to_write = input_size;
-
-        // Ensure input ends with a newline
-        std::string modified_input = input;
-        if (modified_input.empty() || modified_input.back() != '\n')
-        {
-            modified_input += "\n";
-            input_cstr = modified_input.c_str();
-            bytes_to_write = static_cast<ssize_t>(modified_input.size());
+        const ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count > 0) {
+            output.append(buffer, count);
+            continue;
         }
 
-        while (total_written < bytes_to_write)
-        {
-            ssize_t written = write(PARENT_WRITE_FD, input_cstr + total_written, bytes_to_write - total_written);
-            if (written == -1)
-            {
-                if (errno == EINTR)
-                    continue; // Retry on interrupt
-                else {
-                    status.fd_stderr += get_errno_message("write() to child stdin failed: ");
-                    status.exit_status = 1;
-                    return status;
-                }
-            }
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
 
-            total_written += written;
+        if (count == -1 && errno != EAGAIN) {
+            result.fd_stderr += get_errno_message("read() failed: ");
         }
 
-        // Optionally close the write end if no more input is sent
-        if (close(PARENT_WRITE_FD) == -1)
-        {
-            status.fd_stderr += get_errno_message("close() PARENT_WRITE_FD failed: ");
-            status.exit_status = 1;
-            return status;
+        if (count == 0 || errno != EAGAIN) {
+            close_fd(fd); // EOF
         }
+        return;
+    }
+}
 
-        // Function to read all data from a file descriptor
-        auto read_all = [&](int fd, std::string &output) -> bool
-        {
-            char buffer[4096];
-            ssize_t count;
-            while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
-                output.append(buffer, count);
-            }
+void cmd_handle::reap(const int options)
+{
+    int wstatus;
+    const pid_t pid = waitpid(child, &wstatus, options);
+    if (pid == 0) {
+        return; // still running
+    }
 
-            if (count == -1) {
-                output += get_errno_message("read() failed: ");
-                return false;
-            }
-            return true;
-        };
+    reaped = true;
+    if (pid == -1)
+    {
+        result.fd_stderr += get_errno_message("waitpid() failed: ");
+        result.exit_status = 1;
+    }
+    else if (WIFEXITED(wstatus)) {
+        result.exit_status = WEXITSTATUS(wstatus);
+    } else if (WIFSIGNALED(wstatus)) {
+        std::ostringstream oss;
+        oss << "Child terminated by signal " << WTERMSIG(wstatus) << "\n";
+        result.fd_stderr += oss.str();
+        result.exit_status = 1;
+    } else {
+        // Other cases like stopped or continued
+        result.fd_stderr += "Child process ended abnormally.\n";
+        result.exit_status = 1;
+    }
 
-        // Read from child's stdout
-        if (!read_all(PARENT_READ_FD, status.fd_stdout))
-        {
-            status.fd_stderr += get_errno_message("read_all() failed: ");
-            status.exit_status = 1;
-            return status;
-        }
+    // whatever the child wrote before exiting is in the pipes now, anything later comes from
+    // a process it left behind and is not waited for
+    drain(stdout_fd, result.fd_stdout);
+    drain(stderr_fd, result.fd_stderr);
+    close_fd(stdin_fd);
+    close_fd(stdout_fd);
+    close_fd(stderr_fd);
+    close_fd(pidfd);
+}
 
-        // Read from child's stderr
-        if (!read_all(PARENT_ERR_FD, status.fd_stderr))
-        {
-            status.fd_stderr += get_errno_message("read_all() failed: ");
-            status.exit_status = 1;
-            return status;
-        }
+bool cmd_handle::poll()
+{
+    if (reaped) {
+        return true;
+    }
 
-        // Close the read ends
-        if (close(PARENT_READ_FD) == -1)
-        {
-            status.fd_stderr += get_errno_message("close() PARENT_READ_FD failed: ");
-            status.exit_status = 1;
-            return status;
-        }
+    feed_input();
+    drain(stdout_fd, result.fd_stdout);
+    drain(stderr_fd, result.fd_stderr);
+
+    if (monotonic_usec() >= deadline)
+    {
+        kill(child, SIGKILL);
+        result.fd_stderr += "Command timed out and was killed\n";
+        reap(0);
+        result.exit_status = 1;
+        return true;
+    }
+
+    // without a pidfd, the exit shows up as EOF on both output pipes, the child is on its way out
+    if (pidfd != -1) {
+        reap(WNOHANG);
+    } else if (stdout_fd == -1 && stderr_fd == -1) {
+        reap(0);
+    }
 
-        if (close(PARENT_ERR_FD) == -1)
+    return reaped;
+}
+
+cmd_status cmd_handle::wait()
+{
+    while (!poll())
+    {
+        int timeout_ms = -1;
+        if (deadline != UINT64_MAX)
         {
-            status.fd_stderr += get_errno_message("close() PARENT_ERR_FD failed: ");
-            status.exit_status = 1;
-            return status;
+            const uint64_t now = monotonic_usec();
+            timeout_ms = deadline > now ? static_cast<int>((deadline - now + 999) / 1000) : 0;
         }
 
-        // Wait for child process to finish
-        int wstatus;
-        if (waitpid(pid, &wstatus, 0) == -1)
+        pollfd pfd = { epoll_fd, POLLIN, 0 };
+        if (::poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR)
         {
-            status.fd_stderr += get_errno_message("waitpid() failed: ");
-            status.exit_status = 1;
-            return status;
+            result.fd_stderr += get_errno_message("poll() failed: ");
+            release();
+            result.exit_status = 1;
         }
-        else
-        {
-            if (WIFEXITED(wstatus)) {
-                status.exit_status = WEXITSTATUS(wstatus);
-            } else if (WIFSIGNALED(wstatus)) {
-                std::ostringstream oss;
-                oss << "Child terminated by signal " << WTERMSIG(wstatus) << "\n";
-                status.fd_stderr += oss.str();
-                status.exit_status = 1;
-            } else {
-                // Other cases like stopped or continued
-                status.fd_stderr += "Child process ended abnormally.\n";
-                status.exit_status = 1;
+    }
+
+    return result;
+}
+
+cmd_handle exec_command_async_(const std::string &cmd,
+    const std::vector<std::string> &args, const std::string &input, const std::chrono::milliseconds timeout)
+{
+    cmd_handle handle;
+    handle.reaped = true; // until there is a child to reap
+    int pipes[NUM_PIPES][2];
+
+    // Initialize all required pipes, close-on-exec so no other spawn inherits them
+    for (int i = 0; i < NUM_PIPES; i++)
+    {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            handle.result.fd_stderr += get_errno_message("pipe2() failed: ");
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][READ_FD]);
+                close(pipes[j][WRITE_FD]);
             }
-            return status;
+            return handle;
+        }
+    }
+
+    // Build argv for execv
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(cmd.c_str()));
+    for (const auto &arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    // The child gets the pipe ends as stdin/stdout/stderr, everything else is close-on-exec.
+    // posix_spawn clones with CLONE_VM|CLONE_VFORK: no page table copy, so the cost does not grow
+    // with the daemon's RSS, and no code runs in the child that could wait on a lock another thread held
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, CHILD_READ_FD, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, CHILD_WRITE_FD, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, CHILD_ERR_FD, STDERR_FILENO);
+
+    // start with no blocked signals and the driver's SIGINT/SIGUSR1 handlers back to default
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid = -1;
+    const int spawn_error = posix_spawn(&pid, cmd.c_str(), &actions, &attr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    // Close unused pipe ends in the parent
+    close(CHILD_READ_FD);
+    close(CHILD_WRITE_FD);
+    close(CHILD_ERR_FD);
+
+    handle.stdin_fd = PARENT_WRITE_FD;
+    handle.stdout_fd = PARENT_READ_FD;
+    handle.stderr_fd = PARENT_ERR_FD;
+
+    if (spawn_error != 0)
+    {
+        handle.result.fd_stderr += std::string("posix_spawn() failed: ") + std::strerror(spawn_error);
+        handle.release();
+        return handle;
+    }
+
+    handle.child = pid;
+    handle.reaped = false;
+    if (timeout.count() > 0) {
+        handle.deadline = monotonic_usec() + static_cast<uint64_t>(timeout.count()) * 1000;
+    }
+
+    // Ensure input ends with a newline
+    handle.input = input;
+    if (handle.input.empty() || handle.input.back() != '\n') {
+        handle.input += "\n";
+    }
+
+    for (const int fd : { handle.stdin_fd, handle.stdout_fd, handle.stderr_fd }) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    // the exit wakes pollers through the pidfd, output through the pipes
+    handle.pidfd = open_pidfd(pid);
+    handle.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (handle.epoll_fd == -1)
+    {
+        handle.result.fd_stderr += get_errno_message("epoll_create1() failed: ");
+        handle.release();
+        handle.result.exit_status = 1;
+        return handle;
+    }
+
+    for (const auto & [fd, events] : { std::pair { handle.pidfd, EPOLLIN }, { handle.stdout_fd, EPOLLIN },
+                                       { handle.stderr_fd, EPOLLIN }, { handle.stdin_fd, EPOLLOUT } })
+    {
+        if (fd != -1) {
+            epoll_event ev { .events = static_cast<uint32_t>(events), .data = { .fd = fd } };
+            epoll_ctl(handle.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
         }
     }
+
+    handle.feed_input();
+    return handle;
+}
+
+cmd_status exec_command_(const std::string &cmd,
+    const std::vector<std::string> &args, const std::string &input)
+{
+    return exec_command_async_(cmd, args, input).wait();
 }
@@ -1,31 +1,41 @@
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 #include "ckeyid.h"
+#include "halo_module.h"
 
-void (*emit_key)(unsigned int) = nullptr;
+const unsigned int halo_module_abi_version = HALO_MODULE_ABI_VERSION;
+
+// emit_batch lives here, e.g. host->emit_batch((struct halo_module_key_event[]){ { 0, KEY_ID_A, 1 }, { 0, KEY_ID_A, 0 } }, 2)
+const struct halo_module_host * host = nullptr;
 
 void module_exit()
 {
     printf("Exiting...\n");
 }
 
-int module_init(void * emit_key_, int register_vec[13])
+int module_init(const struct halo_module_host * host_, struct halo_module_interest * interest)
 {
     printf("[FN MOD]: Registering helper functions...");
-    emit_key = (void (*)(unsigned int))emit_key_;
-    memset(register_vec, 0, 13 * sizeof(int));
-    register_vec[4] = 1; // No.4, airplane
-    register_vec[8] = 1; // No.8, settings
+    host = host_;
+    memset(interest, 0, sizeof(*interest));
+    interest->fn_keys[4] = 1; // No.4, airplane
+    interest->fn_keys[8] = 1; // No.8, settings
+    HALO_MODULE_INTEREST_SET(interest, KEY_ID_CAPSLOCK);
     printf("done.\n");
     return 0;
 }
 
-void fn_key_handler_vector(const unsigned int key_id)
+void module_key_batch(const struct halo_module_key_event * events, const size_t count)
 {
-    switch (key_id)
+    for (size_t i = 0; i < count; i++)
     {
-    case INVERTED_KEY_AIRPLANEMODE: if (DEBUG) printf("Not implemented\n"); break;
-    case INVERTED_KEY_SETTINGS: printf("Settings\n"); break;
-    default: break;
+        switch (events[i].key_id)
+        {
+        case INVERTED_KEY_AIRPLANEMODE: if (DEBUG) printf("Not implemented\n"); break;
+        case INVERTED_KEY_SETTINGS: if (DEBUG) printf("Settings\n"); break;
+        case KEY_ID_CAPSLOCK: if (DEBUG && events[i].value == 1) printf("Caps Lock at %" PRIu64 "us\n", events[i].time_usec); break;
+        default: break;
+        }
     }
 }
@@ -0,0 +1,608 @@
+/* halo_bench.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+// Microbenchmarks for the hot paths of halo_kbd.
+// Results are printed as JSON: time, heap allocations and syscalls per operation.
+// Allocations are counted by replacing the global operator new, syscalls by interposing
+// the libc wrappers the driver uses (read, write, writev, sendmsg, ioctl, lseek, close).
+// With HALO_BENCH_CHECK_ALLOCS=1 the exit status fails if a key stroke allocated (see must_not_allocate).
+
+// the fortified inline wrappers would collide with the interposed definitions below
+#ifdef _FORTIFY_SOURCE
+# undef _FORTIFY_SOURCE
+#endif
+
+#include <cstdlib>
+#include <cstdarg>
+#include <cstdint>
+#include <new>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <linux/uinput.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <ranges>
+#include <string>
+#include <thread>
+#include <vector>
+#include "log.hpp"
+#include "map_reader.h"
+#include "emit_keys.h"
+#include "execute_command.h"
+#include "halo_core.h"
+#include "halo_clock.h"
+#include "key_id.h"
+
+#ifndef HALO_BENCH_MAP
+# define HALO_BENCH_MAP "yogabook1.map"
+#endif
+
+namespace bench
+{
+    // per thread, so helper threads (pipe reader, metrics) don't show up in the numbers
+    thread_local uint64_t allocations = 0;
+    thread_local uint64_t syscalls = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// allocation counter
+
+void * operator new(const std::size_t size)
+{
+    ++bench::allocations;
+    if (void * ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void * operator new[](const std::size_t size)
+{
+    return operator new(size);
+}
+
+void * operator new(const std::size_t size, const std::align_val_t align)
+{
+    ++bench::allocations;
+    const auto alignment = static_cast<std::size_t>(align);
+    if (void * ptr = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void * operator new[](const std::size_t size, const std::align_val_t align)
+{
+    return operator new(size, align);
+}
+
+void operator delete(void * ptr) noexcept { std::free(ptr); }
+void operator delete[](void * ptr) noexcept { std::free(ptr); }
+void operator delete(void * ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void * ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void * ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void * ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void * ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void * ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// syscall counter
+
+extern "C" {
+
+ssize_t read(const int fd, void * buf, const size_t count)
+{
+    ++bench::syscalls;
+    return syscall(SYS_read, fd, buf, count);
+}
+
+ssize_t write(const int fd, const void * buf, const size_t count)
+{
+    ++bench::syscalls;
+    return syscall(SYS_write, fd, buf, count);
+}
+
+ssize_t writev(const int fd, const iovec * iov, const int iovcnt)
+{
+    ++bench::syscalls;
+    return syscall(SYS_writev, fd, iov, iovcnt);
+}
+
+ssize_t sendmsg(const int fd, const msghdr * msg, const int flags)
+{
+    ++bench::syscalls;
+    return syscall(SYS_sendmsg, fd, msg, flags);
+}
+
+int ioctl(const int fd, const unsigned long request, ...) noexcept
+{
+    va_list args;
+    va_start(args, request);
+    void * argp = va_arg(args, void *);
+    va_end(args);
+    ++bench::syscalls;
+    return static_cast<int>(syscall(SYS_ioctl, fd, request, argp));
+}
+
+off_t lseek(const int fd, const off_t offset, const int whence) noexcept
+{
+    ++bench::syscalls;
+    return syscall(SYS_lseek, fd, offset, whence);
+}
+
+int close(const int fd)
+{
+    ++bench::syscalls;
+    return static_cast<int>(syscall(SYS_close, fd));
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// harness
+
+namespace bench
+{
+    struct result_t {
+        std::string name;
+        uint64_t iterations;
+        double ns_per_op;
+        double allocs_per_op;
+        double syscalls_per_op;
+    };
+
+    std::vector < result_t > results;
+    std::chrono::milliseconds target_time(200);
+    std::string filter;
+
+    template < typename Type >
+    void do_not_optimize(const Type & value)
+    {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    bool selected(const std::string & name)
+    {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    }
+
+    // what the driver loop does for a key stroke at the default log level, with the core's state warmed up
+    bool must_not_allocate(const std::string & name)
+    {
+        return name.starts_with("core/") || name == "log/filtered";
+    }
+
+    // runs `op` in batches of doubling size until one batch takes at least `target_time`,
+    // and reports that batch
+    void run(const std::string & name, const std::function < void(uint64_t) > & op)
+    {
+        if (!selected(name)) {
+            return;
+        }
+
+        op(0); // warm up, lazily initialized state (metrics blocks, log timestamp, ...) is not counted
+
+        uint64_t iterations = 1;
+        while (true)
+        {
+            const auto allocations_before = allocations;
+            const auto syscalls_before = syscalls;
+            const auto begin = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < iterations; i++) {
+                op(i);
+            }
+            const auto elapsed = std::chrono::steady_clock::now() - begin;
+
+            if (elapsed >= target_time || iterations >= (1ull << 40))
+            {
+                // read the counters before building the result, copying `name` allocates
+                const auto n = static_cast<double>(iterations);
+                const auto allocations_made = allocations - allocations_before;
+                const auto syscalls_made = syscalls - syscalls_before;
+                results.push_back({
+                    .name = name,
+                    .iterations = iterations,
+                    .ns_per_op = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / n,
+                    .allocs_per_op = static_cast<double>(allocations_made) / n,
+                    .syscalls_per_op = static_cast<double>(syscalls_made) / n,
+                });
+                std::cerr << name << ": " << results.back().ns_per_op << " ns/op" << std::endl;
+                return;
+            }
+
+            iterations *= 2;
+        }
+    }
+
+    void print_json(std::ostream & out, const std::string & map_path)
+    {
+        out << "{\n  \"map\": \"" << map_path << "\",\n  \"benchmarks\": [\n";
+        for (std::size_t i = 0; i < results.size(); i++)
+        {
+            const auto & [name, iterations, ns_per_op, allocs_per_op, syscalls_per_op] = results[i];
+            out << "    {\"name\": \"" << name << "\", \"iterations\": " << iterations
+                << ", \"ns_per_op\": " << ns_per_op
+                << ", \"allocs_per_op\": " << allocs_per_op
+                << ", \"syscalls_per_op\": " << syscalls_per_op << "}"
+                << (i + 1 == results.size() ? "\n" : ",\n");
+        }
+        out << "  ]\n}\n";
+    }
+
+    // rows x columns grid of 40x40 keys, key codes from 1, plus the touchpad key at 512
+    kbd_map synthetic_layout(const unsigned int rows, const unsigned int columns)
+    {
+        kbd_map map;
+        unsigned int key = 1;
+        for (unsigned int row = 0; row < rows; row++)
+        {
+            for (unsigned int column = 0; column < columns; column++, key++)
+            {
+                if (key == 512) key++;
+                const double x = 10 + column * 42, y = 10 + row * 42;
+                map.emplace(key, key_location_t { x, y, x + 40, y + 40 });
+            }
+        }
+
+        const double bottom = 10 + rows * 42;
+        map.emplace(512, key_location_t { 10, bottom, 10 + columns * 42.0, bottom + 400 });
+        return map;
+    }
+
+    std::string write_layout(const kbd_map & map, const std::string & name)
+    {
+        const std::string path = "/tmp/halo_bench_" + std::to_string(getpid()) + "_" + name + ".map";
+        std::ofstream file(path);
+        assert_throw(file.is_open());
+        file << "# synthetic layout generated by halo_bench\n";
+        for (const auto & [key, location] : map) {
+            file << key << " " << location.key_pixel_top_left_x << " " << location.key_pixel_top_left_y
+                 << " " << location.key_pixel_bottom_right_x << " " << location.key_pixel_bottom_right_y << "\n";
+        }
+        return path;
+    }
+
+    // touch points hitting every key once, then the same number of points hitting nothing
+    std::vector < std::pair < double, double > > touch_points(const kbd_map & map)
+    {
+        std::vector < std::pair < double, double > > points;
+        for (const auto & location : map | std::views::values) {
+            points.emplace_back((location.key_pixel_top_left_x + location.key_pixel_bottom_right_x) / 2,
+                                (location.key_pixel_top_left_y + location.key_pixel_bottom_right_y) / 2);
+        }
+        const auto hits = points.size();
+        for (std::size_t i = 0; i < hits; i++) {
+            points.emplace_back(-1.0 - static_cast<double>(i), -1.0);
+        }
+        return points;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// benchmarks
+
+void bench_hit_test(const std::string & layout, const kbd_map & map)
+{
+    const auto points = bench::touch_points(map);
+    const auto & [first_key, first_location] = *map.begin();
+
+    bench::run("hit_test/single/" + layout, [&](const uint64_t i) {
+        const auto & [x, y] = points[i % points.size()];
+        bench::do_not_optimize(is_this_within_key_location(x, y, first_location));
+    });
+
+    // the scan halo::core does for every touch
+    const halo::core core(map);
+    bench::run("hit_test/full_scan/" + layout, [&](const uint64_t i) {
+        const auto & [x, y] = points[i % points.size()];
+        bench::do_not_optimize(core.hit_test(x, y));
+    });
+}
+
+void bench_read_key_map(const std::string & layout, const std::string & path)
+{
+    bench::run("read_key_map/" + layout, [&](uint64_t) {
+        std::ifstream file(path);
+        const auto map = read_key_map(file);
+        bench::do_not_optimize(map.size());
+    });
+}
+
+void bench_emit()
+{
+    int pipe_fds[2];
+    assert_throw(pipe2(pipe_fds, O_CLOEXEC) == 0);
+    std::thread reader([&] {
+        char buffer[4096];
+        while (read(pipe_fds[0], buffer, sizeof(buffer)) > 0) { }
+    });
+
+    bench::run("emit/pipe", [&](const uint64_t i) {
+        emit(pipe_fds[1], EV_KEY, KEY_A, static_cast<int32_t>(i & 1));
+    });
+
+    close(pipe_fds[1]);
+    reader.join();
+    close(pipe_fds[0]);
+
+    const int memfd = memfd_create("halo_bench", MFD_CLOEXEC);
+    assert_throw(memfd != -1);
+    bench::run("emit/memfd", [&](const uint64_t i) {
+        if ((i & 4095) == 4095) {
+            lseek(memfd, 0, SEEK_SET);
+        }
+        emit(memfd, EV_KEY, KEY_A, static_cast<int32_t>(i & 1));
+    });
+    close(memfd);
+}
+
+void bench_log()
+{
+    const auto level = debug::filter_level.load();
+
+    debug::filter_level = 1;
+    bench::run("log/filtered", [&](const uint64_t i) {
+        print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(KEY_ID_A)), "Key ", key_id_translate(KEY_ID_A), " (", i, ") release registered\n");
+    });
+
+    debug::filter_level = 0;
+    bench::run("log/unfiltered", [&](const uint64_t i) {
+        print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(KEY_ID_A)), "Key ", key_id_translate(KEY_ID_A), " (", i, ") release registered\n");
+    });
+
+    debug::filter_level = level;
+}
+
+// a touch at the center of `key`, in touch_event_t form
+touch_event_t touch_at(const kbd_map & map, const key_id_t key, const uint32_t type, const int32_t slot)
+{
+    const auto & location = map.at(key);
+    return {
+        .time_usec = 0,
+        .slot = slot,
+        .type = type,
+        .x = type == TOUCH_UP ? 0 : (location.key_pixel_top_left_x + location.key_pixel_bottom_right_x) / 2,
+        .y = type == TOUCH_UP ? 0 : (location.key_pixel_top_left_y + location.key_pixel_bottom_right_y) / 2,
+    };
+}
+
+// event generation only, nothing is written anywhere
+void bench_core(const std::string & layout, const kbd_map & map)
+{
+    const auto a_down = touch_at(map, KEY_ID_A, TOUCH_DOWN, 1);
+    const auto a_up = touch_at(map, KEY_ID_A, TOUCH_UP, 1);
+    uint64_t now_usec = 0;
+
+    halo::core core(map);
+    bench::run("core/tap/" + layout, [&](uint64_t) {
+        now_usec += 1000;
+        bench::do_not_optimize(core.touch(a_down, now_usec).keyboard.size());
+        bench::do_not_optimize(core.touch(a_up, now_usec).keyboard.size());
+    });
+
+    // LCtrl held on slot 0 during the whole benchmark
+    core.touch(touch_at(map, KEY_ID_LCTRL, TOUCH_DOWN, 0), now_usec);
+    bench::run("core/tap_with_ctrl/" + layout, [&](uint64_t) {
+        now_usec += 1000;
+        bench::do_not_optimize(core.touch(a_down, now_usec).keyboard.size());
+        bench::do_not_optimize(core.touch(a_up, now_usec).keyboard.size());
+    });
+    core.touch(touch_at(map, KEY_ID_LCTRL, TOUCH_UP, 0), now_usec);
+
+    // Fn + F1 sends Mute
+    if (map.contains(KEY_ID_FN) && map.contains(KEY_ID_F1))
+    {
+        const auto f1_down = touch_at(map, KEY_ID_F1, TOUCH_DOWN, 1);
+        const auto f1_up = touch_at(map, KEY_ID_F1, TOUCH_UP, 1);
+        core.touch(touch_at(map, KEY_ID_FN, TOUCH_DOWN, 0), now_usec);
+        bench::run("core/fn_inverted/" + layout, [&](uint64_t) {
+            now_usec += 1000;
+            bench::do_not_optimize(core.touch(f1_down, now_usec).keyboard.size());
+            bench::do_not_optimize(core.touch(f1_up, now_usec).keyboard.size());
+        });
+        core.touch(touch_at(map, KEY_ID_FN, TOUCH_UP, 0), now_usec);
+    }
+
+    // Space held, one long press repeat per tick
+    core.touch(touch_at(map, KEY_ID_SPACE, TOUCH_DOWN, 0), now_usec);
+    bench::run("core/long_press_tick/" + layout, [&](uint64_t) {
+        now_usec += halo::long_press_interval_usec;
+        bench::do_not_optimize(core.tick(now_usec).keyboard.size());
+    });
+    core.touch(touch_at(map, KEY_ID_SPACE, TOUCH_UP, 0), now_usec);
+
+    // Space held for a minute of virtual time, 750 repeats per op without waiting for any of them
+    halo::virtual_clock clock(now_usec);
+    bench::run("core/hold_1min_virtual/" + layout, [&](uint64_t) {
+        uint64_t repeats = 0;
+        core.touch(touch_at(map, KEY_ID_SPACE, TOUCH_DOWN, 0), clock.now_usec());
+        halo::run_until(core, clock, clock.now_usec() + 60 * 1000000ull, [&](const halo::output_t &) { repeats++; });
+        core.touch(touch_at(map, KEY_ID_SPACE, TOUCH_UP, 0), clock.now_usec());
+        bench::do_not_optimize(repeats);
+    });
+    now_usec = clock.now_usec();
+
+    const auto & touchpad = map.at(KEY_ID_TOUCHPAD);
+    const double width = touchpad.key_pixel_bottom_right_x - touchpad.key_pixel_top_left_x;
+    const double height = touchpad.key_pixel_bottom_right_y - touchpad.key_pixel_top_left_y;
+    core.touch(touch_at(map, KEY_ID_TOUCHPAD, TOUCH_DOWN, 0), now_usec);
+    bench::run("core/touchpad_motion/" + layout, [&](const uint64_t i) {
+        const touch_event_t motion {
+            .time_usec = 0,
+            .slot = 0,
+            .type = TOUCH_MOTION,
+            .x = touchpad.key_pixel_top_left_x + static_cast<double>(i % 100) / 100 * width,
+            .y = touchpad.key_pixel_top_left_y + static_cast<double>(i % 37) / 37 * height,
+        };
+        bench::do_not_optimize(core.touch(motion, ++now_usec).touchpad.size());
+    });
+    core.touch(touch_at(map, KEY_ID_TOUCHPAD, TOUCH_UP, 0), now_usec);
+
+    // independent instances, as a multi-panel or throughput test would run them
+    std::vector < halo::core > cores;
+    cores.reserve(16);
+    for (int i = 0; i < 16; i++) {
+        cores.emplace_back(map);
+    }
+    bench::run("core/tap_16_instances/" + layout, [&](const uint64_t i) {
+        auto & instance = cores[i % cores.size()];
+        now_usec += 1000;
+        bench::do_not_optimize(instance.touch(a_down, now_usec).keyboard.size());
+        bench::do_not_optimize(instance.touch(a_up, now_usec).keyboard.size());
+    });
+}
+
+void bench_emit_batch(const kbd_map & map)
+{
+    const int memfd = memfd_create("halo_bench_vkbd", MFD_CLOEXEC);
+    assert_throw(memfd != -1);
+
+    halo::core core(map);
+    const auto a_down = touch_at(map, KEY_ID_A, TOUCH_DOWN, 0);
+    const auto a_up = touch_at(map, KEY_ID_A, TOUCH_UP, 0);
+    uint64_t now_usec = 0;
+
+    // a tap (4 key events and SYN_REPORTs) generated and written to a memfd, the driver's hot path
+    bench::run("core/tap_emitted", [&](const uint64_t i) {
+        if ((i & 1023) == 1023) {
+            lseek(memfd, 0, SEEK_SET);
+        }
+        now_usec += 1000;
+        emit_events(memfd, core.touch(a_down, now_usec).keyboard);
+        emit_events(memfd, core.touch(a_up, now_usec).keyboard);
+    });
+
+    close(memfd);
+}
+
+void bench_spawn()
+{
+    const auto spawn_true = [](uint64_t) {
+        bench::do_not_optimize(exec_command("/bin/true", "").exit_status);
+    };
+    // what exec_command_ did before posix_spawn, for comparison
+    const auto fork_true = [](uint64_t) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            execl("/bin/true", "/bin/true", nullptr);
+            _exit(127);
+        }
+        int wstatus = 0;
+        waitpid(pid, &wstatus, 0);
+        bench::do_not_optimize(wstatus);
+    };
+
+    bench::run("exec/spawn_true", spawn_true);
+    bench::run("exec/fork_true", fork_true);
+
+    // the same with 512MiB of touched heap: fork copies the page tables, posix_spawn (vfork) does not
+    if (!bench::selected("exec/spawn_true/rss_512m") && !bench::selected("exec/fork_true/rss_512m")) {
+        return;
+    }
+    constexpr std::size_t ballast_size = 512ull << 20;
+    void * ballast = mmap(nullptr, ballast_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    assert_throw(ballast != MAP_FAILED);
+    bench::run("exec/spawn_true/rss_512m", spawn_true);
+    bench::run("exec/fork_true/rss_512m", fork_true);
+    munmap(ballast, ballast_size);
+}
+
+int main(int argc, char ** argv)
+{
+    const std::string map_path = argc > 1 ? argv[1] : HALO_BENCH_MAP;
+    if (const auto time_env = std::getenv("HALO_BENCH_TIME_MS"); time_env != nullptr) {
+        bench::target_time = std::chrono::milliseconds(std::strtoul(time_env, nullptr, 10));
+    }
+    if (const auto filter_env = std::getenv("HALO_BENCH_FILTER"); filter_env != nullptr) {
+        bench::filter = filter_env;
+    }
+
+    try
+    {
+        // keep stdout for the JSON document
+        std::ofstream null_output("/dev/null");
+        debug::output = &null_output;
+        debug::journal_output = false;
+
+        std::ifstream map_file(map_path);
+        if (!map_file.is_open()) {
+            std::cerr << "Cannot open keyboard map " << map_path << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        const std::vector < std::pair < std::string, kbd_map > > layouts = {
+            { "yogabook1", read_key_map(map_file) },
+            { "grid_6x15", bench::synthetic_layout(6, 15) },
+            { "grid_20x25", bench::synthetic_layout(20, 25) },
+        };
+
+        for (const auto & [name, map] : layouts) {
+            bench_hit_test(name, map);
+        }
+
+        bench_read_key_map("yogabook1", map_path);
+        for (const auto & [name, map] : layouts | std::views::drop(1))
+        {
+            const auto path = bench::write_layout(map, name);
+            bench_read_key_map(name, path);
+            unlink(path.c_str());
+        }
+
+        bench_emit();
+        bench_log();
+        for (const auto & [name, map] : layouts) {
+            bench_core(name, map);
+        }
+        bench_emit_batch(layouts.front().second);
+        bench_spawn();
+
+        debug::output = &std::cout;
+        bench::print_json(std::cout, map_path);
+
+        if (const auto check_env = std::getenv("HALO_BENCH_CHECK_ALLOCS"); check_env != nullptr && std::string(check_env) == "1")
+        {
+            bool allocated = false;
+            for (const auto & result : bench::results)
+            {
+                if (bench::must_not_allocate(result.name) && result.allocs_per_op != 0) {
+                    std::cerr << result.name << ": " << result.allocs_per_op << " allocations per op, expected none" << std::endl;
+                    allocated = true;
+                }
+            }
+
+            return allocated ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+
+        return EXIT_SUCCESS;
+    }
+    catch (const std::exception & e)
+    {
+        std::cerr << "halo_bench: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,90 @@
+/* halo_clock.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "halo_clock.h"
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <poll.h>
+#include <stdexcept>
+#include <system_error>
+
+uint64_t halo::monotonic_clock::now_usec() const
+{
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000ull + static_cast<uint64_t>(ts.tv_nsec) / 1000ull;
+}
+
+bool halo::monotonic_clock::wait(const int fd, const uint64_t deadline_usec)
+{
+    pollfd pfd = { fd, POLLIN, 0 };
+    while (true)
+    {
+        int timeout_ms = -1;
+        if (deadline_usec != no_deadline)
+        {
+            const uint64_t now = now_usec();
+            if (deadline_usec <= now) {
+                timeout_ms = 0;
+            } else {
+                // round up, waking early would only spin
+                timeout_ms = static_cast<int>(std::min<uint64_t>((deadline_usec - now + 999) / 1000, INT32_MAX));
+            }
+        }
+
+        const int ready = poll(&pfd, 1, timeout_ms);
+        if (ready < 0)
+        {
+            // a signal, let the caller look at its flags
+            if (errno == EINTR) {
+                return false;
+            }
+
+            throw std::system_error(errno, std::generic_category(), "poll");
+        }
+
+        if (ready > 0) {
+            return true;
+        }
+
+        if (timeout_ms == 0 || now_usec() >= deadline_usec) {
+            return false;
+        }
+    }
+}
+
+bool halo::virtual_clock::wait(const int fd, const uint64_t deadline_usec)
+{
+    if (fd >= 0)
+    {
+        pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) > 0) {
+            return true;
+        }
+    }
+
+    if (deadline_usec == no_deadline) {
+        throw std::logic_error("virtual clock asked to wait forever");
+    }
+
+    now = std::max(now, deadline_usec);
+    return false;
+}
@@ -0,0 +1,531 @@
+/* halo_core.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+// This file uses unnecessarily complicated methods for key emissions because my Yogabook is too old to use "normal"
+// methods, and these are workarounds to bypass certain issues (like sticky keys, etc.)
+
+#include "halo_core.h"
+#include <algorithm>
+#include <ranges>
+#include "log.hpp"
+#include "metrics.h"
+
+const std::map < int, key_id_t > offset_map = {
+    { 0, INVERTED_KEY_FNLOCK },
+    { 1, INVERTED_KEY_MUTE },
+    { 2, INVERTED_KEY_VOLUMEDOWN },
+    { 3, INVERTED_KEY_VOLUMEUP },
+    { 4, INVERTED_KEY_AIRPLANEMODE },
+    { 5, INVERTED_KEY_BRIGHTNESSDOWN },
+    { 6, INVERTED_KEY_BRIGHTNESSUP },
+    { 7, INVERTED_KEY_SEARCH },
+    { 8, INVERTED_KEY_SETTINGS },
+    { 9, INVERTED_KEY_PREVIOUSSONG },
+    { 10, INVERTED_KEY_PLAYPAUSE },
+    { 11, INVERTED_KEY_NEXTSONG },
+    { 12, INVERTED_KEY_PRINT },
+};
+
+std::string_view key_id_translate(const key_id_t key)
+{
+    const auto it = key_id_to_str_translation_table.find(key);
+    if (it == key_id_to_str_translation_table.end()) {
+        return "Unknown";
+    }
+
+    return it->second;
+}
+
+halo::core::core(const kbd_map & map_)
+    : map(map_),
+      touchpad_width(map_.at(KEY_ID_TOUCHPAD).key_pixel_bottom_right_x - map_.at(KEY_ID_TOUCHPAD).key_pixel_top_left_x),
+      touchpad_height(map_.at(KEY_ID_TOUCHPAD).key_pixel_bottom_right_y - map_.at(KEY_ID_TOUCHPAD).key_pixel_top_left_y)
+{
+    // a null handler means the inverted key is emitted like any other key
+    fn_key_invert_handler_map = {
+        { KEY_ID_ESC, {INVERTED_KEY_FNLOCK,         nullptr} },
+        { KEY_ID_F1,  {INVERTED_KEY_MUTE,           nullptr} },
+        { KEY_ID_F2,  {INVERTED_KEY_VOLUMEDOWN,     nullptr} },
+        { KEY_ID_F3,  {INVERTED_KEY_VOLUMEUP,       nullptr} },
+        { KEY_ID_F4,  {INVERTED_KEY_AIRPLANEMODE,   nullptr} },
+        { KEY_ID_F5,  {INVERTED_KEY_BRIGHTNESSDOWN, nullptr} },
+        { KEY_ID_F6,  {INVERTED_KEY_BRIGHTNESSUP,   nullptr} },
+        { KEY_ID_F7,  {INVERTED_KEY_SEARCH,         nullptr} },
+        { KEY_ID_F8,  {INVERTED_KEY_SETTINGS,       nullptr} },
+        { KEY_ID_F9,  {INVERTED_KEY_PREVIOUSSONG,   nullptr} },
+        { KEY_ID_F10, {INVERTED_KEY_PLAYPAUSE,      nullptr} },
+        { KEY_ID_F11, {INVERTED_KEY_NEXTSONG,       nullptr} },
+        { KEY_ID_F12, {INVERTED_KEY_PRINT,          nullptr} },
+    };
+
+    // a key stroke with all functional keys held is 4 events per key plus 4 SYN_REPORTs
+    keyboard_events.reserve(64);
+    touchpad_events.reserve(16);
+    // every functional key plus Win, each one at most once
+    combination_sp_keys.reserve(SpecialKeys.size() + 1);
+}
+
+void halo::core::redirect_fn_key(const key_id_t inverted_key, const inverted_key_map_handler handler)
+{
+    for (auto & [key, key_handler] : fn_key_invert_handler_map | std::views::values)
+    {
+        if (key != INVERTED_KEY_FNLOCK && key == inverted_key) { // cannot override internal fn_lock logic
+            key_handler = handler;
+        }
+    }
+}
+
+void halo::core::emit(std::vector < input_event > & events, const uint16_t type, const uint16_t code, const int32_t value)
+{
+    input_event ev{};
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    events.push_back(ev);
+}
+
+long halo::core::hit_test(const double x, const double y) const
+{
+    // determine the key (fucking just iterate through)
+    for (const auto & [key, location] : map)
+    {
+        if (is_this_within_key_location(x, y, location)) {
+            return key;
+        }
+    }
+
+    return -1;
+}
+
+void halo::core::press_keys_once(const key_id_t pressed_key)
+{
+    if (fn_key_invert_handler_map.contains(pressed_key))
+    {
+        print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(pressed_key)), "Fn governed key ", key_id_translate(pressed_key), " pressed, Fn is ",
+            (std::ranges::find(combination_sp_keys, KEY_ID_FN) != combination_sp_keys.end() ? "" : "NOT "),
+            "present within the key combination\n");
+        // check if Fn Lock and Fn key presence within combinations
+        bool do_i_invert = fnlock_enabled;
+        do_i_invert = std::ranges::find(combination_sp_keys, KEY_ID_FN) != combination_sp_keys.end()
+            ? !do_i_invert : do_i_invert;
+
+        print_log(DEBUG_LOG, "Invert = ", do_i_invert, "\n");
+
+        if (do_i_invert) {
+            const auto [inverted_key_id, handler] = fn_key_invert_handler_map.at(pressed_key);
+            print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(inverted_key_id)), "Pressing down ", key_id_translate(inverted_key_id), "\n");
+            if (inverted_key_id == INVERTED_KEY_FNLOCK) {
+                fnlock_enabled = !fnlock_enabled;
+                print_log(DEBUG_LOG, "Fn ", fnlock_enabled ? "" : "Un", "locked\n");
+            } else if (handler != nullptr) {
+                handler(inverted_key_id);
+            } else if (inverted_key_id <= KEY_MAX) {
+                emit_key(inverted_key_id /* key code */, 1 /* press down */);
+                sync();
+                emit_key(inverted_key_id /* key code */, 0 /* release */);
+                sync();
+            } else {
+                print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(inverted_key_id)), "No handler for ", key_id_translate(inverted_key_id), ", ignored\n");
+            }
+        } else { // just press the corresponding key
+            print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(pressed_key)), "Pressing down ", key_id_translate(pressed_key), "\n");
+            emit_key(pressed_key /* key code */, 1 /* press down */);
+            sync();
+            emit_key(pressed_key /* key code */, 0 /* release */);
+            sync();
+        }
+    }
+    else
+    {
+        print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(pressed_key)), "Executing key press cb:", key_id_translate(combination_sp_keys),
+                " & ch:", key_id_translate(pressed_key), ", fn:", fnlock_enabled, "\n");
+
+        // release all functional key
+        for (const auto key_id : combination_sp_keys) {
+            emit_key(key_id /* key code */, 0 /* release */);
+        }
+        sync();
+
+        // press again
+        for (const auto key_id : combination_sp_keys) {
+            emit_key(key_id /* key code */, 1 /* press down */);
+        }
+        emit_key(pressed_key /* key code */, 1 /* press down */);
+        sync();
+
+        // release again
+        for (const auto key_id : combination_sp_keys) {
+            emit_key(key_id /* key code */, 0 /* release */);
+        }
+        emit_key(pressed_key /* key code */, 0 /* release */);
+        sync();
+
+        // press down again, until it's released by a "pressure gone" signal
+        for (const auto key_id : combination_sp_keys) {
+            if (key_id != KEY_ID_WIN) { // ignore Win, it only serves as combination in my case
+                emit_key(key_id /* key code */, 1 /* press down */);
+            }
+        }
+        sync();
+    }
+}
+
+void halo::core::press(const key_id_t key_id, const uint64_t now_usec)
+{
+    pressed_key[key_id] = key_state_t { .press_time_usec = now_usec, .next_repeat_usec = 0 };
+
+    if (SpecialKeys.contains(key_id))
+    {
+        if (SpecialKeys.at(key_id) == KEY_COMBINATION_ONLY)
+        {
+            combination_sp_keys.push_back(key_id);
+            emit_key(key_id /* key code */, 1 /* press down */);
+            sync();
+            print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(key_id)), "Functional key ", key_id_translate(key_id), " registered\n");
+        }
+    }
+    else if (key_id == KEY_ID_WIN)
+    {
+        combination_sp_keys.push_back(KEY_ID_WIN);
+        no_key_pressed_after_win = true;
+        print_log(DEBUG_LOG, "Clear Win key state registered\n");
+    }
+    else
+    {
+        if (no_key_pressed_after_win) {
+            print_log(DEBUG_LOG, "Clear Win key state damaged\n");
+            no_key_pressed_after_win = false;
+        }
+        press_keys_once(key_id);
+    }
+}
+
+void halo::core::release(const key_id_t key_id)
+{
+    if (key_id == KEY_ID_WIN && no_key_pressed_after_win) {
+        print_log(DEBUG_LOG, "Clear Win key press on release, executing it NOW\n");
+        emit_key(key_id /* key code */, 1 /* press down */);
+        sync();
+        emit_key(key_id /* key code */, 0 /* release */);
+        sync();
+        no_key_pressed_after_win = false;
+    }
+
+    if (std::ranges::find(combination_sp_keys, key_id) != combination_sp_keys.end()) // if this is a functional key
+    {
+        print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(key_id)), "Functional key ", key_id_translate(key_id), " released\n");
+        emit_key(key_id /* key code */, 0 /* release */);
+        sync();
+    }
+    std::erase(combination_sp_keys, key_id); // this will delete WIN as well
+    pressed_key.erase(key_id); // stops the long press as well
+    print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(key_id)), "Key ", key_id_translate(key_id), " released\n");
+}
+
+void halo::core::touchpad(const double x, const double y,
+    const unsigned int determined_key,
+    const uint32_t type,
+    const int slot)
+{
+    if (type == TOUCH_DOWN && (determined_key == BTN_LEFT || determined_key == BTN_RIGHT))
+    {
+        emit(touchpad_events, EV_ABS, ABS_MT_SLOT, slot);
+        emit(touchpad_events, EV_KEY, determined_key, 1);
+        emit(touchpad_events, EV_SYN, SYN_REPORT, 0); // sync
+        emit(touchpad_events, EV_KEY, determined_key, 0);
+        emit(touchpad_events, EV_SYN, SYN_REPORT, 0); // sync
+        print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(determined_key)), "TouchPad ", key_id_translate(determined_key), " key pressed\n");
+    }
+    else if (determined_key == KEY_ID_TOUCHPAD || type == TOUCH_UP)
+    {
+        const auto new_y = std::max(800 - static_cast<int>((x - map.at(KEY_ID_TOUCHPAD).key_pixel_top_left_x)
+            / static_cast<double>(touchpad_width) * 800), 0);
+        const auto new_x = std::max(static_cast<int>((y - map.at(KEY_ID_TOUCHPAD).key_pixel_top_left_y)
+            / static_cast<double>(touchpad_height) * 1280), 0);
+
+        /* 0. choose slot FIRST (always, even if it stays 0) */
+        emit(touchpad_events, EV_ABS, ABS_MT_SLOT, slot);
+
+        /* 1. contact bookkeeping */
+        if (type == TOUCH_DOWN) {
+            emit(touchpad_events, EV_ABS, ABS_MT_TRACKING_ID, next_id++);
+            emit(touchpad_events, EV_KEY, BTN_TOUCH,          1);
+            emit(touchpad_events, EV_KEY, BTN_TOOL_FINGER,    1);
+            emit(touchpad_events, EV_ABS, ABS_MT_PRESSURE, 128);
+        } else if (type == TOUCH_UP) {
+            emit(touchpad_events, EV_ABS, ABS_MT_PRESSURE, 0);
+            emit(touchpad_events, EV_ABS, ABS_MT_TRACKING_ID, -1);
+            emit(touchpad_events, EV_KEY, BTN_TOUCH,          0);
+            emit(touchpad_events, EV_KEY, BTN_TOOL_FINGER,    0);
+        }
+
+        /* 2. coordinates while finger is down */
+        if (type != TOUCH_UP) {
+            emit(touchpad_events, EV_ABS, ABS_MT_POSITION_X, new_x);
+            emit(touchpad_events, EV_ABS, ABS_MT_POSITION_Y, new_y);
+
+            /* mirror slot-0 to single-touch axes */
+            if (slot == 0) {
+                emit(touchpad_events, EV_ABS, ABS_X, new_x);
+                emit(touchpad_events, EV_ABS, ABS_Y, new_y);
+            }
+        }
+
+        /* 3. flush the packet */
+        emit(touchpad_events, EV_SYN, SYN_REPORT, 0);
+        print_log(DEBUG_LOG, "TouchPad movement (", x, ", ", y, ") mapped to (", new_x, ", ", new_y, "), slot=", slot, "\n");
+    }
+}
+
+void halo::core::append_when_fit(const key_id_t id)
+{
+    bool fail = false;
+    switch (reset_key_counter)
+    {
+    case 0:
+        {
+            if (id == KEY_ID_LCTRL) {
+                reset_key_counter++;
+            } else {
+                fail = true;
+            }
+        }
+        break;
+    case 1:
+        {
+            if (id == KEY_ID_LALT) {
+                reset_key_counter++;
+            } else {
+                fail = true;
+            }
+        }
+        break;
+    case 2:
+        {
+            if (id == KEY_ID_TAB) {
+                reset_key_counter++;
+            } else {
+                fail = true;
+            }
+        }
+        break;
+    default:
+        {
+            fail = true;
+        }
+        break;
+    }
+
+    if (fail)
+    {
+        reset_key_counter = 0;
+    }
+
+    if (reset_key_counter == 3)
+    {
+        if constexpr (DEBUG) print_log(DEBUG_LOG, "===> [LCtrl+LAlt+Tab]: Key pressed for release ALL keys <===\n");
+        else print_log(INFO_LOG, "===> Combination for immediate reset keyboard (LCtrl+LAlt+Tab) invoked <===\n");
+    }
+}
+
+halo::output_t halo::core::touch(const touch_event_t & touch, const uint64_t now_usec)
+{
+    keyboard_events.clear();
+    touchpad_events.clear();
+
+    const auto type = touch.type;
+    const int32_t slot = touch.slot;
+    const double x = touch.x, y = touch.y;
+
+    const long determined_key = hit_test(x, y);
+    if (determined_key != -1 || type == TOUCH_UP)
+    {
+        // mouse event
+        if ((determined_key == KEY_ID_MOUSELEFT
+            || determined_key == KEY_ID_MOUSERIGHT
+            || determined_key == KEY_ID_TOUCHPAD)
+            || (type == TOUCH_UP && slot_to_key_id_map.contains(slot)
+                && (slot_to_key_id_map.at(slot) == KEY_ID_MOUSELEFT
+                    || slot_to_key_id_map.at(slot) == KEY_ID_MOUSERIGHT
+                    || slot_to_key_id_map.at(slot) == KEY_ID_TOUCHPAD)
+            ))
+        {
+            if (type == TOUCH_UP) {
+                if (slot_to_key_id_map.contains(slot)) slot_to_key_id_map.erase(slot);
+            } else {
+                slot_to_key_id_map.emplace(slot, determined_key);
+            }
+            touchpad(x, y, determined_key, type, slot);
+        }
+        // key release
+        else if (type == TOUCH_UP)
+        {
+            if (const auto key_id = slot_to_key_id_map.contains(slot) ? slot_to_key_id_map.at(slot) : -1; key_id != -1)
+            {
+                if (slot_to_key_id_map.contains(slot)) slot_to_key_id_map.erase(slot);
+                print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(key_id)), "Key ", key_id_translate(key_id), " (", key_id, ") release registered, slot=", slot, "\n");
+
+                if (pressed_key.contains(key_id))
+                {
+                    // reset "release all keys" counter
+                    if (key_id == KEY_ID_LCTRL || key_id == KEY_ID_LALT || key_id == KEY_ID_TAB)
+                    {
+                        reset_key_counter = 0;
+                    }
+
+                    release(key_id);
+                }
+            }
+        }
+        else if (type == TOUCH_DOWN)
+        {
+            // keyboard only cares about `LIBINPUT_EVENT_TOUCH_DOWN`
+            if (const auto it = time_of_the_last_press_event.find(determined_key);
+                it != time_of_the_last_press_event.end() && now_usec - it->second < debounce_usec)
+            {
+                metrics::add(metrics::DEBOUNCED_PRESSES);
+                return output(); // ignore consecutive key press
+            }
+
+            // avoid conflicting keys
+            if (!pressed_key.contains(determined_key))
+            {
+                print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(determined_key)), "Key ", key_id_translate(determined_key),
+                        " (", determined_key, ") press registered, slot=", slot, ", coordinate=(", x, ", ", y, ")\n");
+                append_when_fit(determined_key);
+                time_of_the_last_press_event[determined_key] = now_usec;
+                slot_to_key_id_map[slot] = determined_key;
+                if (reset_key_counter == 3) {
+                    // the combination's last key is released with everything else, never typed
+                    pressed_key[determined_key] = key_state_t { .press_time_usec = now_usec, .next_repeat_usec = 0 };
+                    force_release();
+                } else {
+                    press(determined_key, now_usec);
+                }
+            }
+        }
+    }
+    else {
+        metrics::add(metrics::HIT_TEST_MISSES);
+        print_log(DEBUG_LOG, "Key pressed but no key associated with this location in key map. "
+            "axisCoordinates=(1920x2400, ", x, ", ", y, ")\n");
+    }
+
+    return output();
+}
+
+void halo::core::force_release()
+{
+    metrics::add(metrics::FORCE_RELEASES);
+    release_held();
+}
+
+void halo::core::release_held()
+{
+    print_log(DEBUG_LOG, "Force releasing all keys\n");
+    for (const auto & key_id : pressed_key | std::views::keys)
+    {
+        emit_key(key_id /* key code */, 0 /* release */);
+        sync();
+    }
+
+    combination_sp_keys.clear();
+    no_key_pressed_after_win = false;
+    pressed_key.clear();
+}
+
+halo::output_t halo::core::release_all()
+{
+    keyboard_events.clear();
+    touchpad_events.clear();
+    force_release();
+    return output();
+}
+
+halo::output_t halo::core::lift_all()
+{
+    keyboard_events.clear();
+    touchpad_events.clear();
+    for (const auto & [slot, key_id] : slot_to_key_id_map)
+    {
+        if (key_id == KEY_ID_MOUSELEFT || key_id == KEY_ID_MOUSERIGHT || key_id == KEY_ID_TOUCHPAD) {
+            touchpad(0, 0, key_id, TOUCH_UP, static_cast<int>(slot));
+        }
+    }
+    slot_to_key_id_map.clear();
+
+    release_held();
+    reset_key_counter = 0;
+    return output();
+}
+
+halo::output_t halo::core::tick(const uint64_t now_usec)
+{
+    keyboard_events.clear();
+    touchpad_events.clear();
+
+    ////////////////////////////////////
+    /// LONG PRESS PROCESSING REGION ///
+    ////////////////////////////////////
+    for (auto & [key_id, state] : pressed_key)
+    {
+        // does this key actually support long press?
+        if (std::ranges::find(keys_supporting_long_press, key_id) == keys_supporting_long_press.end()) {
+            continue;
+        }
+
+        if (state.next_repeat_usec == 0)
+        {
+            // key pressed and escalated for more than 500ms?
+            if (now_usec - state.press_time_usec <= long_press_delay_usec) {
+                continue;
+            }
+            print_log(DEBUG_LOG, JOURNAL_KEY(key_id_translate(key_id)), "Long press started for key ", key_id_translate(key_id), "\n");
+        }
+        else if (now_usec < state.next_repeat_usec) {
+            continue;
+        }
+
+        press_keys_once(key_id);
+        metrics::add(metrics::LONG_PRESS_REPEATS);
+        // keep the cadence, unless the caller fell more than one interval behind
+        state.next_repeat_usec = state.next_repeat_usec != 0 && state.next_repeat_usec + long_press_interval_usec > now_usec
+            ? state.next_repeat_usec + long_press_interval_usec
+            : now_usec + long_press_interval_usec;
+    }
+
+    return output();
+}
+
+uint64_t halo::core::next_deadline() const
+{
+    uint64_t deadline = no_deadline;
+    for (const auto & [key_id, state] : pressed_key)
+    {
+        if (std::ranges::find(keys_supporting_long_press, key_id) != keys_supporting_long_press.end())
+        {
+            deadline = std::min(deadline, state.next_repeat_usec != 0
+                ? state.next_repeat_usec
+                : state.press_time_usec + long_press_delay_usec + 1);
+        }
+    }
+
+    return deadline;
+}
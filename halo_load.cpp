@@ -0,0 +1,520 @@
+/* halo_load.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+// Typing load generator: synthesizes multi-finger typing (rollover, held modifiers, long presses) and
+// touchpad swipes at a configurable rate, pushes it through halo::core and accounts for every key:
+// strokes that never came out, strokes that came out too often, keys left held, and how far behind
+// the touches the driver loop falls. Runs either on a virtual clock (as fast as the core goes) or in
+// real time, where a producer thread feeds the touches through a pipe like the kernel does.
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <ranges>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include "map_reader.h"
+#include "emit_keys.h"
+#include "halo_core.h"
+#include "halo_clock.h"
+#include "key_id.h"
+#include "latency.h"
+
+namespace load
+{
+    constexpr int panel_slots = 10;
+    constexpr uint64_t swipe_motion_usec = 8000; // 125Hz, what the panel reports at
+    constexpr uint64_t max_stroke_usec = 400000; // ordinary strokes stay short of a long press
+
+    struct config_t
+    {
+        double rate = 10;           // key strokes per second
+        double seconds = 10;        // of touches per run
+        double rollover = 0.3;      // share of strokes still held when the next one lands
+        double modifiers = 0.1;     // share of strokes chorded with a held Shift/Ctrl/RAlt
+        double long_press = 0.02;   // share of strokes held into long press repeats
+        double touchpad = 0.05;     // share of strokes that are touchpad swipes instead
+        double max_delay_ms = 10;   // sweep: p99 touch-to-processing delay still counted as keeping up
+        uint64_t seed = 1;
+        bool realtime = false;
+        bool sweep = false;
+    };
+
+    struct stroke_t
+    {
+        key_id_t key;
+        uint64_t hold_usec;
+    };
+
+    struct schedule_t
+    {
+        std::vector < touch_event_t > touches;  // sorted, times relative to the start
+        std::vector < stroke_t > strokes;       // typed keys, modifiers not included
+        uint64_t swipes = 0;
+        uint64_t skipped = 0;                   // strokes that found all ten fingers busy
+    };
+
+    struct result_t
+    {
+        double rate = 0;
+        uint64_t touches = 0, strokes = 0, swipes = 0, skipped = 0;
+        uint64_t dropped = 0, duplicated = 0, stuck = 0;
+        uint64_t max_queue_depth = 0;
+        double wall_seconds = 0;
+        uint64_t delay_p50 = 0, delay_p99 = 0, delay_max = 0;           // touch -> picked up by the loop
+        uint64_t decision_p50 = 0, decision_p99 = 0, decision_max = 0;  // core.touch() itself
+
+        [[nodiscard]] bool clean() const { return dropped == 0 && duplicated == 0 && stuck == 0; }
+    };
+
+    double env_double(const char * name, const double fallback)
+    {
+        const auto value = std::getenv(name);
+        return value == nullptr ? fallback : std::strtod(value, nullptr);
+    }
+
+    touch_event_t touch_at(const key_location_t & location, const uint64_t time_usec, const uint32_t type, const int slot,
+        const double fx = 0.5, const double fy = 0.5)
+    {
+        return touch_event_t {
+            .time_usec = time_usec,
+            .slot = slot,
+            .type = type,
+            .x = type == TOUCH_UP ? 0 : location.key_pixel_top_left_x + (location.key_pixel_bottom_right_x - location.key_pixel_top_left_x) * fx,
+            .y = type == TOUCH_UP ? 0 : location.key_pixel_top_left_y + (location.key_pixel_bottom_right_y - location.key_pixel_top_left_y) * fy,
+        };
+    }
+
+    // the repeats halo::core emits for a key held `hold_usec` on an exact clock
+    uint64_t expected_repeats(const key_id_t key, const uint64_t hold_usec)
+    {
+        if (std::ranges::find(keys_supporting_long_press, key) == keys_supporting_long_press.end()
+            || hold_usec <= halo::long_press_delay_usec) {
+            return 0;
+        }
+
+        return 1 + (hold_usec - halo::long_press_delay_usec - 1) / halo::long_press_interval_usec;
+    }
+
+    schedule_t generate(const kbd_map & map, const config_t & config)
+    {
+        const halo::core probe(map);
+        const auto hits_itself = [&](const key_id_t key) {
+            const auto & location = map.at(key);
+            return probe.hit_test((location.key_pixel_top_left_x + location.key_pixel_bottom_right_x) / 2,
+                (location.key_pixel_top_left_y + location.key_pixel_bottom_right_y) / 2) == key;
+        };
+
+        // plain keys only: no Fn row, no Win tap, and no Tab or LAlt so LCtrl+LAlt+Tab never resets everything
+        std::vector < key_id_t > typing_keys, long_keys, modifier_keys;
+        for (const auto key : map | std::views::keys)
+        {
+            if (!hits_itself(key)) continue;
+            if (key == KEY_ID_LSHIFT || key == KEY_ID_RSHIFT || key == KEY_ID_LCTRL || key == KEY_ID_RCTRL || key == KEY_ID_RALT) {
+                modifier_keys.push_back(key);
+                continue;
+            }
+            if (SpecialKeys.contains(key) || key == KEY_ID_WIN || key == KEY_ID_TAB || key == KEY_ID_ESC
+                || (key >= KEY_ID_F1 && key <= KEY_ID_F10) || key == KEY_ID_F11 || key == KEY_ID_F12
+                || key == KEY_ID_MOUSELEFT || key == KEY_ID_MOUSERIGHT || key == KEY_ID_TOUCHPAD || key > KEY_MAX) {
+                continue;
+            }
+            typing_keys.push_back(key);
+            if (std::ranges::find(keys_supporting_long_press, key) != keys_supporting_long_press.end()) {
+                long_keys.push_back(key);
+            }
+        }
+
+        if (typing_keys.empty()) {
+            throw std::runtime_error("Keyboard map has no plain keys to type on");
+        }
+
+        std::mt19937_64 rng(config.seed);
+        const auto uniform = [&](const double low, const double high) { return std::uniform_real_distribution<double>(low, high)(rng); };
+        const auto pick = [&](const std::vector < key_id_t > & keys) { return keys[std::uniform_int_distribution<std::size_t>(0, keys.size() - 1)(rng)]; };
+
+        std::array < uint64_t, panel_slots > slot_free_at {};
+        std::map < key_id_t, uint64_t > key_free_at;
+        const auto free_slot = [&](const uint64_t at) -> int {
+            for (int slot = 0; slot < panel_slots; slot++) {
+                if (slot_free_at[slot] < at) return slot;
+            }
+            return -1;
+        };
+        const auto free_key = [&](const std::vector < key_id_t > & keys, const uint64_t at) -> long {
+            for (int attempt = 0; attempt < 8; attempt++) {
+                if (const auto key = pick(keys); key_free_at[key] < at) return key;
+            }
+            return -1;
+        };
+
+        schedule_t schedule;
+        const double interval_usec = 1000000.0 / config.rate;
+        const auto end_usec = static_cast<uint64_t>(config.seconds * 1000000);
+        // start late enough for a modifier to go down before the first stroke
+        for (auto t = static_cast<uint64_t>(interval_usec) + 20000;
+             t < end_usec; t += std::max<uint64_t>(1, static_cast<uint64_t>(interval_usec * uniform(0.7, 1.3))))
+        {
+            const int slot = free_slot(t);
+            if (slot == -1) {
+                schedule.skipped++;
+                continue;
+            }
+
+            if (uniform(0, 1) < config.touchpad && map.contains(KEY_ID_TOUCHPAD))
+            {
+                const auto & pad = map.at(KEY_ID_TOUCHPAD);
+                const auto hold = static_cast<uint64_t>(uniform(100000, 400000));
+                const double fy = uniform(0.2, 0.8);
+                schedule.touches.push_back(touch_at(pad, t, TOUCH_DOWN, slot, 0.25, fy));
+                for (uint64_t dt = swipe_motion_usec; dt < hold; dt += swipe_motion_usec) {
+                    schedule.touches.push_back(touch_at(pad, t + dt, TOUCH_MOTION, slot, 0.25 + 0.5 * dt / hold, fy));
+                }
+                schedule.touches.push_back(touch_at(pad, t + hold, TOUCH_UP, slot));
+                slot_free_at[slot] = t + hold;
+                schedule.swipes++;
+                continue;
+            }
+
+            const bool long_press = !long_keys.empty() && uniform(0, 1) < config.long_press;
+            const auto key = free_key(long_press ? long_keys : typing_keys, t);
+            if (key == -1) {
+                schedule.skipped++;
+                continue;
+            }
+
+            uint64_t hold;
+            if (long_press) {
+                hold = halo::long_press_delay_usec + static_cast<uint64_t>(uniform(80000, 1500000));
+            } else if (uniform(0, 1) < config.rollover) {
+                hold = static_cast<uint64_t>(interval_usec * uniform(1.2, 2.5));   // still down when the next one lands
+            } else {
+                hold = static_cast<uint64_t>(interval_usec * uniform(0.3, 0.8));
+            }
+            hold = std::max<uint64_t>(long_press ? hold : std::min(hold, max_stroke_usec), 1000);
+
+            schedule.touches.push_back(touch_at(map.at(key), t, TOUCH_DOWN, slot));
+            schedule.touches.push_back(touch_at(map.at(key), t + hold, TOUCH_UP, slot));
+            schedule.strokes.push_back({ static_cast<key_id_t>(key), hold });
+            slot_free_at[slot] = key_free_at[key] = t + hold;
+
+            // chord: modifier down a little before the key, up a little after
+            if (!modifier_keys.empty() && uniform(0, 1) < config.modifiers)
+            {
+                const uint64_t lead = std::min<uint64_t>(10000, static_cast<uint64_t>(interval_usec / 4) + 1);
+                const int mod_slot = free_slot(t - lead);
+                const auto modifier = free_key(modifier_keys, t - lead);
+                if (mod_slot != -1 && mod_slot != slot && modifier != -1)
+                {
+                    schedule.touches.push_back(touch_at(map.at(modifier), t - lead, TOUCH_DOWN, mod_slot));
+                    schedule.touches.push_back(touch_at(map.at(modifier), t + hold + lead, TOUCH_UP, mod_slot));
+                    slot_free_at[mod_slot] = key_free_at[modifier] = t + hold + lead;
+                }
+            }
+        }
+
+        std::ranges::stable_sort(schedule.touches, {}, &touch_event_t::time_usec);
+        return schedule;
+    }
+
+    // what came out of the core, checked against what went in
+    class accountant
+    {
+    private:
+        std::map < uint16_t, uint64_t > presses;    // typed keys, modifiers excluded
+        std::map < uint16_t, int32_t > key_state;
+        int64_t contacts = 0;
+
+    public:
+        void feed(const halo::output_t & output)
+        {
+            for (const auto & ev : output.keyboard)
+            {
+                if (ev.type != EV_KEY) continue;
+                key_state[ev.code] = ev.value;
+                if (ev.value == 1 && !SpecialKeys.contains(ev.code)) {
+                    presses[ev.code]++;
+                }
+            }
+
+            for (const auto & ev : output.touchpad)
+            {
+                if (ev.type == EV_KEY && ev.code == BTN_TOUCH) {
+                    contacts += ev.value ? 1 : -1;
+                }
+            }
+        }
+
+        // `tolerance` repeats either way per long press, for clocks that wake late
+        void settle(const schedule_t & schedule, const uint64_t tolerance, result_t & result)
+        {
+            std::map < uint16_t, std::pair < uint64_t, uint64_t > > expected; // key -> [min, max]
+            for (const auto & [key, hold] : schedule.strokes)
+            {
+                const auto repeats = expected_repeats(key, hold);
+                auto & [low, high] = expected[key];
+                low += 1 + (repeats > tolerance ? repeats - tolerance : 0);
+                high += 1 + (repeats > 0 ? repeats + tolerance : 0);
+            }
+
+            for (const auto & [key, range] : expected)
+            {
+                const auto seen = presses[key];
+                if (seen < range.first) result.dropped += range.first - seen;
+                if (seen > range.second) result.duplicated += seen - range.second;
+            }
+            for (const auto & [key, seen] : presses)
+            {
+                if (!expected.contains(key)) result.duplicated += seen;
+            }
+
+            result.stuck = std::ranges::count_if(key_state | std::views::values, [](const int32_t value) { return value != 0; })
+                + static_cast<uint64_t>(std::abs(contacts));
+        }
+    };
+
+    void summarize(const latency::histogram & delay, const latency::histogram & decision, result_t & result)
+    {
+        result.delay_p50 = delay.percentile(50);
+        result.delay_p99 = delay.percentile(99);
+        result.delay_max = delay.maximum();
+        result.decision_p50 = decision.percentile(50);
+        result.decision_p99 = decision.percentile(99);
+        result.decision_max = decision.maximum();
+    }
+
+    // as fast as the core goes: every touch lands on time, the wall clock tells the throughput
+    result_t run_virtual(const kbd_map & map, const schedule_t & schedule)
+    {
+        halo::core core(map);
+        halo::virtual_clock clock;
+        accountant books;
+        const auto decision = std::make_unique<latency::histogram>();
+        const auto delay = std::make_unique<latency::histogram>();
+        const auto sink = [&](const halo::output_t & output) { books.feed(output); };
+
+        const auto started = latency::now();
+        for (const auto & touch : schedule.touches)
+        {
+            halo::run_until(core, clock, touch.time_usec, sink);
+            const auto before = latency::now();
+            const auto output = core.touch(touch, clock.now_usec());
+            decision->record((latency::now() - before) / 1000);
+            delay->record(0);
+            books.feed(output);
+        }
+
+        result_t result;
+        result.wall_seconds = static_cast<double>(latency::now() - started) / 1e9;
+        books.settle(schedule, 0, result);
+        summarize(*delay, *decision, result);
+        return result;
+    }
+
+    // the driver loop as halo_kbd runs it, with a producer thread standing in for the kernel
+    result_t run_realtime(const kbd_map & map, const schedule_t & schedule)
+    {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            throw std::runtime_error(std::string("pipe2: ") + strerror(errno));
+        }
+        const int sink_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+        halo::monotonic_clock clock;
+        const uint64_t start_usec = clock.now_usec() + 10000;
+        std::thread producer([&] {
+            halo::monotonic_clock producer_clock;
+            for (auto touch : schedule.touches)
+            {
+                producer_clock.sleep_until(start_usec + touch.time_usec);
+                touch.time_usec = producer_clock.now_usec(); // what the kernel would stamp
+                if (write(fds[1], &touch, sizeof(touch)) != sizeof(touch)) {
+                    break;
+                }
+            }
+            close(fds[1]);
+        });
+
+        halo::core core(map);
+        accountant books;
+        const auto decision = std::make_unique<latency::histogram>();
+        const auto delay = std::make_unique<latency::histogram>();
+        result_t result;
+        const auto deliver = [&](const halo::output_t & output) {
+            books.feed(output);
+            if (!output.keyboard.empty()) emit_events(sink_fd, output.keyboard);
+            if (!output.touchpad.empty()) emit_events(sink_fd, output.touchpad);
+        };
+
+        std::array < touch_event_t, 64 > batch {};
+        bool open_end = true;
+        while (open_end)
+        {
+            const bool ready = clock.wait(fds[0], core.next_deadline());
+            deliver(core.tick(clock.now_usec()));
+            if (!ready) continue;
+
+            int pending = 0;
+            ioctl(fds[0], FIONREAD, &pending);
+            result.max_queue_depth = std::max<uint64_t>(result.max_queue_depth, pending / sizeof(touch_event_t));
+
+            const auto bytes = read(fds[0], batch.data(), sizeof(batch));
+            if (bytes <= 0) {
+                open_end = bytes < 0 && errno == EINTR;
+                continue;
+            }
+
+            for (std::size_t i = 0; i < static_cast<std::size_t>(bytes) / sizeof(touch_event_t); i++)
+            {
+                const uint64_t now = clock.now_usec();
+                delay->record(now - batch[i].time_usec);
+                const auto before = latency::now();
+                const auto output = core.touch(batch[i], now);
+                decision->record((latency::now() - before) / 1000);
+                deliver(output);
+            }
+        }
+
+        producer.join();
+        close(fds[0]);
+        close(sink_fd);
+
+        result.wall_seconds = static_cast<double>(clock.now_usec() - start_usec) / 1e6;
+        books.settle(schedule, 1, result);
+        summarize(*delay, *decision, result);
+        return result;
+    }
+
+    result_t run(const kbd_map & map, const config_t & config)
+    {
+        const auto schedule = generate(map, config);
+        auto result = config.realtime ? run_realtime(map, schedule) : run_virtual(map, schedule);
+        result.rate = config.rate;
+        result.touches = schedule.touches.size();
+        result.strokes = schedule.strokes.size();
+        result.swipes = schedule.swipes;
+        result.skipped = schedule.skipped;
+        return result;
+    }
+
+    // keeping up: nothing lost, and in real time the loop picks touches up within the delay budget,
+    // on a virtual clock the core handles the touches faster than they were typed
+    bool keeps_up(const config_t & config, const result_t & result)
+    {
+        if (!result.clean() || result.skipped * 10 > result.strokes) {
+            return false;
+        }
+
+        return config.realtime
+            ? static_cast<double>(result.delay_p99) <= config.max_delay_ms * 1000
+            : result.wall_seconds <= config.seconds;
+    }
+
+    void print(std::ostream & out, const result_t & r)
+    {
+        out << "    {\"rate\": " << r.rate << ", \"touches\": " << r.touches << ", \"strokes\": " << r.strokes
+            << ", \"swipes\": " << r.swipes << ", \"skipped\": " << r.skipped
+            << ", \"dropped\": " << r.dropped << ", \"duplicated\": " << r.duplicated << ", \"stuck\": " << r.stuck
+            << ", \"max_queue_depth\": " << r.max_queue_depth
+            << ", \"throughput_strokes_per_s\": " << (r.wall_seconds > 0 ? static_cast<double>(r.strokes) / r.wall_seconds : 0)
+            << ", \"delay_us\": {\"p50\": " << r.delay_p50 << ", \"p99\": " << r.delay_p99 << ", \"max\": " << r.delay_max << "}"
+            << ", \"decision_us\": {\"p50\": " << r.decision_p50 << ", \"p99\": " << r.decision_p99 << ", \"max\": " << r.decision_max << "}}";
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc != 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <keymap>" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        load::config_t config;
+        config.rate = load::env_double("HALO_LOAD_RATE", config.rate);
+        config.seconds = load::env_double("HALO_LOAD_SECONDS", config.seconds);
+        config.rollover = load::env_double("HALO_LOAD_ROLLOVER", config.rollover);
+        config.modifiers = load::env_double("HALO_LOAD_MODIFIERS", config.modifiers);
+        config.long_press = load::env_double("HALO_LOAD_LONG_PRESS", config.long_press);
+        config.touchpad = load::env_double("HALO_LOAD_TOUCHPAD", config.touchpad);
+        config.max_delay_ms = load::env_double("HALO_LOAD_MAX_DELAY_MS", config.max_delay_ms);
+        config.seed = static_cast<uint64_t>(load::env_double("HALO_LOAD_SEED", static_cast<double>(config.seed)));
+        if (const auto mode_env = std::getenv("HALO_LOAD_MODE"); mode_env != nullptr)
+        {
+            if (std::string(mode_env) != "virtual" && std::string(mode_env) != "realtime") {
+                throw std::runtime_error(std::string("Unknown HALO_LOAD_MODE ") + mode_env + ", expected virtual or realtime");
+            }
+            config.realtime = std::string(mode_env) == "realtime";
+        }
+        config.sweep = std::getenv("HALO_LOAD_SWEEP") != nullptr;
+        if (config.rate <= 0 || config.seconds <= 0) {
+            throw std::runtime_error("HALO_LOAD_RATE and HALO_LOAD_SECONDS must be positive");
+        }
+
+        std::ifstream map_file(argv[1]);
+        if (!map_file.is_open()) {
+            throw std::runtime_error(std::string("Cannot open keyboard map ") + argv[1]);
+        }
+        const auto map = read_key_map(map_file);
+
+        // sweep: double the rate until the driver stops keeping up, the last good rate is the sustainable one
+        std::vector < load::result_t > results;
+        double sustainable = 0;
+        while (true)
+        {
+            std::cerr << "load: " << config.rate << " strokes/s for " << config.seconds << "s ("
+                      << (config.realtime ? "realtime" : "virtual") << ")" << std::endl;
+            results.push_back(load::run(map, config));
+            const bool good = load::keeps_up(config, results.back());
+            if (good) sustainable = config.rate;
+            if (!config.sweep || !good || config.rate >= 100000) break;
+            config.rate *= 2;
+        }
+
+        std::cout << "{\n  \"map\": \"" << argv[1] << "\",\n  \"mode\": \"" << (config.realtime ? "realtime" : "virtual") << "\",\n";
+        if (config.sweep) std::cout << "  \"sustainable_rate\": " << sustainable << ",\n";
+        std::cout << "  \"runs\": [\n";
+        for (std::size_t i = 0; i < results.size(); i++)
+        {
+            load::print(std::cout, results[i]);
+            std::cout << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        std::cout << "  ]\n}" << std::endl;
+
+        return std::ranges::all_of(results, &load::result_t::clean) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    catch (const std::exception & e)
+    {
+        std::cerr << "halo_load: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
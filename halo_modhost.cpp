@@ -0,0 +1,202 @@
+/* halo_modhost.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+// halo_modhost: runs halo_kbd's modules in a process of their own (HALO_MODULE_HOST), see module_ring.h.
+// Started by the driver with the shared ring on fd 3 and the two eventfds on fds 4 and 5,
+// it loads the modules, hands them the frames the driver writes, and sends their emit_batch frames back.
+
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include "module_chain.h"
+#include "module_ring.h"
+#include "log.hpp"
+
+namespace
+{
+    module_ring::shared_t * shared = nullptr;
+    std::mutex to_driver_mutex; // modules may emit from their own threads
+
+    void wake(const int fd)
+    {
+        constexpr uint64_t one = 1;
+        [[maybe_unused]] const auto ignored = write(fd, &one, sizeof(one));
+    }
+
+    int emit(const module_ring::record_t * records, const uint32_t count)
+    {
+        std::lock_guard lock(to_driver_mutex);
+        if (!shared->to_driver.push(records, count)) {
+            return -1;
+        }
+
+        if (shared->to_driver.needs_wakeup()) {
+            wake(module_ring::to_driver_fd);
+        }
+        return 0;
+    }
+
+    void fail(const std::string & reason)
+    {
+        print_log(ERROR_LOG, reason, "\n");
+        std::strncpy(shared->error, reason.c_str(), sizeof(shared->error) - 1);
+        shared->state.store(module_ring::FAILED, std::memory_order_release);
+        wake(module_ring::to_driver_fd);
+    }
+}
+
+// the entry points libmod hands to the modules, in this process they go back through the ring
+extern "C"
+void normal_key_emit(const key_id_t key_id) noexcept
+{
+    const module_ring::record_t tap[] = {
+        { .time_usec = 0, .key_id = key_id, .value = 1, .flags = 0, .reserved = 0 },
+        { .time_usec = 0, .key_id = key_id, .value = 0, .flags = module_ring::FRAME_END, .reserved = 0 },
+    };
+    emit(tap, 2);
+}
+
+extern "C"
+int module_emit_batch(const halo_module_key_event * events, const size_t count) noexcept
+{
+    if (events == nullptr || count == 0 || count > HALO_MODULE_BATCH_MAX) {
+        return -1;
+    }
+
+    module_ring::record_t records[HALO_MODULE_BATCH_MAX];
+    for (size_t i = 0; i < count; i++)
+    {
+        if (events[i].key_id >= KEY_CNT || events[i].value < 0 || events[i].value > 2) {
+            return -1;
+        }
+        records[i] = { .time_usec = 0, .key_id = events[i].key_id, .value = events[i].value, .flags = 0, .reserved = 0 };
+    }
+
+    records[count - 1].flags = module_ring::FRAME_END;
+    return emit(records, static_cast<uint32_t>(count));
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc != 3)
+    {
+        print_log(ERROR_LOG, "Usage: ", argv[0], " <driver pid> <module.so[,module.so...]>, started by halo_kbd\n");
+        return EXIT_FAILURE;
+    }
+
+    // go down with the driver, even if it died before this line
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (std::to_string(getppid()) != argv[1]) {
+        return EXIT_FAILURE;
+    }
+
+    void * memory = mmap(nullptr, sizeof(module_ring::shared_t), PROT_READ | PROT_WRITE, MAP_SHARED, module_ring::shared_fd, 0);
+    if (memory == MAP_FAILED) {
+        print_log(ERROR_LOG, "Cannot map the module ring: ", strerror(errno), "\n");
+        return EXIT_FAILURE;
+    }
+
+    shared = static_cast<module_ring::shared_t *>(memory);
+    if (shared->magic != module_ring::magic) {
+        print_log(ERROR_LOG, "Module ring layout mismatch, halo_kbd and halo_modhost are from different builds\n");
+        return EXIT_FAILURE;
+    }
+
+    std::unique_ptr < module_chain > modules;
+    try
+    {
+        uint64_t budget_usec = 200;
+        if (const auto budget_env = std::getenv("HALO_MODULE_BUDGET_US"); budget_env != nullptr) {
+            budget_usec = std::strtoull(budget_env, nullptr, 10);
+        }
+        modules = std::make_unique<module_chain>(module_chain::parse(argv[2], budget_usec));
+    }
+    catch (const std::exception & e)
+    {
+        fail(e.what());
+        return EXIT_FAILURE;
+    }
+
+    if (modules->has_filters()) {
+        print_log(WARNING_LOG, "[WARNING] Filters do not run out of process, module_key_filter is not called\n");
+    }
+
+    shared->interest = modules->interest();
+    shared->state.store(module_ring::READY, std::memory_order_release);
+    wake(module_ring::to_driver_fd);
+
+    std::vector < input_event > frame;
+    frame.reserve(HALO_MODULE_BATCH_MAX);
+    module_ring::record_t record { };
+    while (true)
+    {
+        while (shared->to_host.pop(record))
+        {
+            if ((record.flags & module_ring::FN_SLOT) != 0)
+            {
+                if (const auto module = modules->fn_owner(record.key_id); module == nullptr) {
+                    // a slot no module claimed, the driver is confused
+                } else if (module->api().abi_version == 1) {
+                    module->api().fn_key_handler_vector(record.key_id);
+                } else {
+                    module->queue_fn_key(record.key_id);
+                }
+            }
+            else
+            {
+                input_event ev { };
+                ev.type = EV_KEY;
+                ev.code = static_cast<uint16_t>(record.key_id);
+                ev.value = record.value;
+                frame.push_back(ev);
+            }
+
+            if ((record.flags & module_ring::FRAME_END) != 0)
+            {
+                modules->dispatch(frame, record.time_usec);
+                frame.clear();
+            }
+        }
+
+        if (shared->stopping.load(std::memory_order_acquire) != 0) {
+            break;
+        }
+
+        if (shared->to_host.prepare_sleep())
+        {
+            pollfd fd { module_ring::to_host_fd, POLLIN, 0 };
+            poll(&fd, 1, -1);
+            uint64_t count;
+            [[maybe_unused]] const auto ignored = read(module_ring::to_host_fd, &count, sizeof(count));
+            shared->to_host.woke_up();
+        }
+    }
+
+    modules.reset();
+    return EXIT_SUCCESS;
+}
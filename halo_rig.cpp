@@ -0,0 +1,592 @@
+/* halo_rig.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+// Loopback rig: simulates the Halo touch panel with a uinput multitouch device (1046:9110),
+// plays scripted touches on it and reads what halo_kbd writes to "Halo Keyboard" and "Halo TouchPad"
+// back through evdev, checking the result and measuring touch-to-event latency through libinput
+// and the kernel. Runs on any machine with /dev/uinput, as a user allowed to use it.
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <ranges>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include "map_reader.h"
+#include "emit_keys.h"
+#include "key_id.h"
+
+extern char ** environ;
+
+namespace rig
+{
+    // the driver maps panel coordinates into a 1920x2400 space (see the libinput loop in entry.cpp),
+    // advertising exactly that range makes keymap coordinates and raw axis values the same
+    constexpr int panel_width = 1920;
+    constexpr int panel_height = 2400;
+    constexpr int panel_slots = 10;
+    constexpr int panel_resolution = 10; // units/mm, only keeps libinput from guessing a size
+
+    constexpr int long_press_delay_ms = 500;
+    constexpr int long_press_interval_ms = 80;
+
+    std::chrono::milliseconds timeout(1000);
+    std::chrono::milliseconds settle(100);
+
+    int64_t monotonic_usec()
+    {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    int64_t event_usec(const input_event & ev)
+    {
+        return static_cast<int64_t>(ev.input_event_sec) * 1000000 + ev.input_event_usec;
+    }
+
+    class panel_t
+    {
+    private:
+        int fd = -1;
+        int next_tracking_id = 0;
+        int active = 0;
+
+        void write_event(const uint16_t type, const uint16_t code, const int32_t value) const
+        {
+            input_event ev{};
+            ev.type = type;
+            ev.code = code;
+            ev.value = value;
+            assert_throw(write(fd, &ev, sizeof(ev)) == sizeof(ev));
+        }
+
+        static void abs_setup(const int fd, const uint16_t code, const int maximum, const int resolution)
+        {
+            uinput_abs_setup abs{};
+            abs.code = code;
+            abs.absinfo.minimum = 0;
+            abs.absinfo.maximum = maximum;
+            abs.absinfo.resolution = resolution;
+            assert_throw(ioctl(fd, UI_ABS_SETUP, &abs) != -1);
+        }
+
+    public:
+        panel_t()
+        {
+            fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd < 0) {
+                throw std::runtime_error("Unable to open /dev/uinput");
+            }
+
+            assert_throw(ioctl(fd, UI_SET_EVBIT, EV_KEY) != -1);
+            assert_throw(ioctl(fd, UI_SET_EVBIT, EV_ABS) != -1);
+            assert_throw(ioctl(fd, UI_SET_EVBIT, EV_SYN) != -1);
+            assert_throw(ioctl(fd, UI_SET_KEYBIT, BTN_TOUCH) != -1);
+            for (const auto code : { ABS_X, ABS_Y, ABS_MT_SLOT, ABS_MT_TRACKING_ID, ABS_MT_POSITION_X, ABS_MT_POSITION_Y }) {
+                assert_throw(ioctl(fd, UI_SET_ABSBIT, code) != -1);
+            }
+            assert_throw(ioctl(fd, UI_SET_PROPBIT, INPUT_PROP_DIRECT) != -1); // a touchscreen, like the panel
+
+            uinput_setup setup{};
+            setup.id.bustype = BUS_I2C;
+            setup.id.vendor  = 1046;
+            setup.id.product = 9110;
+            std::strcpy(setup.name, "Halo Panel Simulator");
+            assert_throw(ioctl(fd, UI_DEV_SETUP, &setup) != -1);
+
+            abs_setup(fd, ABS_X, panel_width - 1, panel_resolution);
+            abs_setup(fd, ABS_Y, panel_height - 1, panel_resolution);
+            abs_setup(fd, ABS_MT_POSITION_X, panel_width - 1, panel_resolution);
+            abs_setup(fd, ABS_MT_POSITION_Y, panel_height - 1, panel_resolution);
+            abs_setup(fd, ABS_MT_SLOT, panel_slots - 1, 0);
+            abs_setup(fd, ABS_MT_TRACKING_ID, 65535, 0);
+
+            if (ioctl(fd, UI_DEV_CREATE) == -1) {
+                close(fd);
+                throw std::runtime_error("UI_DEV_CREATE failed");
+            }
+        }
+
+        ~panel_t()
+        {
+            ioctl(fd, UI_DEV_DESTROY);
+            close(fd);
+        }
+
+        panel_t(const panel_t &) = delete;
+        panel_t & operator=(const panel_t &) = delete;
+
+        // every call writes one frame and returns the monotonic time right after its SYN_REPORT
+        int64_t down(const int slot, const double x, const double y)
+        {
+            write_event(EV_ABS, ABS_MT_SLOT, slot);
+            write_event(EV_ABS, ABS_MT_TRACKING_ID, next_tracking_id++ & 0xffff);
+            write_event(EV_ABS, ABS_MT_POSITION_X, static_cast<int>(x));
+            write_event(EV_ABS, ABS_MT_POSITION_Y, static_cast<int>(y));
+            if (active++ == 0) {
+                write_event(EV_KEY, BTN_TOUCH, 1);
+            }
+            write_event(EV_ABS, ABS_X, static_cast<int>(x));
+            write_event(EV_ABS, ABS_Y, static_cast<int>(y));
+            write_event(EV_SYN, SYN_REPORT, 0);
+            return monotonic_usec();
+        }
+
+        int64_t move(const int slot, const double x, const double y) const
+        {
+            write_event(EV_ABS, ABS_MT_SLOT, slot);
+            write_event(EV_ABS, ABS_MT_POSITION_X, static_cast<int>(x));
+            write_event(EV_ABS, ABS_MT_POSITION_Y, static_cast<int>(y));
+            write_event(EV_ABS, ABS_X, static_cast<int>(x));
+            write_event(EV_ABS, ABS_Y, static_cast<int>(y));
+            write_event(EV_SYN, SYN_REPORT, 0);
+            return monotonic_usec();
+        }
+
+        int64_t up(const int slot)
+        {
+            write_event(EV_ABS, ABS_MT_SLOT, slot);
+            write_event(EV_ABS, ABS_MT_TRACKING_ID, -1);
+            if (--active == 0) {
+                write_event(EV_KEY, BTN_TOUCH, 0);
+            }
+            write_event(EV_SYN, SYN_REPORT, 0);
+            return monotonic_usec();
+        }
+    };
+
+    // an evdev node of one of the driver's virtual devices
+    class output_device_t
+    {
+    private:
+        int fd = -1;
+
+    public:
+        std::vector < input_event > events;
+
+        explicit output_device_t(const std::string & name)
+        {
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            while (std::chrono::steady_clock::now() < deadline)
+            {
+                for (const auto & entry : std::filesystem::directory_iterator("/dev/input"))
+                {
+                    if (!entry.path().filename().string().starts_with("event")) {
+                        continue;
+                    }
+
+                    const int candidate = open(entry.path().c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+                    if (candidate < 0) {
+                        continue;
+                    }
+
+                    char device_name[256] = { };
+                    if (ioctl(candidate, EVIOCGNAME(sizeof(device_name) - 1), device_name) >= 0 && name == device_name)
+                    {
+                        // timestamps comparable with monotonic_usec()
+                        int clock = CLOCK_MONOTONIC;
+                        assert_throw(ioctl(candidate, EVIOCSCLOCKID, &clock) == 0);
+                        fd = candidate;
+                        return;
+                    }
+                    close(candidate);
+                }
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+
+            throw std::runtime_error("Device \"" + name + "\" did not show up, is halo_kbd running?");
+        }
+
+        ~output_device_t()
+        {
+            close(fd);
+        }
+
+        output_device_t(const output_device_t &) = delete;
+        output_device_t & operator=(const output_device_t &) = delete;
+
+        [[nodiscard]] int descriptor() const { return fd; }
+
+        void drain()
+        {
+            input_event buffer[64];
+            ssize_t len;
+            while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+                events.insert(events.end(), buffer, buffer + len / sizeof(input_event));
+            }
+        }
+    };
+
+    // collects events from both devices until nothing arrived for `settle`, or `timeout` passed
+    void collect(output_device_t & keyboard, output_device_t & touchpad)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        auto quiet_since = std::chrono::steady_clock::now();
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            pollfd fds[2] = {
+                { .fd = keyboard.descriptor(), .events = POLLIN, .revents = 0 },
+                { .fd = touchpad.descriptor(), .events = POLLIN, .revents = 0 },
+            };
+
+            if (poll(fds, 2, 10) > 0)
+            {
+                keyboard.drain();
+                touchpad.drain();
+                quiet_since = std::chrono::steady_clock::now();
+            }
+            else if (std::chrono::steady_clock::now() - quiet_since >= settle) {
+                return;
+            }
+        }
+    }
+
+    struct step_t {
+        std::string line;
+        std::string action;
+        std::vector < int > args;
+    };
+
+    struct result_t {
+        bool passed = false;
+        int64_t latency_usec = -1;
+        std::string detail;
+    };
+
+    std::pair < double, double > center_of(const kbd_map & map, const int key)
+    {
+        const auto it = map.find(key);
+        if (it == map.end()) {
+            throw std::invalid_argument("Key " + std::to_string(key) + " is not in the keymap");
+        }
+        const auto & location = it->second;
+        return { (location.key_pixel_top_left_x + location.key_pixel_bottom_right_x) / 2,
+                 (location.key_pixel_top_left_y + location.key_pixel_bottom_right_y) / 2 };
+    }
+
+    // key presses (value 1) and releases (value 0) of `events`, autorepeat (value 2) dropped
+    std::vector < input_event > key_transitions(const std::vector < input_event > & events)
+    {
+        std::vector < input_event > result;
+        std::ranges::copy_if(events, std::back_inserter(result),
+            [](const input_event & ev) { return ev.type == EV_KEY && ev.value != 2; });
+        return result;
+    }
+
+    bool all_released(const std::vector < input_event > & transitions)
+    {
+        std::map < int, int > state;
+        for (const auto & ev : transitions) {
+            state[ev.code] = ev.value;
+        }
+        return std::ranges::all_of(state | std::views::values, [](const int value) { return value == 0; });
+    }
+
+    int64_t first_press_after(const std::vector < input_event > & transitions, const int code, const int64_t since)
+    {
+        const auto it = std::ranges::find_if(transitions,
+            [&](const input_event & ev) { return ev.code == code && ev.value == 1 && event_usec(ev) >= since; });
+        return it == transitions.end() ? -1 : event_usec(*it) - since;
+    }
+
+    result_t run_step(const step_t & step, const kbd_map & map, panel_t & panel,
+        output_device_t & keyboard, output_device_t & touchpad)
+    {
+        keyboard.events.clear();
+        touchpad.events.clear();
+        result_t result;
+
+        if (step.action == "wait")
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(step.args.at(0)));
+            result.passed = true;
+            return result;
+        }
+
+        if (step.action == "tap" || step.action == "hold")
+        {
+            const int key = step.args.at(0);
+            const int hold_ms = step.action == "tap" ? 30 : step.args.at(1);
+            const auto [x, y] = center_of(map, key);
+            const auto touch_time = panel.down(0, x, y);
+            std::this_thread::sleep_for(std::chrono::milliseconds(hold_ms));
+            const auto release_time = panel.up(0);
+            collect(keyboard, touchpad);
+
+            const auto transitions = key_transitions(keyboard.events);
+            const auto presses = std::ranges::count_if(transitions,
+                [&](const input_event & ev) { return ev.code == key && ev.value == 1; });
+            const auto foreign = std::ranges::count_if(transitions,
+                [&](const input_event & ev) { return ev.code != key; });
+
+            // Win only goes out on release when nothing was pressed with it
+            result.latency_usec = first_press_after(transitions, key, key == KEY_ID_WIN ? release_time : touch_time);
+
+            long expected_presses = 1;
+            if (step.action == "hold" && std::ranges::find(keys_supporting_long_press, key) != keys_supporting_long_press.end()
+                && hold_ms > long_press_delay_ms + long_press_interval_ms)
+            {
+                // the driver loop sleeps until the next repeat is due, so every repeat comes on time: one after
+                // the delay and one per interval after that. Only a repeat due within release_slack_ms of the
+                // release may lose the race against it and is not counted on
+                constexpr int release_slack_ms = 10;
+                expected_presses += (hold_ms - long_press_delay_ms - release_slack_ms) / long_press_interval_ms + 1;
+            }
+
+            result.passed = presses >= expected_presses && foreign == 0 && all_released(transitions)
+                && touchpad.events.empty() && result.latency_usec >= 0;
+            result.detail = "presses=" + std::to_string(presses) + " expected>=" + std::to_string(expected_presses)
+                + " foreign=" + std::to_string(foreign) + " touchpad_events=" + std::to_string(touchpad.events.size());
+            return result;
+        }
+
+        if (step.action == "chord")
+        {
+            const int modifier = step.args.at(0);
+            const int key = step.args.at(1);
+            const auto [mx, my] = center_of(map, modifier);
+            const auto [kx, ky] = center_of(map, key);
+            panel.down(0, mx, my);
+            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+            const auto touch_time = panel.down(1, kx, ky);
+            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+            panel.up(1);
+            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+            panel.up(0);
+            collect(keyboard, touchpad);
+
+            // the key has to go down while the modifier is held
+            const auto transitions = key_transitions(keyboard.events);
+            bool modifier_down = false, combined = false;
+            for (const auto & ev : transitions)
+            {
+                if (ev.code == modifier) modifier_down = ev.value == 1;
+                if (ev.code == key && ev.value == 1 && modifier_down) combined = true;
+            }
+
+            result.latency_usec = first_press_after(transitions, key, touch_time);
+            result.passed = combined && all_released(transitions) && result.latency_usec >= 0;
+            result.detail = std::string("combined=") + (combined ? "yes" : "no")
+                + " released=" + (all_released(transitions) ? "yes" : "no");
+            return result;
+        }
+
+        if (step.action == "swipe" || step.action == "click")
+        {
+            const int key = step.action == "swipe" ? KEY_ID_TOUCHPAD : step.args.at(0);
+            const auto [x, y] = center_of(map, key);
+            const auto touch_time = panel.down(0, x, y);
+            if (step.action == "swipe")
+            {
+                const auto & area = map.at(KEY_ID_TOUCHPAD);
+                const double width = area.key_pixel_bottom_right_x - area.key_pixel_top_left_x;
+                for (int i = 1; i <= 10; i++)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(8));
+                    panel.move(0, x - width / 4 + width / 2 * i / 10, y);
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+            panel.up(0);
+            collect(keyboard, touchpad);
+
+            const auto first = std::ranges::find_if(touchpad.events, [](const input_event & ev) {
+                return ev.type == EV_ABS || ev.type == EV_KEY;
+            });
+            if (first != touchpad.events.end()) {
+                result.latency_usec = event_usec(*first) - touch_time;
+            }
+
+            bool contact = false, lifted = false, clicked = false;
+            for (const auto & ev : touchpad.events)
+            {
+                if (ev.type == EV_ABS && ev.code == ABS_MT_TRACKING_ID) (ev.value >= 0 ? contact : lifted) = true;
+                if (ev.type == EV_KEY && ev.code == key && ev.value == 1) clicked = true;
+            }
+
+            result.passed = keyboard.events.empty() && result.latency_usec >= 0
+                && (step.action == "swipe" ? contact && lifted : clicked);
+            result.detail = "touchpad_events=" + std::to_string(touchpad.events.size())
+                + " keyboard_events=" + std::to_string(keyboard.events.size());
+            return result;
+        }
+
+        throw std::invalid_argument("Unknown action in \"" + step.line + "\"");
+    }
+
+    std::vector < step_t > read_script(std::istream & in)
+    {
+        std::vector < step_t > steps;
+        std::string line;
+        while (std::getline(in, line))
+        {
+            if (const auto comment = line.find('#'); comment != std::string::npos) {
+                line.erase(comment);
+            }
+
+            std::stringstream ss(line);
+            step_t step { .line = line, .action = {}, .args = {} };
+            if (!(ss >> step.action)) {
+                continue;
+            }
+            int arg;
+            while (ss >> arg) {
+                step.args.push_back(arg);
+            }
+            steps.push_back(step);
+        }
+        return steps;
+    }
+
+    // every key once, a chord, a long press, a swipe and both touchpad buttons
+    std::vector < step_t > default_script(const kbd_map & map)
+    {
+        std::stringstream script;
+        for (const auto key : map | std::views::keys)
+        {
+            if (key != KEY_ID_TOUCHPAD && key != KEY_ID_MOUSELEFT && key != KEY_ID_MOUSERIGHT) {
+                script << "tap " << key << "\n";
+            }
+        }
+        if (map.contains(KEY_ID_LCTRL) && map.contains(KEY_ID_C)) script << "chord " << KEY_ID_LCTRL << " " << KEY_ID_C << "\n";
+        if (map.contains(KEY_ID_SPACE)) script << "hold " << KEY_ID_SPACE << " 900\n";
+        if (map.contains(KEY_ID_TOUCHPAD)) script << "swipe\n";
+        if (map.contains(KEY_ID_MOUSELEFT)) script << "click " << KEY_ID_MOUSELEFT << "\n";
+        if (map.contains(KEY_ID_MOUSERIGHT)) script << "click " << KEY_ID_MOUSERIGHT << "\n";
+        return read_script(script);
+    }
+
+    int64_t percentile(const std::vector < int64_t > & sorted, const double p)
+    {
+        if (sorted.empty()) return 0;
+        const auto index = static_cast<std::size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+        return sorted[std::min(index, sorted.size() - 1)];
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <keymap> [script]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (const auto timeout_env = std::getenv("HALO_RIG_TIMEOUT_MS"); timeout_env != nullptr) {
+        rig::timeout = std::chrono::milliseconds(std::strtoul(timeout_env, nullptr, 10));
+    }
+
+    pid_t daemon = -1;
+    try
+    {
+        std::ifstream map_file(argv[1]);
+        if (!map_file.is_open()) {
+            throw std::runtime_error(std::string("Cannot open keyboard map ") + argv[1]);
+        }
+        const auto map = read_key_map(map_file);
+
+        std::vector < rig::step_t > steps;
+        if (argc > 2)
+        {
+            std::ifstream script(argv[2]);
+            if (!script.is_open()) {
+                throw std::runtime_error(std::string("Cannot open script ") + argv[2]);
+            }
+            steps = rig::read_script(script);
+        } else {
+            steps = rig::default_script(map);
+        }
+
+        rig::panel_t panel;
+
+        // HALO_RIG_EXEC=/path/to/halo_kbd starts the driver under test, otherwise a running one is used
+        if (const auto exec_env = std::getenv("HALO_RIG_EXEC"); exec_env != nullptr)
+        {
+            char * const daemon_argv[] = { exec_env, argv[1], nullptr };
+            if (const int err = posix_spawn(&daemon, exec_env, nullptr, nullptr, daemon_argv, environ); err != 0) {
+                daemon = -1;
+                throw std::runtime_error(std::string("Cannot start ") + exec_env + ": " + strerror(err));
+            }
+        }
+
+        rig::output_device_t keyboard("Halo Keyboard");
+        rig::output_device_t touchpad("Halo TouchPad");
+        // let the driver's libinput context pick up the panel before the first touch
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        keyboard.drain();
+        touchpad.drain();
+
+        int checked = 0, failed = 0;
+        std::vector < int64_t > latencies;
+        for (const auto & step : steps)
+        {
+            const auto [passed, latency_usec, detail] = rig::run_step(step, map, panel, keyboard, touchpad);
+            if (step.action == "wait") {
+                continue;
+            }
+
+            checked++;
+            if (!passed) failed++;
+            if (latency_usec >= 0) latencies.push_back(latency_usec);
+            std::cout << (passed ? "PASS " : "FAIL ") << step.line
+                      << "  latency_us=" << latency_usec << "  " << detail << std::endl;
+        }
+
+        std::ranges::sort(latencies);
+        std::cout << "\n" << checked << " steps, " << failed << " failed\n"
+                  << "touch-to-event latency (us): p50=" << rig::percentile(latencies, 0.50)
+                  << " p90=" << rig::percentile(latencies, 0.90)
+                  << " p99=" << rig::percentile(latencies, 0.99)
+                  << " max=" << (latencies.empty() ? 0 : latencies.back()) << std::endl;
+
+        if (daemon != -1)
+        {
+            kill(daemon, SIGINT);
+            waitpid(daemon, nullptr, 0);
+        }
+        return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    catch (const std::exception & e)
+    {
+        std::cerr << "halo_rig: " << e.what() << std::endl;
+        if (daemon != -1)
+        {
+            kill(daemon, SIGINT);
+            waitpid(daemon, nullptr, 0);
+        }
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,239 @@
+/* halo_session.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+// halo_session: the user session helper, see session.h for the protocol.
+// Runs as a systemd user service so it has the session's environment (WAYLAND_DISPLAY,
+// DBUS_SESSION_BUS_ADDRESS, ...) and launches whatever halo_kbd asks for right there.
+
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "session.h"
+#include "log.hpp"
+
+extern char ** environ;
+
+namespace
+{
+    std::atomic_bool stop = false;
+
+    void stop_handler(int)
+    {
+        stop = true;
+    }
+
+    // detached from the helper: own session, stdio on /dev/null, default signals
+    std::string launch(const std::vector < std::string > & argv)
+    {
+        std::vector < char * > args;
+        for (const auto & arg : argv) {
+            args.push_back(const_cast<char *>(arg.c_str()));
+        }
+        args.push_back(nullptr);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        sigset_t mask;
+        sigemptyset(&mask);
+        posix_spawnattr_setsigmask(&attr, &mask);
+        for (const int sig : { SIGCHLD, SIGINT, SIGTERM, SIGPIPE }) {
+            sigaddset(&mask, sig);
+        }
+        posix_spawnattr_setsigdefault(&attr, &mask);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+        pid_t pid = -1;
+        const int error = posix_spawnp(&pid, args.front(), &actions, &attr, args.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+
+        if (error != 0)
+        {
+            print_log(WARNING_LOG, "[WARNING] Cannot launch ", argv.front(), ": ", strerror(error), "\n");
+            return session::encode({ "error", strerror(error) });
+        }
+
+        print_log(INFO_LOG, "Launched ", argv.front(), " (pid=", pid, ")\n");
+        return session::encode({ "ok", std::to_string(pid) });
+    }
+
+    std::string handle(const std::vector < std::string > & request)
+    {
+        if (request.empty()) {
+            return session::encode({ "error", "empty request" });
+        }
+
+        if (request.front() == "ping") {
+            return session::encode({ "ok" });
+        }
+
+        if (request.front() == "launch")
+        {
+            if (request.size() < 2) {
+                return session::encode({ "error", "nothing to launch" });
+            }
+            return launch({ request.begin() + 1, request.end() });
+        }
+
+        return session::encode({ "error", "unknown request " + request.front() });
+    }
+
+    // only root (halo_kbd) and the session's own user may ask for anything
+    bool trusted(const int fd)
+    {
+        ucred credentials {};
+        socklen_t length = sizeof(credentials);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1) {
+            return false;
+        }
+
+        return credentials.uid == 0 || credentials.uid == getuid();
+    }
+}
+
+int main()
+{
+    try
+    {
+        std::string path;
+        if (const auto path_env = std::getenv("HALO_SESSION_SOCKET"); path_env != nullptr) {
+            path = path_env;
+        } else if (const auto runtime_dir = std::getenv("XDG_RUNTIME_DIR"); runtime_dir != nullptr) {
+            path = std::string(runtime_dir) + "/halo-session.sock";
+        } else {
+            throw std::runtime_error("Neither HALO_SESSION_SOCKET nor XDG_RUNTIME_DIR is set, is this a user session?");
+        }
+
+        sockaddr_un address { .sun_family = AF_UNIX, .sun_path = {} };
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path too long: " + path);
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (listener == -1) {
+            throw std::runtime_error(std::string("socket: ") + strerror(errno));
+        }
+
+        // a socket left behind by a crashed helper
+        unlink(path.c_str());
+        const auto old_mask = umask(0077);
+        const int bound = bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+        umask(old_mask);
+        if (bound == -1 || listen(listener, 4) == -1) {
+            throw std::runtime_error("Cannot listen on " + path + ": " + strerror(errno));
+        }
+
+        // launched programs are never waited for, the kernel reaps them
+        struct sigaction reaper {};
+        reaper.sa_handler = SIG_DFL;
+        reaper.sa_flags = SA_NOCLDWAIT;
+        sigaction(SIGCHLD, &reaper, nullptr);
+
+        struct sigaction stopper {};
+        stopper.sa_handler = stop_handler;
+        sigaction(SIGINT, &stopper, nullptr);
+        sigaction(SIGTERM, &stopper, nullptr);
+        std::signal(SIGPIPE, SIG_IGN);
+
+        print_log(INFO_LOG, "Session helper listening on ", path, "\n");
+
+        std::vector < pollfd > fds = { { listener, POLLIN, 0 } };
+        std::map < int, std::string > pending; // partial request per connection
+        while (!stop)
+        {
+            if (poll(fds.data(), fds.size(), -1) == -1)
+            {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("poll: ") + strerror(errno));
+            }
+
+            for (std::size_t i = 1; i < fds.size(); i++)
+            {
+                if (fds[i].revents == 0) continue;
+
+                const int fd = fds[i].fd;
+                char buffer[1024];
+                const ssize_t count = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+                if (count > 0)
+                {
+                    auto & requests = pending[fd];
+                    requests.append(buffer, count);
+                    for (std::size_t end; (end = requests.find('\n')) != std::string::npos; requests.erase(0, end + 1))
+                    {
+                        const auto reply = handle(session::decode(std::string_view(requests).substr(0, end)));
+                        send(fd, reply.data(), reply.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                    }
+                    continue;
+                }
+
+                if (count == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+
+                print_log(DEBUG_LOG, "Connection ", fd, " closed\n");
+                close(fd);
+                pending.erase(fd);
+                fds[i].fd = -1;
+            }
+            std::erase_if(fds, [](const pollfd & pfd) { return pfd.fd == -1; });
+
+            if (fds.front().revents & POLLIN)
+            {
+                for (int fd; (fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1;)
+                {
+                    if (!trusted(fd))
+                    {
+                        print_log(WARNING_LOG, "[WARNING] Refused a connection from an unexpected user\n");
+                        close(fd);
+                        continue;
+                    }
+
+                    print_log(DEBUG_LOG, "Connection ", fd, " accepted\n");
+                    fds.push_back({ fd, POLLIN, 0 });
+                }
+            }
+        }
+
+        print_log(INFO_LOG, "Session helper stopping\n");
+        unlink(path.c_str());
+        return EXIT_SUCCESS;
+    }
+    catch (const std::exception & e)
+    {
+        print_log(ERROR_LOG, "halo_session: ", e.what(), "\n");
+        return EXIT_FAILURE;
+    }
+}
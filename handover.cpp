@@ -0,0 +1,342 @@
+/* handover.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "handover.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "log.hpp"
+
+extern char ** environ;
+
+namespace {
+    // the devices allow typing anything, so only a process of the same user gets them
+    pid_t same_user_pid(const int sock)
+    {
+        ucred credentials { };
+        socklen_t length = sizeof(credentials);
+        if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1 || credentials.uid != geteuid()) {
+            return -1;
+        }
+        return credentials.pid;
+    }
+
+    bool wait_readable(const int fd, const std::chrono::milliseconds timeout)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (true)
+        {
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0) {
+                return false;
+            }
+
+            pollfd pfd { .fd = fd, .events = POLLIN, .revents = 0 };
+            const int ret = poll(&pfd, 1, static_cast<int>(left.count()));
+            if (ret > 0) {
+                return true;
+            }
+            if (ret < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    sockaddr_un address_of(const std::string & path)
+    {
+        sockaddr_un address { .sun_family = AF_UNIX, .sun_path = {} };
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Handover socket path too long: " + path);
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return address;
+    }
+}
+
+std::string handover::socket_path()
+{
+    if (const auto path_env = std::getenv("HALO_HANDOVER_SOCKET"); path_env != nullptr) {
+        return path_env;
+    }
+
+    return "/run/halo_kbd/handover.sock";
+}
+
+handover::server::server(std::string path_) : path(std::move(path_))
+{
+    const auto address = address_of(path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listen_fd == -1) {
+        throw std::runtime_error(std::string("Cannot create handover socket: ") + strerror(errno));
+    }
+
+    // the socket of a process that handed over to us, or of one that crashed
+    unlink(path.c_str());
+    if (bind(listen_fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1
+        || chmod(path.c_str(), 0600) == -1
+        || listen(listen_fd, 1) == -1)
+    {
+        const std::string reason = strerror(errno);
+        close(listen_fd);
+        throw std::runtime_error("Cannot listen for handovers at " + path + ": " + reason);
+    }
+
+    struct stat bound { };
+    if (stat(path.c_str(), &bound) == 0) {
+        socket_inode = bound.st_ino;
+    }
+}
+
+handover::server::server(std::string path_, const int listen_fd_) : path(std::move(path_)), listen_fd(listen_fd_)
+{
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+}
+
+handover::server::~server()
+{
+    if (peer != -1) {
+        close(peer);
+    }
+    if (connection != -1) {
+        close(connection);
+    }
+
+    // a successor already replaced the socket file with its own, leave that one alone
+    struct stat current { };
+    if (socket_inode != 0 && stat(path.c_str(), &current) == 0 && current.st_ino == socket_inode) {
+        unlink(path.c_str());
+    }
+    close(listen_fd);
+}
+
+int handover::server::accept_connection()
+{
+    const int sock = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (sock == -1) {
+        return -1;
+    }
+
+    const pid_t pid = same_user_pid(sock);
+    if (peer != -1 || connection != -1 || pid == -1)
+    {
+        print_log(WARNING_LOG, "[WARNING] Ignored a handover request", peer != -1 || connection != -1 ? ", one is already pending" : "", "\n");
+        close(sock);
+        return -1;
+    }
+
+    connection = sock;
+    connection_pid = pid;
+    connection_deadline = std::chrono::steady_clock::now() + request_timeout;
+    request_received = 0;
+    return connection;
+}
+
+void handover::server::drop_connection()
+{
+    close(connection);
+    connection = -1;
+    connection_pid = -1;
+}
+
+bool handover::server::read_request()
+{
+    if (connection == -1) {
+        return false;
+    }
+
+    const auto received = recv(connection, reinterpret_cast<char *>(&request) + request_received, sizeof(request) - request_received, 0);
+    if (received == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return false;
+    }
+
+    if (received > 0) {
+        request_received += static_cast<std::size_t>(received);
+    }
+    if (received > 0 && request_received < sizeof(request)) {
+        return false;
+    }
+
+    if (received <= 0 || request.magic != magic)
+    {
+        print_log(WARNING_LOG, "[WARNING] Ignored a handover request\n");
+        drop_connection();
+        return false;
+    }
+
+    peer = std::exchange(connection, -1);
+    peer_pid = std::exchange(connection_pid, -1);
+    return true;
+}
+
+void handover::server::expire_connection()
+{
+    if (connection != -1 && std::chrono::steady_clock::now() >= connection_deadline)
+    {
+        print_log(WARNING_LOG, "[WARNING] Ignored a handover request, nothing was sent in ", request_timeout.count(), "ms\n");
+        drop_connection();
+    }
+}
+
+bool handover::server::hand_over(const int vkbd_fd, const int mouse_fd, const int lock_fd, const state_t & state,
+    const std::chrono::milliseconds timeout)
+{
+    const int fds[3] = { vkbd_fd, mouse_fd, lock_fd };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] { };
+    iovec data { .iov_base = const_cast<state_t *>(&state), .iov_len = sizeof(state) };
+    msghdr message { };
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    cmsghdr * header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+    char confirmation = 0;
+    const bool confirmed = sendmsg(peer, &message, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(state))
+        && wait_readable(peer, timeout)
+        && recv(peer, &confirmation, 1, 0) == 1;
+
+    close(peer);
+    peer = -1;
+    return confirmed;
+}
+
+handover::devices_t handover::take_over(const std::string & path, const std::chrono::milliseconds timeout)
+{
+    const auto address = address_of(path);
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        throw std::runtime_error(std::string("Cannot create handover socket: ") + strerror(errno));
+    }
+
+    const auto fail = [sock, &path](const std::string & reason)
+    {
+        close(sock);
+        throw std::runtime_error("Handover from " + path + " failed: " + reason);
+    };
+
+    const request_t request { .magic = magic };
+    if (connect(sock, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1) {
+        fail(strerror(errno));
+    }
+    if (send(sock, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+        fail(strerror(errno));
+    }
+    if (!wait_readable(sock, timeout)) {
+        fail("no reply");
+    }
+
+    devices_t devices;
+    alignas(cmsghdr) char control[CMSG_SPACE(3 * sizeof(int))] { };
+    iovec data { .iov_base = &devices.state, .iov_len = sizeof(devices.state) };
+    msghdr message { };
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    const auto received = recvmsg(sock, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+    if (const cmsghdr * header = CMSG_FIRSTHDR(&message);
+        header != nullptr && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS
+        && header->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+    {
+        int fds[3];
+        std::memcpy(fds, CMSG_DATA(header), sizeof(fds));
+        devices.vkbd_fd = fds[0];
+        devices.mouse_fd = fds[1];
+        devices.lock_fd = fds[2];
+    }
+
+    if (received != sizeof(devices.state) || devices.state.magic != magic || devices.vkbd_fd == -1)
+    {
+        if (devices.vkbd_fd != -1) {
+            close(devices.vkbd_fd);
+            close(devices.mouse_fd);
+            close(devices.lock_fd);
+        }
+        fail(received == 0 ? "connection closed" : "unexpected reply");
+    }
+
+    constexpr char confirmation = 1;
+    if (send(sock, &confirmation, 1, MSG_NOSIGNAL) != 1)
+    {
+        close(devices.vkbd_fd);
+        close(devices.mouse_fd);
+        close(devices.lock_fd);
+        fail(strerror(errno));
+    }
+
+    close(sock);
+    return devices;
+}
+
+pid_t handover::spawn_successor(char ** argv, const std::map < std::string, int > & listen_fds)
+{
+    std::vector < char * > env;
+    for (char ** var = environ; *var != nullptr; var++)
+    {
+        if (std::strncmp(*var, "HALO_HANDOVER=", 14) != 0) {
+            env.push_back(*var);
+        }
+    }
+    char handover_var[] = "HALO_HANDOVER=1";
+    env.push_back(handover_var);
+    env.push_back(nullptr);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    // dup2 onto itself clears FD_CLOEXEC in the child only
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (const auto & [name, fd] : listen_fds) {
+        posix_spawn_file_actions_adddup2(&actions, fd, fd);
+    }
+
+    pid_t pid = -1;
+    const int spawn_error = posix_spawnp(&pid, argv[0], &actions, &attr, argv, env.data());
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (spawn_error != 0)
+    {
+        print_log(ERROR_LOG, "Cannot start ", argv[0], ": ", strerror(spawn_error), "\n");
+        return -1;
+    }
+
+    return pid;
+}
@@ -23,13 +23,15 @@
 
 #include <atomic>
 #include <string>
+#include <string_view>
 
 namespace color {
     extern std::atomic_bool g_no_color;
-    std::string no_color();
+    // escape sequences point into a static palette, no allocation
+    std::string_view no_color();
     std::string color(int r, int g, int b, int br, int bg, int bb);
-    std::string color(int r, int g, int b);
-    std::string bg_color(int r, int g, int b);
+    std::string_view color(int r, int g, int b);
+    std::string_view bg_color(int r, int g, int b);
 }
 
 #endif //COLOR_H
@@ -2,10 +2,18 @@
 #define EMIT_KEYS_H
 
 #include <cstdint>
+#include <span>
+#include <linux/input.h>
 #include <map_reader.h>
 #include <stdexcept>
+#include <string>
 
 void emit(int fd, uint16_t type, uint16_t code, int32_t value);
+// writes a whole batch (SYN_REPORTs included) with one syscall, the kernel stamps the time
+void emit_events(int fd, std::span < const input_event > events);
+// replay: events written to `fd` become text lines "<device> <type> <code> <value>" without timestamps,
+// so traces of two builds can be diffed
+void emit_trace_device(int fd, const std::string & device_name);
 int init_linux_input(const kbd_map & key_map);
 int init_linux_mouse_input();
 #define STRINGIZE_DETAIL(x) #x
@@ -1,8 +1,11 @@
 #ifndef EXECUTE_COMMAND_H
 #define EXECUTE_COMMAND_H
 
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <vector>
+#include <sys/types.h>
 
 struct cmd_status
 {
@@ -11,8 +14,68 @@ struct cmd_status
     int exit_status{}; // exit status
 };
 
+// A command started by exec_command_async_(). Every handle owns its own pipes, pidfd and epoll
+// instance, so any number of them can run at once from any thread (one thread per handle).
+class cmd_handle
+{
+private:
+    pid_t child = -1;
+    int pidfd = -1;         // readable once the child exited
+    int epoll_fd = -1;      // pidfd, stdout and stderr, plus stdin while input is pending
+    int stdin_fd = -1;
+    int stdout_fd = -1;
+    int stderr_fd = -1;
+    std::string input;
+    std::size_t input_written = 0;
+    uint64_t deadline = UINT64_MAX; // CLOCK_MONOTONIC microseconds
+    bool reaped = false;
+    cmd_status result = {"", "", 1};
+
+    friend cmd_handle exec_command_async_(const std::string &, const std::vector<std::string> &,
+        const std::string &, std::chrono::milliseconds);
+
+    cmd_handle() = default;
+    void close_fd(int & fd);
+    void feed_input();
+    void drain(int & fd, std::string & output);
+    void reap(int options);
+    void release() noexcept;
+
+public:
+    cmd_handle(cmd_handle && other) noexcept;
+    cmd_handle & operator=(cmd_handle && other) noexcept;
+    cmd_handle(const cmd_handle &) = delete;
+    cmd_handle & operator=(const cmd_handle &) = delete;
+    // a command still running is killed and reaped
+    ~cmd_handle();
+
+    // readable whenever poll() has something to do: output arrived, room for input, the child exited
+    [[nodiscard]] int fd() const { return epoll_fd; }
+    // when the command gets killed for running too long, UINT64_MAX without a timeout
+    [[nodiscard]] uint64_t deadline_usec() const { return reaped ? UINT64_MAX : deadline; }
+    [[nodiscard]] pid_t pid() const { return child; }
+    [[nodiscard]] bool finished() const { return reaped; }
+    // exit status and output, complete once finished()
+    [[nodiscard]] const cmd_status & status() const { return result; }
+
+    // never blocks: passes input on, collects output, kills the command past its deadline
+    // and reaps it, returns finished()
+    bool poll();
+    // blocks until the command finished (or was killed at its deadline)
+    cmd_status wait();
+};
+
+// starts `cmd` with `args`, writing `input` (newline terminated) to its stdin,
+// a zero `timeout` lets it run for as long as it likes
+cmd_handle exec_command_async_(const std::string &, const std::vector<std::string> &, const std::string &,
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+// runs `cmd` to completion
 cmd_status exec_command_(const std::string &, const std::vector<std::string> &, const std::string &);
 
+// pidfd_open(2): an fd that turns readable once `pid` exited, -1 with errno set (ENOSYS before Linux 5.3)
+int open_pidfd(pid_t pid);
+
 template <typename... Strings>
 cmd_status exec_command(const std::string& cmd, const std::string &input, Strings&&... args)
 {
@@ -20,4 +83,11 @@ cmd_status exec_command(const std::string& cmd, const std::string &input, String
     return exec_command_(cmd, vec, input);
 }
 
+template <typename... Strings>
+cmd_handle exec_command_async(const std::chrono::milliseconds timeout, const std::string& cmd, const std::string &input, Strings&&... args)
+{
+    const std::vector<std::string> vec{std::forward<Strings>(args)...};
+    return exec_command_async_(cmd, vec, input, timeout);
+}
+
 #endif //EXECUTE_COMMAND_H
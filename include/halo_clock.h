@@ -0,0 +1,90 @@
+/* halo_core.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef HALO_CLOCK_H
+#define HALO_CLOCK_H
+
+#include <cstdint>
+#include "halo_core.h"
+
+// Where the driver gets its time from.
+// halo::core only ever sees the numbers, the clock decides whether waiting for the next long press
+// repeat takes real time (monotonic_clock) or none at all (virtual_clock).
+namespace halo
+{
+    class clock
+    {
+    public:
+        virtual ~clock() = default;
+
+        // microseconds, never goes backwards
+        [[nodiscard]] virtual uint64_t now_usec() const = 0;
+
+        // block until `deadline_usec` has passed (no_deadline: forever) or `fd` is readable (-1: no fd),
+        // returns true if `fd` is readable
+        virtual bool wait(int fd, uint64_t deadline_usec) = 0;
+
+        void sleep_until(const uint64_t deadline_usec) { wait(-1, deadline_usec); }
+    };
+
+    // CLOCK_MONOTONIC, the same time base as the kernel touch timestamps, waits in poll(2)
+    class monotonic_clock final : public clock
+    {
+    public:
+        [[nodiscard]] uint64_t now_usec() const override;
+        bool wait(int fd, uint64_t deadline_usec) override;
+    };
+
+    // Time that only moves when told to: waiting jumps straight to the deadline,
+    // so hours of held keys and repeats simulate in however long the core takes to compute them
+    class virtual_clock final : public clock
+    {
+    private:
+        uint64_t now = 0;
+
+    public:
+        explicit virtual_clock(const uint64_t start_usec = 0) : now(start_usec) { }
+
+        [[nodiscard]] uint64_t now_usec() const override { return now; }
+        // returns at once when `fd` is readable, otherwise jumps to the deadline,
+        // throws if there is neither (nothing would ever wake it)
+        bool wait(int fd, uint64_t deadline_usec) override;
+
+        void advance(const uint64_t usec) { now += usec; }
+    };
+
+    // runs the time driven work of `core` due up to `until_usec`, sleeping on `clk` in between,
+    // every non-empty output goes to `sink`
+    template < typename Sink >
+    void run_until(core & core, clock & clk, const uint64_t until_usec, Sink && sink)
+    {
+        for (uint64_t deadline; (deadline = core.next_deadline()) <= until_usec;)
+        {
+            clk.sleep_until(deadline);
+            if (const auto output = core.tick(clk.now_usec()); !output.keyboard.empty() || !output.touchpad.empty()) {
+                sink(output);
+            }
+        }
+
+        clk.sleep_until(until_usec);
+    }
+}
+
+#endif //HALO_CLOCK_H
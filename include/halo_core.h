@@ -0,0 +1,159 @@
+/* halo_core.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef HALO_CORE_H
+#define HALO_CORE_H
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <ranges>
+#include <span>
+#include <string_view>
+#include <vector>
+#include <linux/input.h>
+#include <key_id.h>
+#include "map_reader.h"
+#include "touch_record.h"
+
+// name of the key, a view into the static translation table
+std::string_view key_id_translate(key_id_t key);
+
+// names of the keys, translated lazily while the view is printed
+template < typename Type > requires (!std::is_integral_v<Type>)
+auto key_id_translate(const Type & keys)
+{
+    static_assert(std::is_same_v < std::ranges::range_value_t<Type>, key_id_t >,
+        "Decompressed element does not speaking the type `key_id_t`");
+    return keys | std::views::transform([](const key_id_t key) { return key_id_translate(key); });
+}
+
+// handler for a Fn governed key, called with the inverted key id (e.g. INVERTED_KEY_SETTINGS)
+typedef void(*inverted_key_map_handler)(key_id_t);
+
+// offset of the Fn governed keys in a module's register vector -> inverted key
+extern const std::map < int, key_id_t > offset_map;
+
+// The Halo keyboard logic: touches in, input events out.
+// One instance holds the complete state of one panel (held keys, combinations, Fn lock,
+// long presses, touchpad contacts) and never touches a device, a thread or the clock,
+// so any number of instances can run side by side. Not thread safe, one caller per instance.
+namespace halo
+{
+    constexpr uint64_t long_press_delay_usec = 500000;
+    constexpr uint64_t long_press_interval_usec = 80000;
+    constexpr uint64_t debounce_usec = 50;
+    constexpr uint64_t no_deadline = std::numeric_limits<uint64_t>::max();
+
+    // events produced by one call, valid until the next call on the same core
+    struct output_t
+    {
+        std::span < const input_event > keyboard;   // for the "Halo Keyboard" device
+        std::span < const input_event > touchpad;   // for the "Halo TouchPad" device
+    };
+
+    class core
+    {
+    private:
+        struct key_state_t {
+            uint64_t press_time_usec = 0;
+            uint64_t next_repeat_usec = 0;  // 0 until the long press kicked in
+        };
+
+        // node storage for the maps below: freed nodes are reused and new ones come from `buffer`,
+        // so touches and ticks never reach the heap. On the heap itself so the core stays movable
+        struct arena_t {
+            std::array < std::byte, 16 << 10 > buffer;
+            std::pmr::monotonic_buffer_resource chunks { buffer.data(), buffer.size() };
+            std::pmr::unsynchronized_pool_resource nodes { &chunks };
+        };
+
+        const kbd_map & map;
+        const double touchpad_width;
+        const double touchpad_height;
+        std::unique_ptr < arena_t > arena = std::make_unique < arena_t > ();
+
+        // cleared, never shrunk, at the start of every call
+        std::vector < input_event > keyboard_events;
+        std::vector < input_event > touchpad_events;
+
+        std::pmr::map < key_id_t, key_state_t > pressed_key { &arena->nodes };
+        std::vector < unsigned int > combination_sp_keys; // capacity for every functional key, reserved once
+        bool no_key_pressed_after_win = false;
+        bool fnlock_enabled = false;
+
+        std::map < key_id_t, std::pair <key_id_t, inverted_key_map_handler> > fn_key_invert_handler_map;
+        std::pmr::map < key_id_t /* key */, uint64_t > time_of_the_last_press_event { &arena->nodes };
+        std::pmr::map < unsigned int /* slot */, key_id_t > slot_to_key_id_map { &arena->nodes };
+        int next_id = 0;
+        int reset_key_counter = 0;
+
+        void emit(std::vector < input_event > & events, uint16_t type, uint16_t code, int32_t value);
+        void emit_key(uint16_t code, int32_t value) { emit(keyboard_events, EV_KEY, code, value); }
+        void sync() { emit(keyboard_events, EV_SYN, SYN_REPORT, 0); }
+
+        void press_keys_once(key_id_t pressed_key);
+        void press(key_id_t key_id, uint64_t now_usec);
+        void release(key_id_t key_id);
+        void touchpad(double x, double y, unsigned int determined_key, uint32_t type, int slot);
+        void append_when_fit(key_id_t id);
+        void force_release();
+        void release_held();
+        [[nodiscard]] output_t output() const { return { keyboard_events, touchpad_events }; }
+
+    public:
+        // `map_` must outlive the core and contain the touchpad (KEY_ID_TOUCHPAD)
+        explicit core(const kbd_map & map_);
+
+        // one panel touch at `now_usec`, microseconds of a halo::clock (see halo_clock.h)
+        output_t touch(const touch_event_t & touch, uint64_t now_usec);
+        // time driven work (long press repeats) due at `now_usec`
+        output_t tick(uint64_t now_usec);
+        // when tick() has work to do next, no_deadline if nothing is held
+        [[nodiscard]] uint64_t next_deadline() const;
+        // release every held key, as the LCtrl+LAlt+Tab combination does
+        output_t release_all();
+        // release every held key and end every touchpad contact, as if all fingers left the panel
+        output_t lift_all();
+        // nothing held: no keys and no touchpad contacts
+        [[nodiscard]] bool idle() const { return pressed_key.empty() && slot_to_key_id_map.empty(); }
+
+        // what a process taking over the devices carries on with (see handover.h)
+        struct snapshot_t {
+            bool fn_lock = false;
+            int next_tracking_id = 0;
+        };
+        [[nodiscard]] snapshot_t snapshot() const { return { .fn_lock = fnlock_enabled, .next_tracking_id = next_id }; }
+        void restore(const snapshot_t & snapshot) { fnlock_enabled = snapshot.fn_lock; next_id = snapshot.next_tracking_id; }
+
+        // the key under (x, y) in key map space, -1 if none
+        [[nodiscard]] long hit_test(double x, double y) const;
+
+        void set_fn_lock(bool enabled) { fnlock_enabled = enabled; }
+        [[nodiscard]] bool fn_lock() const { return fnlock_enabled; }
+        // hand the inverted key to `handler` instead of emitting it, Fn lock itself cannot be redirected
+        void redirect_fn_key(key_id_t inverted_key, inverted_key_map_handler handler);
+    };
+}
+
+#endif //HALO_CORE_H
@@ -0,0 +1,106 @@
+/* halo_module.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef HALO_MODULE_H
+#define HALO_MODULE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The interface between halo_kbd and its modules (C shared libraries, the comma separated [FN MOD] argument).
+// A module exports, with C linkage:
+//
+//   const unsigned int halo_module_abi_version = HALO_MODULE_ABI_VERSION;
+//   int  module_init(const struct halo_module_host * host, struct halo_module_interest * interest);
+//   void module_exit(void);
+//   void module_key_batch(const struct halo_module_key_event * events, size_t count);
+//
+// and optionally, to consume or rewrite keys before they are typed:
+//
+//   size_t module_key_filter(struct halo_module_key_event * events, size_t count, size_t capacity);
+//
+// module_init fills `interest` and may keep `host` until module_exit.
+// Several modules form a chain, in the order they are given to the driver. For each frame the driver
+// writes, the filters run first, in chain order, on the key events of the frame (all of them, when any
+// is in the module's interest). A filter returns the new number of events: it can drop events (consume),
+// change them or add some up to `capacity` (transform), or return them untouched (pass through).
+// Afterwards module_key_batch gets the key events of the frame as written that the module asked for.
+// Both run on the driver loop and are timed against the module's budget: a module that overruns it
+// repeatedly is demoted, its filter is no longer called and its batches are delivered on a thread
+// of its own, so it cannot hold up typing. Slow work belongs on a thread of the module anyway;
+// the reference module, fn_keymods.c, does no I/O on the loop outside of debug builds.
+//
+// ABI version 1 modules (module_init(emit_key, register_vec), fn_key_handler_vector(key_id)
+// called once per Fn key from a worker thread) still load. All entry points are resolved once
+// when the module is loaded, and a module built against any other ABI version is refused.
+
+#define HALO_MODULE_ABI_VERSION 2
+#define HALO_MODULE_FN_KEYS     13      // Fn slots, in the order of fn_inverted_keys in ckeyid.h
+#define HALO_MODULE_KEY_CODES   0x300   // KEY_CNT, the key codes an interest bitmap covers
+#define HALO_MODULE_BATCH_MAX   64      // most events in a batch, a filter call or an emit_batch
+
+struct halo_module_key_event
+{
+    uint64_t time_usec;     // CLOCK_MONOTONIC, when the driver produced the frame
+    unsigned int key_id;    // evdev key code, or an inverted Fn key from ckeyid.h
+    int value;              // 1 press, 0 release, 2 repeat; Fn slots only report presses
+};
+
+struct halo_module_interest
+{
+    // key codes of the "Halo Keyboard" device the module wants to see; they are still typed
+    uint8_t keys[HALO_MODULE_KEY_CODES / 8];
+    // Fn slots the module takes over: the driver does not act on them, they arrive in the batch
+    int fn_keys[HALO_MODULE_FN_KEYS];
+};
+
+#define HALO_MODULE_INTEREST_SET(interest, code) \
+    ((interest)->keys[(code) / 8] |= (uint8_t)(1u << ((code) % 8)))
+#define HALO_MODULE_INTEREST_TEST(interest, code) \
+    (((interest)->keys[(code) / 8] >> ((code) % 8)) & 1u)
+
+struct halo_module_host
+{
+    unsigned int abi_version;
+    // writes press/release events as one frame, a SYN_REPORT after each, with a single write(),
+    // callable from any thread; returns 0, or -1 for an empty, oversized or out of range batch
+    // or when the virtual keyboard cannot be written
+    int (*emit_batch)(const struct halo_module_key_event * events, size_t count);
+};
+
+typedef int  (*halo_module_init_t)(const struct halo_module_host * host, struct halo_module_interest * interest);
+typedef void (*halo_module_exit_t)(void);
+typedef void (*halo_module_key_batch_t)(const struct halo_module_key_event * events, size_t count);
+typedef size_t (*halo_module_key_filter_t)(struct halo_module_key_event * events, size_t count, size_t capacity);
+
+// ABI version 1
+typedef void (*halo_module_emit_key_t)(unsigned int key_id);
+typedef int  (*halo_module_init_v1_t)(void * emit_key, int register_vec[HALO_MODULE_FN_KEYS]);
+typedef void (*halo_module_handler_t)(unsigned int key_id);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern const unsigned int halo_module_abi_version; // defined by the module
+#ifdef __cplusplus
+}
+#endif
+
+#endif //HALO_MODULE_H
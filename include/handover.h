@@ -0,0 +1,128 @@
+/* handover.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <sys/types.h>
+
+// Zero downtime restarts: the running halo_kbd listens on a Unix socket, a new one started with
+// HALO_HANDOVER=1 connects and receives the "Halo Keyboard" and "Halo TouchPad" uinput fds (SCM_RIGHTS)
+// with the state of the core, so the devices never disappear and the desktop keeps its input state.
+// The instance lock goes along, it is held by the open file rather than by a process.
+//
+// One exchange per connection:
+//   new -> old   request_t
+//   old -> new   state_t, the keyboard, touchpad and lock fds attached; sent once nothing is held on the panel,
+//                or after the old process released what still was
+//   new -> old   one byte once it holds the devices, the old process then exits without destroying them
+namespace handover
+{
+    constexpr uint32_t magic = 0x484b4832; // "HKH2", changes with the layout below
+
+    struct request_t
+    {
+        uint32_t magic;
+    };
+
+    struct state_t
+    {
+        uint32_t magic;
+        uint32_t fn_lock;
+        int32_t next_tracking_id;
+        uint32_t reserved;
+        uint64_t last_touch_usec;   // touches up to here were handled by the old process
+    };
+
+    // HALO_HANDOVER_SOCKET, or /run/halo_kbd/handover.sock
+    std::string socket_path();
+
+    // the running process' end, driver loop only. Nothing here waits for the other end but hand_over():
+    // a connection is read as its request arrives, and dropped when that takes longer than request_timeout
+    class server
+    {
+    public:
+        static constexpr std::chrono::milliseconds request_timeout { 250 };
+
+    private:
+        std::string path;
+        int listen_fd = -1;
+        int peer = -1;
+        ino_t socket_inode = 0;                 // 0 for a socket passed by systemd, which is not ours to remove
+        pid_t peer_pid = -1;
+        int connection = -1;                    // accepted, its request not complete yet
+        pid_t connection_pid = -1;
+        std::chrono::steady_clock::time_point connection_deadline;
+        request_t request { };
+        std::size_t request_received = 0;
+
+        void drop_connection();
+
+    public:
+        // takes over `path` from a previous process, throws if it cannot listen there
+        explicit server(std::string path_);
+        // listens on `listen_fd` instead, a socket passed by systemd (handover.socket)
+        server(std::string path_, int listen_fd_);
+        ~server();
+        server(const server &) = delete;
+        server & operator=(const server &) = delete;
+
+        // readable when a new process connects, see accept_connection()
+        [[nodiscard]] int fd() const { return listen_fd; }
+        // takes the waiting connection and returns it (non-blocking) to be watched for read_request(),
+        // or -1 when it was turned away
+        int accept_connection();
+        // reads what arrived on the connection, true once it completed a handover request. The connection
+        // is closed when it sent anything else or hung up
+        bool read_request();
+        // closes the connection when its request did not arrive by request_deadline()
+        void expire_connection();
+        [[nodiscard]] bool connecting() const { return connection != -1; }
+        [[nodiscard]] int connection_fd() const { return connection; }
+        [[nodiscard]] std::chrono::steady_clock::time_point request_deadline() const { return connection_deadline; }
+        [[nodiscard]] bool pending() const { return peer != -1; }
+        // the process the last request came from
+        [[nodiscard]] pid_t successor() const { return peer_pid; }
+        // sends the devices and `state` to the pending process, true once it confirmed within `timeout`
+        bool hand_over(int vkbd_fd, int mouse_fd, int lock_fd, const state_t & state, std::chrono::milliseconds timeout);
+    };
+
+    struct devices_t
+    {
+        int vkbd_fd = -1;
+        int mouse_fd = -1;
+        int lock_fd = -1;
+        state_t state { };
+    };
+
+    // the new process' end: asks the process listening at `path` for its devices and confirms them,
+    // throws if there is none or it did not hand them over within `timeout`
+    devices_t take_over(const std::string & path, std::chrono::milliseconds timeout);
+
+    // starts `argv` again with HALO_HANDOVER=1, returns its pid or -1. Of our descriptors only
+    // `listen_fds` (readiness::listen_fds) are passed on, at the same numbers
+    pid_t spawn_successor(char ** argv, const std::map < std::string, int > & listen_fds);
+}
+
+#endif //HANDOVER_H
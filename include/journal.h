@@ -0,0 +1,47 @@
+/* journal.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <string_view>
+
+// Minimal client for the systemd journal native protocol, see
+// https://systemd.io/JOURNAL_NATIVE_PROTOCOL/
+// No libsystemd dependency, one datagram per log entry.
+namespace journal {
+    // syslog(3) priorities, as expected by the PRIORITY= field
+    constexpr int PRIORITY_ERR      = 3;
+    constexpr int PRIORITY_WARNING  = 4;
+    constexpr int PRIORITY_INFO     = 6;
+    constexpr int PRIORITY_DEBUG    = 7;
+
+    // true if stdout or stderr is the stream systemd connected to journald (checks $JOURNAL_STREAM)
+    bool stream_is_journal();
+
+    // connect to /run/systemd/journal/socket, returns false if journald is not reachable
+    bool open();
+    void close();
+
+    // send one structured entry, empty code_func/key are omitted
+    bool send(int priority, std::string_view code_func, std::string_view key, std::string_view message);
+}
+
+#endif //JOURNAL_H
@@ -0,0 +1,118 @@
+/* latency.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+// Touch-to-uinput latency instrumentation.
+// Every stage lands in a lock-free log-linear (HDR style) histogram, recording is
+// one clock read plus two relaxed atomic adds, so it stays enabled in production.
+namespace latency
+{
+    using stamp_t = uint64_t; // CLOCK_MONOTONIC, nanoseconds
+
+    inline stamp_t now() noexcept
+    {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<stamp_t>(ts.tv_sec) * 1000000000ull + static_cast<stamp_t>(ts.tv_nsec);
+    }
+
+    // libinput event times are CLOCK_MONOTONIC microseconds
+    inline stamp_t from_usec(const uint64_t usec) noexcept { return usec * 1000ull; }
+
+    enum stage_t : unsigned
+    {
+        STAGE_INGEST,   // kernel touch timestamp -> pulled out of libinput
+        STAGE_DECISION, // pulled out of libinput -> events generated by halo::core
+        STAGE_EMIT,     // generated -> written to uinput
+        STAGE_TOTAL,    // kernel touch timestamp -> written to uinput
+        STAGE_COUNT
+    };
+
+    class histogram
+    {
+    public:
+        // 2^sub_bucket_bits linear buckets per power of two, ~6% relative precision
+        static constexpr unsigned sub_bucket_bits = 4;
+        static constexpr unsigned sub_bucket_count = 1u << sub_bucket_bits;
+        static constexpr unsigned bucket_count = (64 - sub_bucket_bits + 1) * sub_bucket_count;
+
+        static constexpr unsigned index_of(const uint64_t value) noexcept
+        {
+            if (value < sub_bucket_count) {
+                return static_cast<unsigned>(value);
+            }
+
+            const unsigned msb = 63u - static_cast<unsigned>(__builtin_clzll(value));
+            const unsigned shift = msb - sub_bucket_bits;
+            return (shift + 1) * sub_bucket_count + static_cast<unsigned>((value >> shift) - sub_bucket_count);
+        }
+
+        // smallest value that lands in bucket `index`
+        static constexpr uint64_t lowest_of(const unsigned index) noexcept
+        {
+            if (index < sub_bucket_count) {
+                return index;
+            }
+
+            const unsigned shift = index / sub_bucket_count - 1;
+            return (static_cast<uint64_t>(sub_bucket_count) + index % sub_bucket_count) << shift;
+        }
+
+        void record(const uint64_t value) noexcept
+        {
+            counts[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(1, std::memory_order_relaxed);
+            uint64_t seen = max.load(std::memory_order_relaxed);
+            while (value > seen && !max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) { }
+        }
+
+        // upper bound of the bucket holding the given percentile, 0 if empty
+        [[nodiscard]] uint64_t percentile(double pct) const noexcept;
+        [[nodiscard]] uint64_t count() const noexcept { return total.load(std::memory_order_relaxed); }
+        [[nodiscard]] uint64_t maximum() const noexcept { return max.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> counts[bucket_count] {};
+        std::atomic<uint64_t> total {0};
+        std::atomic<uint64_t> max {0};
+    };
+
+    static_assert(histogram::lowest_of(histogram::index_of(1000)) <= 1000);
+    static_assert(histogram::index_of(histogram::lowest_of(100)) == 100);
+
+    extern histogram stages[STAGE_COUNT];
+    extern std::atomic_bool dump_requested; // set from the SIGUSR1 handler
+
+    inline void record(const stage_t stage, const stamp_t begin, const stamp_t end) noexcept
+    {
+        stages[stage].record(end > begin ? end - begin : 0);
+    }
+
+    // print percentiles of every stage to the log
+    void dump();
+}
+
+#endif //LATENCY_H
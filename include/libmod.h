@@ -22,48 +22,63 @@
 #define LIBMOD_H
 
 #include <string>
-#include <any>
 #include <dlfcn.h>
-#include <atomic>
 #include <stdexcept>
 #include <vector>
+#include <array>
+#include <span>
+#include <cstdint>
+#include <linux/input.h>
+#include "halo_module.h"
+
+// entry points of a loaded module, resolved once by Module, called directly afterwards
+struct module_api
+{
+    unsigned int abi_version = 0;
+    halo_module_exit_t module_exit = nullptr;
+
+    // ABI version 2
+    halo_module_init_t module_init = nullptr;
+    halo_module_key_batch_t module_key_batch = nullptr;
+    halo_module_key_filter_t module_key_filter = nullptr; // optional
+
+    // ABI version 1
+    halo_module_init_v1_t module_init_v1 = nullptr;
+    halo_module_handler_t fn_key_handler_vector = nullptr;
+};
 
 class Module
 {
 private:
-    std::atomic < void * > handle = nullptr;
-    std::mutex ModuleCallMutex;
-
-public:
-    template < typename Ret, typename... Args >
-    std::any call(const std::string & function_name, Args &... args)
-    {
-        std::lock_guard<std::mutex> lock(ModuleCallMutex);
-        void *entry = dlsym(handle, function_name.c_str());
-        if (const char *error = dlerror()) {
-            throw std::runtime_error(error);
-        }
+    void * handle = nullptr;
+    int image_fd = -1;  // the private copy the module was loaded from
+    module_api api_ { };
+    halo_module_interest interest_ { };
 
-        using function_type = Ret(*)(Args...);
-        auto func = reinterpret_cast<function_type>(entry);
+    // Fn slot presses taken over by a version 2 module, delivered with the next frame
+    std::array < unsigned int, HALO_MODULE_BATCH_MAX > pending_fn_keys { };
+    std::size_t pending_fn_count = 0;
 
-        if constexpr (std::is_same_v<Ret, void>)
-        {
-            // If Ret is void, call the function and return nothing
-            func(args...);
-            return {};
-        } else {
-            Ret result = func(args...);
-            return std::any(result);
-        }
-    }
+    // looks `symbol_name` up in the module, throws if it is missing unless it is `optional`
+    void * resolve(const char * symbol_name, bool optional = false) const;
 
+public:
     explicit Module(const std::string & module_path, std::vector<bool> & mod_map);
     ~Module() { unload(); }
     void init(std::vector<bool> & mod_map);
     void unload();
+    Module(const Module &) = delete;
     Module & operator=(const Module &) = delete;
     [[nodiscard]] void * get_handler() const { return handle; }
+    [[nodiscard]] const module_api & api() const { return api_; }
+
+    [[nodiscard]] bool wants(const unsigned int code) const {
+        return code < HALO_MODULE_KEY_CODES && HALO_MODULE_INTEREST_TEST(&interest_, code);
+    }
+
+    // version 2, driver loop only: a press of an Fn slot the module took over, handed out by take_fn_keys()
+    void queue_fn_key(unsigned int key_id);
+    std::span < const unsigned int > take_fn_keys();
 };
 
 #endif //LIBMOD_H
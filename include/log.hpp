@@ -31,15 +31,15 @@
 #include <vector>
 #include <tuple>      // for std::tuple, std::make_tuple
 #include <utility>    // for std::forward
-#include <any>
 #include <cstring>
-#include <regex>
+#include <string_view>
 #include <chrono>
 #include <functional>
 #include <cstddef>
 #include <type_traits>
 #include <source_location>
 #include "color.h"
+#include "journal.h"
 
 #define construct_simple_type_compare(type)                             \
     template <typename T>                                               \
@@ -158,6 +158,11 @@ namespace debug {
     extern std::atomic_uint filter_level;
     extern bool endl_found_in_last_log;
     extern std::ostream * output;
+    extern bool journal_output;             // entries go to journald, `output` is the line buffer
+    extern std::string journal_code_func;
+    extern std::string journal_key;
+    void journal_flush();
+    std::string_view log_timestamp();       // "dd-mm-YYYY HH:MM:SS", reformatted once per second
 
     template <typename ParamType>
     void _log(const ParamType& param);
@@ -325,7 +330,17 @@ namespace debug {
     template <typename T, typename Tag> void _log(const strong_typedef<T, Tag>&) { }
 
     struct prefix_string_tag {};
-    using prefix_string_t = strong_typedef<std::string, prefix_string_tag>;
+    using prefix_string_t = strong_typedef<std::string_view, prefix_string_tag>;
+
+    // KEY= field for journald, invisible in text output
+    struct key_field_tag {};
+    using key_field_t = strong_typedef<std::string_view, key_field_tag>;
+    inline void _log(const key_field_t & key)
+    {
+        if (journal_output) {
+            journal_key = key.get();
+        }
+    }
 
     template <typename... Args> void log(const Args &...args)
     {
@@ -334,8 +349,9 @@ namespace debug {
         auto ref_tuple = std::forward_as_tuple(args...);
         using LastType = std::tuple_element_t<sizeof...(Args) - 1, std::tuple<Args...>>;
         using FirstType = std::tuple_element_t<0, std::tuple<Args...>>;
-        const std::any last_arg = std::get<sizeof...(Args) - 1>(ref_tuple);
-        std::string user_prefix_addon;
+        const auto & last_arg = std::get<sizeof...(Args) - 1>(ref_tuple);
+        // a view of a function name, the entry is dropped without touching the heap when it is filtered
+        std::string_view user_prefix_addon;
 
         auto call_log = []<class... Ts>(Ts&&... xs) -> decltype(auto) {
             return _log(std::forward<Ts>(xs)...);
@@ -343,8 +359,7 @@ namespace debug {
 
         if constexpr (std::is_same_v<FirstType, prefix_string_t>) // [PREFIX] [...]
         {
-            const std::any first_arg = std::get<0>(ref_tuple);
-            user_prefix_addon = std::any_cast<prefix_string_t>(first_arg).value;
+            user_prefix_addon = std::get<0>(ref_tuple).value;
         }
 
         if (endl_found_in_last_log)
@@ -385,35 +400,44 @@ namespace debug {
                 }
             }
 
-            const auto now = std::chrono::system_clock::now();
-            std::string prefix;
-            switch (log_level)
-            {
-                case 0: prefix =  color::color(1,1,1) + "[DEBUG]"; break;
-                case 1: prefix =  color::color(5,5,5) + "[INFO]"; break;
-                case 2: prefix =  color::color(0,5,5) + "[WARNING]"; break;
-                case 3: prefix =  color::color(5,0,0) + "[ERROR]"; break;
-                default: prefix = color::color(5,5,5) + "[INFO]"; break;
-            }
-
             // now, check if the log level is printable or masked
             if (log_level < filter_level)
             {
                 return;
             }
 
-            _log(color::color(0, 2, 2), std::format("{:%d-%m-%Y %H:%M:%S}", now), " ",
-                user_prefix_addon,
-                prefix, ": ", color::no_color());
+            if (journal_output)
+            {
+                // journald keeps its own timestamps, and the level goes into PRIORITY=
+                journal_code_func = user_prefix_addon;
+            }
+            else
+            {
+                std::string_view prefix_color, prefix;
+                switch (log_level)
+                {
+                    case 0: prefix_color = color::color(1,1,1); prefix = "[DEBUG]"; break;
+                    case 1: prefix_color = color::color(5,5,5); prefix = "[INFO]"; break;
+                    case 2: prefix_color = color::color(0,5,5); prefix = "[WARNING]"; break;
+                    case 3: prefix_color = color::color(5,0,0); prefix = "[ERROR]"; break;
+                    default: prefix_color = color::color(5,5,5); prefix = "[INFO]"; break;
+                }
+
+                _log(color::color(0, 2, 2), log_timestamp(), " ");
+                if (!user_prefix_addon.empty()) {
+                    _log(color::color(2, 3, 4), "(", user_prefix_addon, ") ");
+                }
+                _log(prefix_color, prefix, ": ", color::no_color());
+            }
         }
 
         if constexpr (!is_char_array<LastType>::value)
         {
-            endl_found_in_last_log = _do_i_show_caller_next_time_(std::any_cast<LastType>(last_arg));
+            endl_found_in_last_log = _do_i_show_caller_next_time_(last_arg);
         }
         else
         {
-            endl_found_in_last_log = _do_i_show_caller_next_time_(std::any_cast<const char*>(last_arg));
+            endl_found_in_last_log = _do_i_show_caller_next_time_(static_cast<const char *>(last_arg));
         }
 
         if (user_prefix_addon.empty())
@@ -424,16 +448,40 @@ namespace debug {
         {
             std::apply(call_log, tuple_drop1(ref_tuple));
         }
+
+        if (journal_output && endl_found_in_last_log)
+        {
+            journal_flush();
+        }
     }
 
-    std::string strip_func_name(const std::string &);
+    // "void halo::core::touch(const touch_event_t&, uint64_t)" -> "halo::core::touch", a view into `name`;
+    // names that do not start with a plain return type are kept whole
+    constexpr std::string_view strip_func_name(const std::string_view name)
+    {
+        const auto space = name.find(' ');
+        const auto open = name.rfind('(');
+        if (space == std::string_view::npos || space == 0 || open == std::string_view::npos || open <= space
+            || !name.ends_with(')')) {
+            return name;
+        }
+
+        for (const char c : name.substr(0, space)) {
+            if (!(c == '_' || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+                return name;
+            }
+        }
+
+        return name.substr(space + 1, open - space - 1);
+    }
 
 }
 
-#define print_log(...)  (void)::debug::log(debug::prefix_string_t(color::color(2,3,4) + "(" + debug::strip_func_name(std::source_location::current().function_name()) + ") "), __VA_ARGS__)
+#define print_log(...)  (void)::debug::log(debug::prefix_string_t(debug::strip_func_name(std::source_location::current().function_name())), __VA_ARGS__)
 #define DEBUG_LOG       (debug::debug_log)
 #define INFO_LOG        (debug::info_log)
 #define WARNING_LOG     (debug::warning_log)
 #define ERROR_LOG       (debug::error_log)
+#define JOURNAL_KEY(name) (debug::key_field_t(name))
 
 #endif // LOG_HPP
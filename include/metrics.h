@@ -0,0 +1,105 @@
+/* metrics.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include "latency.h"
+
+// Daemon counters, exported as a Prometheus text-exposition file.
+// Every thread bumps its own cache-line aligned block, the writer sums them up,
+// so the hot path never shares a cache line with another thread.
+namespace metrics
+{
+    enum counter_t : unsigned
+    {
+        TOUCH_EVENTS,       // touch events ingested from libinput
+        HIT_TEST_MISSES,    // touches that landed outside every key
+        DEBOUNCED_PRESSES,  // presses dropped by the debounce window
+        LONG_PRESS_REPEATS, // key repeats generated by long press
+        UINPUT_WRITES,      // write()s to uinput devices
+        UINPUT_BYTES,       // bytes written to uinput devices
+        FORCE_RELEASES,     // LCtrl+LAlt+Tab force release invocations
+        LOG_DROPS,          // log entries that could not be delivered
+        FN_ACTIONS,             // Fn key actions run on the worker pool
+        FN_ACTIONS_COALESCED,   // Fn key presses folded into an action still waiting
+        FN_ACTIONS_REJECTED,    // Fn key actions dropped because the queue was full
+        MODULE_HOST_DROPS,      // frames not handed to the module host, its ring was full
+        COUNTER_COUNT
+    };
+
+    constexpr unsigned max_devices = 8; // further devices share the last slot
+
+    struct alignas(64) thread_block_t
+    {
+        std::atomic<uint64_t> counters[COUNTER_COUNT] {};
+        std::atomic<uint64_t> device_events[max_devices] {};
+    };
+
+    thread_block_t & this_thread_block();
+
+    // single writer per block, so a relaxed load/store pair is enough
+    inline void add(const counter_t counter, const uint64_t value = 1) noexcept
+    {
+        auto & c = this_thread_block().counters[counter];
+        c.store(c.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    inline void add_device_event(const unsigned device) noexcept
+    {
+        auto & c = this_thread_block().device_events[device < max_devices ? device : max_devices - 1];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // name a device slot, returns its index (not for the hot path)
+    unsigned register_device(const std::string & name);
+
+    constexpr unsigned max_modules = 8; // further modules share the last slot
+
+    // timing of one module in the module chain, written by the driver loop or the module's own thread
+    struct module_stats_t
+    {
+        latency::histogram call_ns;             // time per filter or batch call
+        std::atomic<uint64_t> budget_ns {0};
+        std::atomic<uint64_t> overruns {0};     // calls that took longer than the budget
+        std::atomic<uint64_t> async_dropped {0}; // batches lost because the module's queue was full
+        std::atomic<bool> demoted {false};      // calls moved off the driver loop
+    };
+
+    // the stats of the module named `name`, the same ones again after a reload (not for the hot path)
+    module_stats_t & register_module(const std::string & name);
+
+    // periodically write the exposition file to `path` (via rename, so readers never see a partial file)
+    bool start_writer(const std::string & path, std::chrono::milliseconds interval);
+    void stop_writer();
+    // a parked writer writes once more, then sleeps until it is unparked or stopped
+    void park_writer(bool parked);
+    // answer every connection on the listening socket `listen_fd` with the exposition as a plain HTTP response,
+    // from a thread of its own, one connection at a time
+    bool start_server(int listen_fd);
+    void stop_server();
+    std::string render();
+}
+
+#endif //METRICS_H
@@ -0,0 +1,105 @@
+/* module_chain.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef MODULE_CHAIN_H
+#define MODULE_CHAIN_H
+
+#include <bitset>
+#include <map>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+#include <linux/input.h>
+#include "key_id.h"
+#include "libmod.h"
+#include "metrics.h"
+#include "worker_pool.h"
+
+// The modules between halo::core and the virtual keyboard, in the order they were given.
+// Before a frame is written its key events run through the filters of the chain, which may consume,
+// rewrite or pass them; after it is written every module gets the part of it it asked for.
+// Each call is timed against the module's budget, and a module that overruns it overrun_limit times
+// in a row is demoted: its filter is skipped and its batches go to a thread of its own, so a slow
+// module never holds up a key press. Keys a demoted filter left pressed that are not pressed on the
+// keyboard are released with the next frame written. Driver loop only.
+class module_chain
+{
+public:
+    static constexpr unsigned overrun_limit = 3;
+    static constexpr std::size_t async_capacity = 64; // batches a demoted module may have queued
+
+    struct spec_t
+    {
+        std::string path;
+        uint64_t budget_usec;
+    };
+
+    // "first.so,second.so@500": modules in chain order, each with an optional budget in microseconds
+    static std::vector < spec_t > parse(const std::string & list, uint64_t default_budget_usec);
+
+private:
+    struct link_t
+    {
+        std::shared_ptr < Module > module;
+        std::string name;
+        uint64_t budget_ns = 0;
+        metrics::module_stats_t * stats = nullptr;
+        unsigned overruns_in_row = 0;
+        std::unique_ptr < worker_pool > async;  // set once demoted
+        uint64_t async_jobs = 0;
+    };
+
+    std::vector < link_t > links;
+    std::map < key_id_t, std::shared_ptr < Module > > fn_owners;
+    std::vector < bool > claimed_fn_slots;
+    halo_module_interest combined_interest { };
+    input_event rewritten[(HALO_MODULE_BATCH_MAX + KEY_CNT) * 2] { };
+    std::bitset < KEY_CNT > pressed_in;     // keys down on the keyboard, tracked while a filter runs
+    std::bitset < KEY_CNT > pressed_out;    // keys down as written after the filters
+    bool filter_demoted = false;            // a filter was demoted, its keys are released with the next frame
+
+    // runs `call` against the budget of `link`, demoting the module when it keeps overrunning
+    template < typename Call >
+    void timed(link_t & link, Call && call);
+    void demote(link_t & link);
+    void deliver(link_t & link, const halo_module_key_event * events, std::size_t count);
+
+public:
+    // loads every module, throws if one of them fails
+    explicit module_chain(const std::vector < spec_t > & specs);
+    module_chain(const module_chain &) = delete;
+    module_chain & operator=(const module_chain &) = delete;
+
+    // the Fn slots taken over by a module, the first module claiming a slot gets it
+    [[nodiscard]] const std::vector < bool > & fn_slots() const { return claimed_fn_slots; }
+    [[nodiscard]] std::shared_ptr < Module > fn_owner(key_id_t key) const;
+    // the key codes any module wants, and the claimed Fn slots
+    [[nodiscard]] const halo_module_interest & interest() const { return combined_interest; }
+    [[nodiscard]] bool has_filters() const;
+
+    // the frame to write instead of `keyboard`: `keyboard` itself unless a filter changed its key events,
+    // otherwise the remaining key events each followed by a SYN_REPORT, valid until the next call
+    std::span < const input_event > filter(std::span < const input_event > keyboard, uint64_t time_usec);
+    // hands every module the pending Fn presses and the key events of the written frame it is interested in
+    void dispatch(std::span < const input_event > keyboard, uint64_t time_usec);
+};
+
+#endif //MODULE_CHAIN_H
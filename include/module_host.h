@@ -0,0 +1,88 @@
+/* module_host.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef MODULE_HOST_H
+#define MODULE_HOST_H
+
+#include <chrono>
+#include <span>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <linux/input.h>
+#include "key_id.h"
+#include "module_ring.h"
+
+// The module chain run by a halo_modhost child process instead of inside the driver
+// (HALO_MODULE_HOST). Frames as written and Fn slot presses go to the host through a shared memory
+// ring, so module work overlaps with input handling, and a module that is slow or crashes takes the
+// host down, not the keyboard. Filters do not run out of process. Driver loop only.
+class module_host
+{
+private:
+    pid_t child = -1;
+    int pidfd = -1;
+    int shared_fd = -1;
+    int to_host_fd = -1;
+    int to_driver_fd = -1;
+    module_ring::shared_t * shared = nullptr;
+    halo_module_interest interest { };          // copied from the host once it is ready
+    std::vector < bool > claimed_fn_slots;
+    module_ring::record_t pending[HALO_MODULE_BATCH_MAX] { };
+    uint32_t pending_count = 0;
+    bool loaded = false;
+    bool exited = false;
+    bool broken = false;                        // killed for corrupting the ring, until reaped
+
+    void push(uint64_t time_usec);
+    void release() noexcept;
+
+public:
+    static constexpr std::chrono::milliseconds start_timeout { 5000 };
+
+    // starts `host_path` on the comma separated `module_list`, without waiting for its modules to load
+    module_host(const std::string & host_path, const std::string & module_list);
+    ~module_host();
+    module_host(const module_host &) = delete;
+    module_host & operator=(const module_host &) = delete;
+
+    // blocks until the modules are loaded, throws with the host's reason if they are not within `timeout`
+    void wait_ready(std::chrono::milliseconds timeout);
+    // never blocks: true once the modules are loaded, false while they are loading,
+    // throws with the host's reason if they failed to load. The rest of the class needs a ready host
+    bool poll_ready();
+
+    [[nodiscard]] const std::vector < bool > & fn_slots() const { return claimed_fn_slots; }
+    [[nodiscard]] bool running() const { return !exited; }
+    // readable when the host sent emit_batch frames, see service(), or while starting once it is ready
+    [[nodiscard]] int notify_fd() const { return to_driver_fd; }
+    // readable once the host exited, see reap()
+    [[nodiscard]] int exit_fd() const { return pidfd; }
+
+    void queue_fn_key(key_id_t key_id);
+    // hands the frame as written to the host, never blocks: a frame that does not fit is dropped
+    void dispatch(std::span < const input_event > keyboard, uint64_t time_usec);
+    // types the frames the host's modules emitted to `vkbd_fd`
+    void service(int vkbd_fd);
+    // collects the exited host, returns how it ended
+    std::string reap();
+};
+
+#endif //MODULE_HOST_H
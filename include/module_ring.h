@@ -0,0 +1,138 @@
+/* module_ring.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef MODULE_RING_H
+#define MODULE_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include "halo_module.h"
+
+// The shared memory between halo_kbd and halo_modhost, the process running the modules out of process.
+// Two single-producer single-consumer rings carry key events, one towards the host, one back
+// for emit_batch. Neither side ever blocks on the other: a full ring drops the frame, and an eventfd
+// is written only when the consumer announced it is going to sleep.
+namespace module_ring
+{
+    constexpr uint32_t magic = 0x484d5231; // "HMR1", bumped with the layout
+
+    constexpr uint32_t FRAME_END = 1u << 0; // last record of a frame or an emit_batch
+    constexpr uint32_t FN_SLOT   = 1u << 1; // an Fn slot press for the module owning the slot
+
+    struct record_t
+    {
+        uint64_t time_usec;
+        uint32_t key_id;
+        int32_t value;
+        uint32_t flags;
+        uint32_t reserved;
+    };
+
+    template < uint32_t Capacity >
+    struct spsc_t
+    {
+        static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+        static_assert(std::atomic<uint32_t>::is_always_lock_free, "ring indices must work across processes");
+        static constexpr uint32_t capacity = Capacity;
+
+        alignas(64) std::atomic<uint32_t> head {0};             // written by the producer
+        alignas(64) std::atomic<uint32_t> tail {0};             // written by the consumer
+        alignas(64) std::atomic<uint32_t> consumer_sleeping {0};
+        record_t slots[Capacity];
+
+        // publishes all `count` records or none of them, so the consumer never sees half a frame
+        bool push(const record_t * records, const uint32_t count) noexcept
+        {
+            const uint32_t h = head.load(std::memory_order_relaxed);
+            if (Capacity - (h - tail.load(std::memory_order_acquire)) < count) {
+                return false;
+            }
+
+            for (uint32_t i = 0; i < count; i++) {
+                slots[(h + i) & (Capacity - 1)] = records[i];
+            }
+            head.store(h + count, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(record_t & record) noexcept
+        {
+            const uint32_t t = tail.load(std::memory_order_relaxed);
+            if (t == head.load(std::memory_order_acquire)) {
+                return false;
+            }
+
+            record = slots[t & (Capacity - 1)];
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        [[nodiscard]] bool empty() const noexcept {
+            return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+        }
+
+        // records waiting, more than Capacity only if the producer corrupted `head`
+        [[nodiscard]] uint32_t size() const noexcept {
+            return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+        }
+
+        // producer, after a push: whether the consumer sleeps and its eventfd has to be written
+        [[nodiscard]] bool needs_wakeup() const noexcept
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return consumer_sleeping.load(std::memory_order_relaxed) != 0;
+        }
+
+        // consumer, before waiting on its eventfd: false if records arrived in the meantime
+        bool prepare_sleep() noexcept
+        {
+            consumer_sleeping.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!empty())
+            {
+                consumer_sleeping.store(0, std::memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+
+        void woke_up() noexcept { consumer_sleeping.store(0, std::memory_order_relaxed); }
+    };
+
+    enum state_t : uint32_t { STARTING, READY, FAILED };
+
+    struct shared_t
+    {
+        uint32_t magic;
+        std::atomic<uint32_t> state;                // set by the host once its modules are loaded
+        std::atomic<uint32_t> stopping;             // set by the driver, the host drains and exits
+        halo_module_interest interest;              // key codes any module wants, Fn slots claimed
+        char error[256];                            // why the host failed to start
+        spsc_t<1024> to_host;                       // frames as written, Fn slot presses
+        spsc_t<256> to_driver;                      // emit_batch frames
+    };
+
+    // file descriptors halo_modhost finds its end in
+    constexpr int shared_fd = 3;
+    constexpr int to_host_fd = 4;
+    constexpr int to_driver_fd = 5;
+}
+
+#endif //MODULE_RING_H
@@ -0,0 +1,48 @@
+/* readiness.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef READINESS_H
+#define READINESS_H
+
+#include <chrono>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <libudev.h>
+
+// Startup readiness: waits for what the driver depends on instead of sleeping a fixed time,
+// and tells systemd (Type=notify) once typing works.
+namespace readiness
+{
+    // blocks until udev has set up the event nodes of the uinput devices behind `uinput_fds`,
+    // returns false if that did not happen within `timeout`
+    bool wait_for_uinput(udev * udev, std::initializer_list<int> uinput_fds, std::chrono::milliseconds timeout);
+
+    // sd_notify(3): sends `state` (e.g. "READY=1") to $NOTIFY_SOCKET, does nothing when not started by systemd
+    void notify(const std::string & state);
+
+    // sd_listen_fds(3): the sockets systemd passed (socket activation) by FileDescriptorName, empty otherwise.
+    // They are marked close-on-exec, so commands and the module host do not inherit them; LISTEN_PID is
+    // set to this process and handover::spawn_successor passes them on, so a successor started for
+    // a handover (HALO_HANDOVER=1) finds them as well. Call once, before starting threads.
+    std::map < std::string, int > listen_fds();
+}
+
+#endif //READINESS_H
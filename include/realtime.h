@@ -0,0 +1,84 @@
+/* realtime.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Opt-in real-time mode for the driver loop, which both ingests touches and emits keys:
+// a real-time scheduling policy, a core of its own, and memory that is locked and already faulted in,
+// so a busy desktop neither preempts the loop nor makes it wait on a page fault.
+namespace realtime
+{
+    enum policy_t { OFF, FIFO, DEADLINE };
+
+    struct config_t
+    {
+        policy_t policy = OFF;
+        int priority = 50;                  // SCHED_FIFO priority
+        int cpu = -1;                       // core to pin to, -1 leaves the affinity alone
+        uint64_t runtime_usec = 500;        // SCHED_DEADLINE budget per period
+        uint64_t period_usec = 4000;
+        std::size_t heap_bytes = 8 << 20;   // heap prefaulted for the hot path
+        bool check_allocations = false;     // arm no_allocations_t on the hot path (debug builds)
+    };
+
+    // HALO_RT=fifo|deadline, HALO_RT_PRIORITY, HALO_RT_CPU, HALO_RT_RUNTIME_US, HALO_RT_PERIOD_US, HALO_RT_HEAP_KB,
+    // HALO_RT_CHECK_ALLOCS
+    config_t from_env();
+
+    // applies `config` to the calling thread: locks all memory (mlockall), keeps freed heap in the process,
+    // prefaults the heap and the stack, pins the thread and switches its policy. Threads and processes
+    // started afterwards do not inherit the policy. Call after the other threads were started,
+    // false if any step failed (each is logged)
+    bool enter(const config_t & config);
+
+    // debug builds: operator new aborts on a thread inside a no_allocations_t scope, release builds check nothing
+    extern thread_local bool allocations_forbidden;
+
+    class no_allocations_t
+    {
+    private:
+        const bool previous;
+
+    public:
+        explicit no_allocations_t(const bool armed = true) : previous(allocations_forbidden) { allocations_forbidden = previous || armed; }
+        ~no_allocations_t() { allocations_forbidden = previous; }
+        no_allocations_t(const no_allocations_t &) = delete;
+        no_allocations_t & operator=(const no_allocations_t &) = delete;
+    };
+
+    // lifts an enclosing no_allocations_t, for work handed off the loop that allocates by nature
+    class allocations_allowed_t
+    {
+    private:
+        const bool previous;
+
+    public:
+        allocations_allowed_t() : previous(allocations_forbidden) { allocations_forbidden = false; }
+        ~allocations_allowed_t() { allocations_forbidden = previous; }
+        allocations_allowed_t(const allocations_allowed_t &) = delete;
+        allocations_allowed_t & operator=(const allocations_allowed_t &) = delete;
+    };
+}
+
+#endif //REALTIME_H
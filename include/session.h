@@ -0,0 +1,87 @@
+/* session.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+
+// The user session helper (halo_session) runs inside the desktop session and launches programs there
+// on behalf of halo_kbd, which connects to it once over a Unix socket instead of building a
+// machinectl/bash process chain for every Fn key press.
+//
+// Protocol: one request per line, words separated by tabs (so words cannot hold tabs or newlines),
+// every request gets one reply line in order:
+//   ping                         -> ok
+//   launch <program> [args...]   -> ok <pid> | error <reason>
+// <program> is looked up in the helper's PATH, it starts in its own session with stdio on /dev/null.
+namespace session
+{
+    // HALO_SESSION_SOCKET, or /run/user/<uid>/halo-session.sock
+    std::string socket_path(uid_t uid);
+
+    std::string encode(const std::vector < std::string > & words);
+    std::vector < std::string > decode(std::string_view line);
+
+    // halo_kbd's end of the connection. Requests are written without blocking, replies are read
+    // whenever fd() turns readable, so a slow helper never holds up the driver loop.
+    // launch() and service() may run on different threads; every connection is added to the epoll
+    // set given to watch() under the same lock, so no other thread ever sees a connection half made.
+    class client
+    {
+    private:
+        std::string path;
+        mutable std::mutex mutex;
+        int sock = -1;
+        std::string replies;
+        int epoll_fd = -1;
+        void * epoll_tag = nullptr;
+
+        bool connect();
+        bool send(const std::string & request);
+        void disconnect();
+
+    public:
+        explicit client(std::string path_) : path(std::move(path_)) { }
+        ~client() { disconnect(); }
+        client(const client &) = delete;
+        client & operator=(const client &) = delete;
+
+        // -1 while not connected, changes when a lost connection is re-established
+        [[nodiscard]] int fd() const { std::lock_guard lock(mutex); return sock; }
+
+        // registers every connection from now on with `epoll_fd_` (EPOLLIN, data.ptr = `tag`), closing
+        // one takes it off again
+        void watch(int epoll_fd_, void * tag);
+
+        // asks the helper to start `argv`, connecting (or reconnecting) first,
+        // false if no helper could be reached and the caller has to launch it some other way
+        bool launch(const std::vector < std::string > & argv);
+
+        // reads the replies that arrived, logs failures, notices the helper going away
+        void service();
+    };
+}
+
+#endif //SESSION_H
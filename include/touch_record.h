@@ -0,0 +1,62 @@
+/* touch_record.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef TOUCH_RECORD_H
+#define TOUCH_RECORD_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// One Halo panel touch, as handed to the key resolution code.
+// Also the on-disk record of a touch stream recording, after an 8-byte magic.
+struct touch_event_t
+{
+    uint64_t time_usec;     // kernel timestamp, CLOCK_MONOTONIC
+    int32_t slot;
+    uint32_t type;          // libinput_event_type, TOUCH_DOWN/UP/MOTION
+    double x;               // in the 1920x2400 key map space, zero on touch up
+    double y;
+};
+
+static_assert(sizeof(touch_event_t) == 32, "touch record layout changed");
+
+// touch_event_t::type values, the same numbers as libinput_event_type
+constexpr uint32_t TOUCH_DOWN = 500;
+constexpr uint32_t TOUCH_UP = 501;
+constexpr uint32_t TOUCH_MOTION = 502;
+
+constexpr char touch_record_magic[8] = { 'H', 'A', 'L', 'O', 'R', 'E', 'C', '1' };
+
+class touch_recorder
+{
+private:
+    std::ofstream ofs;
+
+public:
+    explicit touch_recorder(const std::string & path);
+    void append(const touch_event_t & touch);
+    void flush() { ofs.flush(); }
+};
+
+std::vector<touch_event_t> read_touch_records(const std::string & path);
+
+#endif //TOUCH_RECORD_H
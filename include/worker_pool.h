@@ -0,0 +1,70 @@
+/* worker_pool.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads for slow side effects (Fn key actions, module handlers), so the driver
+// loop never waits on them. submit() never blocks: a job whose key is already waiting in the queue
+// is folded into that one, and a full queue turns the job away instead of growing.
+class worker_pool
+{
+public:
+    using job_t = std::function < void() >;
+    enum submit_result_t { SUBMITTED, COALESCED, REJECTED };
+
+private:
+    struct entry_t {
+        uint64_t key;
+        job_t job;
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque < entry_t > queue;
+    std::vector < std::thread > threads;
+    const std::size_t capacity;
+    bool stopping = false;
+
+    void run(const std::string & name);
+
+public:
+    // `name` names the threads (name0, name1, ...), signals are blocked in them,
+    // so SIGINT and friends keep landing on the driver loop
+    worker_pool(unsigned thread_count, std::size_t capacity_, const std::string & name);
+    ~worker_pool() { stop(); }
+    worker_pool(const worker_pool &) = delete;
+    worker_pool & operator=(const worker_pool &) = delete;
+
+    submit_result_t submit(uint64_t key, job_t job);
+    // runs what is already queued, then joins the threads, later submissions are rejected
+    void stop();
+};
+
+#endif //WORKER_POOL_H
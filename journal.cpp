@@ -0,0 +1,133 @@
+/* journal.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "journal.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <endian.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static int journal_fd = -1;
+constexpr char journal_socket_path[] = "/run/systemd/journal/socket";
+
+bool journal::stream_is_journal()
+{
+    const char * stream = std::getenv("JOURNAL_STREAM");
+    if (stream == nullptr) {
+        return false;
+    }
+
+    unsigned long long dev = 0, ino = 0;
+    if (std::sscanf(stream, "%llu:%llu", &dev, &ino) != 2) {
+        return false;
+    }
+
+    for (const int fd : { STDOUT_FILENO, STDERR_FILENO })
+    {
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && st.st_dev == dev && st.st_ino == ino) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool journal::open()
+{
+    if (journal_fd != -1) {
+        return true;
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, journal_socket_path, sizeof(journal_socket_path));
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+        ::close(fd);
+        return false;
+    }
+
+    journal_fd = fd;
+    return true;
+}
+
+void journal::close()
+{
+    if (journal_fd != -1) {
+        ::close(journal_fd);
+        journal_fd = -1;
+    }
+}
+
+bool journal::send(const int priority, const std::string_view code_func,
+    const std::string_view key, const std::string_view message)
+{
+    if (journal_fd == -1) {
+        return false;
+    }
+
+    // PRIORITY=N\n, digits only
+    char priority_field[] = "PRIORITY=0\n";
+    priority_field[9] = static_cast<char>('0' + (priority & 7));
+
+    // MESSAGE may contain newlines, so it always uses the binary form:
+    // name \n little-endian uint64 length, data \n
+    const uint64_t message_size = htole64(message.size());
+
+    iovec iov[12];
+    int n = 0;
+    auto push = [&](const void * data, const size_t size) {
+        iov[n].iov_base = const_cast<void *>(data);
+        iov[n].iov_len = size;
+        n++;
+    };
+
+    push(priority_field, sizeof(priority_field) - 1);
+    push("SYSLOG_IDENTIFIER=halo_kbd\n", 27);
+    if (!code_func.empty()) {
+        push("CODE_FUNC=", 10);
+        push(code_func.data(), code_func.size());
+        push("\n", 1);
+    }
+    if (!key.empty()) {
+        push("KEY=", 4);
+        push(key.data(), key.size());
+        push("\n", 1);
+    }
+    push("MESSAGE\n", 8);
+    push(&message_size, sizeof(message_size));
+    push(message.data(), message.size());
+    push("\n", 1);
+
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    return sendmsg(journal_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) >= 0;
+}
@@ -0,0 +1,69 @@
+/* latency.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "latency.h"
+#include "log.hpp"
+#include <cmath>
+
+latency::histogram latency::stages[STAGE_COUNT];
+std::atomic_bool latency::dump_requested = false;
+
+uint64_t latency::histogram::percentile(const double pct) const noexcept
+{
+    const uint64_t samples = count();
+    if (samples == 0) {
+        return 0;
+    }
+
+    const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(pct / 100.0 * static_cast<double>(samples))));
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < bucket_count; i++)
+    {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            // report the bucket's upper edge, but never beyond what was actually observed
+            const uint64_t upper = i + 1 < bucket_count ? lowest_of(i + 1) - 1 : UINT64_MAX;
+            return std::min(upper, maximum());
+        }
+    }
+
+    return maximum();
+}
+
+void latency::dump()
+{
+    constexpr const char * stage_names[STAGE_COUNT] = {
+        "touch->ingest", "ingest->decision", "decision->emit", "touch->emit",
+    };
+
+    auto us = [](const uint64_t ns)->double { return static_cast<double>(ns) / 1000.0; };
+
+    print_log(INFO_LOG, "Latency percentiles (us):\n");
+    for (unsigned i = 0; i < STAGE_COUNT; i++)
+    {
+        const auto & h = stages[i];
+        print_log(INFO_LOG, "    ", stage_names[i], ": n=", h.count(),
+            " p50=", us(h.percentile(50)),
+            " p90=", us(h.percentile(90)),
+            " p99=", us(h.percentile(99)),
+            " p99.9=", us(h.percentile(99.9)),
+            " max=", us(h.maximum()), "\n");
+    }
+}
@@ -19,48 +19,161 @@
  */
 
 #include "libmod.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <utility>
+
+// copies the module into a memfd: a build overwriting the file in place cannot pull pages from under
+// the running module, and every reload is a new object to dlopen() instead of the already loaded one
+static int private_copy(const std::string & module_path)
+{
+    const int file_fd = open(module_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file_fd == -1) {
+        throw std::runtime_error("Cannot open module " + module_path);
+    }
+
+    const int copy_fd = memfd_create("halo_module", MFD_CLOEXEC);
+    struct stat st { };
+    bool copied = copy_fd != -1 && fstat(file_fd, &st) == 0;
+    for (off_t offset = 0; copied && offset < st.st_size;) {
+        copied = sendfile(copy_fd, file_fd, &offset, st.st_size - offset) > 0;
+    }
+
+    close(file_fd);
+    if (!copied)
+    {
+        if (copy_fd != -1) {
+            close(copy_fd);
+        }
+        throw std::runtime_error("Cannot copy module " + module_path);
+    }
+
+    return copy_fd;
+}
 
 Module::Module(const std::string & module_path, std::vector<bool> & mod_map)
 {
-    handle = dlopen(module_path.c_str(), RTLD_LAZY);
-    if (!handle) {
-        throw std::runtime_error(dlerror());
+    // the copy stays open while the module is loaded, so no later copy gets the same /proc path
+    image_fd = private_copy(module_path);
+
+    // RTLD_NOW: a module with unresolved references fails here, not on its first key press
+    handle = dlopen(("/proc/self/fd/" + std::to_string(image_fd)).c_str(), RTLD_NOW);
+    if (!handle)
+    {
+        const std::string error = dlerror();
+        close(image_fd);
+        image_fd = -1;
+        throw std::runtime_error(module_path + ": " + error);
     }
 
-    try {
+    try
+    {
+        const auto version = static_cast<const unsigned int *>(resolve("halo_module_abi_version"));
+        api_.abi_version = *version;
+        if (api_.abi_version == HALO_MODULE_ABI_VERSION)
+        {
+            api_.module_init = reinterpret_cast<halo_module_init_t>(resolve("module_init"));
+            api_.module_key_batch = reinterpret_cast<halo_module_key_batch_t>(resolve("module_key_batch"));
+            api_.module_key_filter = reinterpret_cast<halo_module_key_filter_t>(resolve("module_key_filter", true));
+        }
+        else if (api_.abi_version == 1)
+        {
+            api_.module_init_v1 = reinterpret_cast<halo_module_init_v1_t>(resolve("module_init"));
+            api_.fn_key_handler_vector = reinterpret_cast<halo_module_handler_t>(resolve("fn_key_handler_vector"));
+        }
+        else
+        {
+            throw std::runtime_error("Module " + module_path + " was built for ABI version "
+                + std::to_string(api_.abi_version) + ", expected 1 or " + std::to_string(HALO_MODULE_ABI_VERSION));
+        }
+
+        api_.module_exit = reinterpret_cast<halo_module_exit_t>(resolve("module_exit"));
         init(mod_map);
-    } catch (const std::exception &) {
+    }
+    catch (const std::exception &)
+    {
         dlclose(handle);
+        handle = nullptr;
+        close(image_fd);
+        image_fd = -1;
         throw;
     }
 }
 
+void * Module::resolve(const char * symbol_name, const bool optional) const
+{
+    dlerror(); // clear a stale error, a symbol may legitimately be null
+    void * symbol = dlsym(handle, symbol_name);
+    if (const char * error = dlerror())
+    {
+        if (optional) {
+            return nullptr;
+        }
+        throw std::runtime_error(error);
+    }
+
+    if (symbol == nullptr) {
+        throw std::runtime_error(std::string("Module symbol ") + symbol_name + " is null");
+    }
+
+    return symbol;
+}
+
 void Module::unload()
 {
     if (handle)
     {
-        call<void>("module_exit");
+        api_.module_exit();
         dlclose(handle);
         handle = nullptr;
+        api_ = { };
+        pending_fn_count = 0;
+        close(image_fd);
+        image_fd = -1;
     }
 }
 
-extern "C" void normal_key_emit(unsigned int);
+extern "C" void normal_key_emit(unsigned int) noexcept;
+extern "C" int module_emit_batch(const halo_module_key_event * events, size_t count) noexcept;
 
 void Module::init(std::vector<bool> & mod_map)
 {
-    int register_map[13] = { };
-    mod_map.resize(std::size(register_map), false);
-    if (std::any_cast<int>(call<int>("module_init", normal_key_emit, register_map)) != 0)
+    static constexpr halo_module_host host {
+        .abi_version = HALO_MODULE_ABI_VERSION,
+        .emit_batch = module_emit_batch,
+    };
+
+    interest_ = { };
+    mod_map.assign(HALO_MODULE_FN_KEYS, false);
+    const int result = api_.abi_version == 1
+        ? api_.module_init_v1(reinterpret_cast<void *>(normal_key_emit), interest_.fn_keys)
+        : api_.module_init(&host, &interest_);
+    if (result != 0)
     {
         throw std::runtime_error("Module initialization failed");
     }
 
-    for (uint64_t i = 0; i < std::size(register_map); i++)
+    for (uint64_t i = 0; i < std::size(interest_.fn_keys); i++)
     {
-        if (register_map[i] != 0)
+        if (interest_.fn_keys[i] != 0)
         {
             mod_map[i] = true;
         }
     }
 }
+
+void Module::queue_fn_key(const unsigned int key_id)
+{
+    // a frame holds a handful of Fn presses at most, more than a batch is dropped
+    if (pending_fn_count < pending_fn_keys.size()) {
+        pending_fn_keys[pending_fn_count++] = key_id;
+    }
+}
+
+std::span < const unsigned int > Module::take_fn_keys()
+{
+    return { pending_fn_keys.data(), std::exchange(pending_fn_count, 0) };
+}
@@ -19,22 +19,63 @@
  */
 
 #include "log.hpp"
-#include <regex>
+#include "metrics.h"
 #include <ranges>
 #include <algorithm>
+#include <sstream>
+#include <format>
+#include <chrono>
 
 std::mutex debug::log_mutex;
 std::atomic_uint debug::filter_level = !!!DEBUG;
 unsigned int debug::log_level = 1;
 bool debug::endl_found_in_last_log = true;
 std::ostream * debug::output = nullptr;
-std::string debug::strip_func_name(const std::string & name)
+bool debug::journal_output = false;
+std::string debug::journal_code_func;
+std::string debug::journal_key;
+static std::ostringstream journal_line;
+
+void debug::journal_flush()
+{
+    std::string message = journal_line.str();
+    if (!message.empty() && message.back() == '\n') {
+        message.pop_back();
+    }
+
+    int priority;
+    switch (log_level)
+    {
+        case 0: priority = journal::PRIORITY_DEBUG; break;
+        case 2: priority = journal::PRIORITY_WARNING; break;
+        case 3: priority = journal::PRIORITY_ERR; break;
+        default: priority = journal::PRIORITY_INFO; break;
+    }
+
+    if (!journal::send(priority, journal_code_func, journal_key, message)) {
+        metrics::add(metrics::LOG_DROPS);
+    }
+    journal_line.str("");
+    journal_code_func.clear();
+    journal_key.clear();
+}
+
+std::string_view debug::log_timestamp()
 {
-    const std::regex pattern(R"([\w]+ (.*)\(.*\))");
-    if (std::smatch matches; std::regex_match(name, matches, pattern) && matches.size() > 1) {
-        return matches[1];
+    // only ever called with log_mutex held
+    static char buffer[32];
+    static std::size_t length = 0;
+    static std::chrono::sys_seconds cached_second{};
+
+    if (const auto now = std::chrono::floor<std::chrono::seconds>(std::chrono::system_clock::now());
+        length == 0 || now != cached_second)
+    {
+        length = std::format_to_n(buffer, sizeof(buffer), "{:%d-%m-%Y %H:%M:%S}", now).size;
+        length = std::min(length, sizeof(buffer));
+        cached_second = now;
     }
-    return name;
+
+    return { buffer, length };
 }
 
 class init_instance_t
@@ -57,10 +98,13 @@ public:
         }
 
         debug::output = &std::cout;
+        // under systemd, stdout is already connected to journald, so talk to it directly
+        bool use_journal = journal::stream_is_journal();
         if (const auto log_level_env = std::getenv("LOG_OUTPUT"); log_level_env != nullptr)
         {
             std::string log_output = log_level_env;
             std::ranges::transform(log_output, log_output.begin(), ::tolower);
+            use_journal = log_output == "journal";
             if (log_output == "stderr")
             {
                 debug::output = &std::cerr;
@@ -70,5 +114,12 @@ public:
                 debug::output = &std::cout;
             }
         }
+
+        if (use_journal && journal::open())
+        {
+            debug::journal_output = true;
+            debug::output = &journal_line;
+            color::g_no_color = true;
+        }
     }
 } log_init_instance;
@@ -0,0 +1,414 @@
+/* metrics.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "metrics.h"
+#include "latency.h"
+#include "log.hpp"
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+namespace {
+    constexpr unsigned max_threads = 32;
+
+    std::mutex registry_mutex;
+    metrics::thread_block_t blocks[max_threads];
+    bool block_in_use[max_threads] {};
+    metrics::thread_block_t retired;    // counts of threads that already exited
+    metrics::thread_block_t overflow;   // shared by threads beyond max_threads
+    std::vector<std::string> device_names;
+    metrics::module_stats_t module_stats[metrics::max_modules];
+    std::vector<std::string> module_names;
+
+    // claims a block on first use and folds it into `retired` when the thread exits
+    struct thread_slot_t
+    {
+        metrics::thread_block_t * block = nullptr;
+
+        thread_slot_t()
+        {
+            std::lock_guard lock(registry_mutex);
+            for (unsigned i = 0; i < max_threads; i++)
+            {
+                if (!block_in_use[i]) {
+                    block_in_use[i] = true;
+                    block = &blocks[i];
+                    return;
+                }
+            }
+            block = &overflow;
+        }
+
+        ~thread_slot_t()
+        {
+            if (block == &overflow) {
+                return;
+            }
+
+            std::lock_guard lock(registry_mutex);
+            for (unsigned i = 0; i < metrics::COUNTER_COUNT; i++) {
+                retired.counters[i].fetch_add(block->counters[i].exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            for (unsigned i = 0; i < metrics::max_devices; i++) {
+                retired.device_events[i].fetch_add(block->device_events[i].exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            block_in_use[block - blocks] = false;
+        }
+    };
+
+    struct counter_desc_t {
+        const char * name;
+        const char * help;
+    };
+
+    constexpr counter_desc_t counter_desc[metrics::COUNTER_COUNT] = {
+        { "halo_touch_events_total",        "Touch events ingested from libinput." },
+        { "halo_hit_test_misses_total",     "Touches outside of every key in the key map." },
+        { "halo_debounced_presses_total",   "Key presses ignored by the debounce window." },
+        { "halo_long_press_repeats_total",  "Key repeats generated by long press." },
+        { "halo_uinput_writes_total",       "Writes to the virtual keyboard and touchpad." },
+        { "halo_uinput_bytes_total",        "Bytes written to the virtual keyboard and touchpad." },
+        { "halo_force_releases_total",      "Force release (LCtrl+LAlt+Tab) invocations." },
+        { "halo_log_drops_total",           "Log entries that could not be delivered." },
+        { "halo_fn_actions_total",          "Fn key actions run on the worker pool." },
+        { "halo_fn_actions_coalesced_total", "Fn key presses folded into an action still waiting." },
+        { "halo_fn_actions_rejected_total", "Fn key actions dropped because the queue was full." },
+        { "halo_module_host_drops_total",   "Frames not handed to the module host because its ring was full." },
+    };
+
+    std::thread writer_thread;
+    std::mutex writer_mutex;
+    std::condition_variable writer_cv;
+    bool writer_stop = false;
+    bool writer_parked = false;
+
+    std::thread server_thread;
+    int server_stop_fd = -1;
+}
+
+metrics::thread_block_t & metrics::this_thread_block()
+{
+    thread_local thread_slot_t slot;
+    return *slot.block;
+}
+
+unsigned metrics::register_device(const std::string & name)
+{
+    std::lock_guard lock(registry_mutex);
+    for (unsigned i = 0; i < device_names.size(); i++)
+    {
+        if (device_names[i] == name) {
+            return i;
+        }
+    }
+
+    if (device_names.size() == max_devices) {
+        return max_devices - 1;
+    }
+
+    device_names.push_back(device_names.size() == max_devices - 1 ? "other" : name);
+    return device_names.size() - 1;
+}
+
+metrics::module_stats_t & metrics::register_module(const std::string & name)
+{
+    std::lock_guard lock(registry_mutex);
+    for (unsigned i = 0; i < module_names.size(); i++)
+    {
+        if (module_names[i] == name) {
+            return module_stats[i];
+        }
+    }
+
+    if (module_names.size() == max_modules) {
+        return module_stats[max_modules - 1];
+    }
+
+    module_names.push_back(module_names.size() == max_modules - 1 ? "other" : name);
+    return module_stats[module_names.size() - 1];
+}
+
+std::string metrics::render()
+{
+    uint64_t counters[COUNTER_COUNT] {};
+    uint64_t device_events[max_devices] {};
+    std::vector<std::string> names;
+    std::vector<std::string> modules;
+
+    {
+        std::lock_guard lock(registry_mutex);
+        auto sum = [&](const thread_block_t & block)
+        {
+            for (unsigned i = 0; i < COUNTER_COUNT; i++) {
+                counters[i] += block.counters[i].load(std::memory_order_relaxed);
+            }
+            for (unsigned i = 0; i < max_devices; i++) {
+                device_events[i] += block.device_events[i].load(std::memory_order_relaxed);
+            }
+        };
+
+        for (unsigned i = 0; i < max_threads; i++) {
+            sum(blocks[i]);
+        }
+        sum(retired);
+        sum(overflow);
+        names = device_names;
+        modules = module_names;
+    }
+
+    std::ostringstream oss;
+    for (unsigned i = 0; i < COUNTER_COUNT; i++)
+    {
+        oss << "# HELP " << counter_desc[i].name << " " << counter_desc[i].help << "\n"
+            << "# TYPE " << counter_desc[i].name << " counter\n"
+            << counter_desc[i].name << " " << counters[i] << "\n";
+    }
+
+    oss << "# HELP halo_device_touch_events_total Touch events ingested, per input device.\n"
+        << "# TYPE halo_device_touch_events_total counter\n";
+    for (unsigned i = 0; i < names.size(); i++)
+    {
+        std::string label = names[i];
+        std::erase_if(label, [](const char c) { return c == '"' || c == '\\' || c == '\n'; });
+        oss << "halo_device_touch_events_total{device=\"" << label << "\"} " << device_events[i] << "\n";
+    }
+
+    constexpr const char * stage_names[latency::STAGE_COUNT] = {
+        "touch_ingest", "ingest_decision", "decision_emit", "touch_emit",
+    };
+    oss << "# HELP halo_key_latency_seconds Key press latency per pipeline stage.\n"
+        << "# TYPE halo_key_latency_seconds summary\n";
+    for (unsigned i = 0; i < latency::STAGE_COUNT; i++)
+    {
+        const auto & h = latency::stages[i];
+        for (const double q : { 0.5, 0.9, 0.99 }) {
+            oss << "halo_key_latency_seconds{stage=\"" << stage_names[i] << "\",quantile=\"" << q << "\"} "
+                << static_cast<double>(h.percentile(q * 100)) / 1e9 << "\n";
+        }
+        oss << "halo_key_latency_seconds_count{stage=\"" << stage_names[i] << "\"} " << h.count() << "\n";
+    }
+
+    if (modules.empty()) {
+        return oss.str();
+    }
+
+    const auto module_label = [&](const unsigned i)
+    {
+        std::string label = modules[i];
+        std::erase_if(label, [](const char c) { return c == '"' || c == '\\' || c == '\n'; });
+        return "module=\"" + label + "\"";
+    };
+
+    oss << "# HELP halo_module_call_seconds Time per module filter or batch call.\n"
+        << "# TYPE halo_module_call_seconds summary\n";
+    for (unsigned i = 0; i < modules.size(); i++)
+    {
+        const auto & h = module_stats[i].call_ns;
+        for (const double q : { 0.5, 0.9, 0.99 }) {
+            oss << "halo_module_call_seconds{" << module_label(i) << ",quantile=\"" << q << "\"} "
+                << static_cast<double>(h.percentile(q * 100)) / 1e9 << "\n";
+        }
+        oss << "halo_module_call_seconds_count{" << module_label(i) << "} " << h.count() << "\n";
+    }
+
+    const auto per_module = [&](const char * name, const char * type, const char * help, auto value)
+    {
+        oss << "# HELP " << name << " " << help << "\n" << "# TYPE " << name << " " << type << "\n";
+        for (unsigned i = 0; i < modules.size(); i++) {
+            oss << name << "{" << module_label(i) << "} " << value(module_stats[i]) << "\n";
+        }
+    };
+
+    per_module("halo_module_budget_seconds", "gauge", "Time a module call may take on the driver loop.",
+        [](const module_stats_t & m) { return static_cast<double>(m.budget_ns.load(std::memory_order_relaxed)) / 1e9; });
+    per_module("halo_module_budget_overruns_total", "counter", "Module calls that took longer than the budget.",
+        [](const module_stats_t & m) { return m.overruns.load(std::memory_order_relaxed); });
+    per_module("halo_module_demoted", "gauge", "Whether the module runs on its own thread after overrunning its budget.",
+        [](const module_stats_t & m) { return m.demoted.load(std::memory_order_relaxed) ? 1 : 0; });
+    per_module("halo_module_async_dropped_total", "counter", "Batches of a demoted module dropped because its queue was full.",
+        [](const module_stats_t & m) { return m.async_dropped.load(std::memory_order_relaxed); });
+
+    return oss.str();
+}
+
+static bool write_atomically(const std::string & path, const std::string & content)
+{
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream ofs(tmp_path, std::ios::trunc);
+        if (!ofs) {
+            return false;
+        }
+        ofs << content;
+        if (!ofs.flush()) {
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    return !ec;
+}
+
+bool metrics::start_writer(const std::string & path, const std::chrono::milliseconds interval)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    if (!write_atomically(path, render())) {
+        print_log(WARNING_LOG, "[WARNING] Cannot write metrics file ", path, ", metrics disabled\n");
+        return false;
+    }
+
+    writer_stop = false;
+    writer_parked = false;
+    writer_thread = std::thread([path, interval]
+    {
+        pthread_setname_np(pthread_self(), "Metrics");
+        std::unique_lock lock(writer_mutex);
+        while (true)
+        {
+            if (writer_parked) {
+                writer_cv.wait(lock, [] { return writer_stop || !writer_parked; });
+            } else {
+                writer_cv.wait_for(lock, interval, [] { return writer_stop; });
+            }
+
+            if (writer_stop) {
+                break;
+            }
+
+            lock.unlock();
+            write_atomically(path, render());
+            lock.lock();
+        }
+        lock.unlock();
+        write_atomically(path, render());
+    });
+
+    return true;
+}
+
+void metrics::stop_writer()
+{
+    {
+        std::lock_guard lock(writer_mutex);
+        writer_stop = true;
+    }
+    writer_cv.notify_all();
+    if (writer_thread.joinable()) {
+        writer_thread.join();
+    }
+}
+
+void metrics::park_writer(const bool parked)
+{
+    {
+        std::lock_guard lock(writer_mutex);
+        writer_parked = parked;
+    }
+    writer_cv.notify_all();
+}
+
+// a scraper sends its request first, which is read (and ignored) for at most 100ms
+static void serve_connection(const int sock)
+{
+    char request[1024];
+    pollfd pfd { .fd = sock, .events = POLLIN, .revents = 0 };
+    if (poll(&pfd, 1, 100) > 0) {
+        [[maybe_unused]] const auto ignored = recv(sock, request, sizeof(request), MSG_DONTWAIT);
+    }
+
+    const std::string body = metrics::render();
+    const std::string response = "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n\r\n" + body;
+
+    const timeval timeout { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    for (std::size_t sent = 0; sent < response.size();)
+    {
+        const auto ret = send(sock, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (ret <= 0) {
+            break;
+        }
+        sent += static_cast<std::size_t>(ret);
+    }
+}
+
+bool metrics::start_server(const int listen_fd)
+{
+    server_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (server_stop_fd == -1) {
+        print_log(WARNING_LOG, "[WARNING] Cannot serve metrics: ", strerror(errno), "\n");
+        return false;
+    }
+
+    // a successor taking over the devices may be accepting on the same socket
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    server_thread = std::thread([listen_fd]
+    {
+        pthread_setname_np(pthread_self(), "MetricsSrv");
+        pollfd pfds[2] = {
+            { .fd = listen_fd, .events = POLLIN, .revents = 0 },
+            { .fd = server_stop_fd, .events = POLLIN, .revents = 0 },
+        };
+        while (poll(pfds, 2, -1) >= 0 || errno == EINTR)
+        {
+            if (pfds[1].revents != 0) {
+                break;
+            }
+            if (pfds[0].revents == 0) {
+                continue;
+            }
+
+            if (const int sock = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC); sock != -1)
+            {
+                serve_connection(sock);
+                close(sock);
+            }
+        }
+        close(listen_fd);
+    });
+
+    return true;
+}
+
+void metrics::stop_server()
+{
+    if (!server_thread.joinable()) {
+        return;
+    }
+
+    constexpr uint64_t one = 1;
+    [[maybe_unused]] const auto ignored = write(server_stop_fd, &one, sizeof(one));
+    server_thread.join();
+    close(server_stop_fd);
+    server_stop_fd = -1;
+}
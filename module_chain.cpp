@@ -0,0 +1,322 @@
+/* module_chain.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "module_chain.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <ranges>
+#include "halo_core.h"
+#include "latency.h"
+#include "log.hpp"
+
+std::vector < module_chain::spec_t > module_chain::parse(const std::string & list, const uint64_t default_budget_usec)
+{
+    std::vector < spec_t > specs;
+    for (const auto part : list | std::views::split(','))
+    {
+        std::string entry(part.begin(), part.end());
+        if (entry.empty()) {
+            continue;
+        }
+
+        spec_t spec { .path = entry, .budget_usec = default_budget_usec };
+        if (const auto at = entry.rfind('@'); at != std::string::npos)
+        {
+            spec.path = entry.substr(0, at);
+            try {
+                spec.budget_usec = std::stoull(entry.substr(at + 1));
+            } catch (const std::exception &) {
+                throw std::runtime_error("Invalid module budget in \"" + entry + "\"");
+            }
+        }
+
+        specs.push_back(spec);
+    }
+
+    return specs;
+}
+
+module_chain::module_chain(const std::vector < spec_t > & specs)
+    : claimed_fn_slots(HALO_MODULE_FN_KEYS, false)
+{
+    for (const auto & [path, budget_usec] : specs)
+    {
+        std::vector < bool > slots;
+        link_t link;
+        link.module = std::make_shared<Module>(path, slots);
+        link.name = std::filesystem::path(path).filename().string();
+        link.budget_ns = budget_usec * 1000;
+        link.stats = &metrics::register_module(link.name);
+        link.stats->budget_ns = link.budget_ns;
+        link.stats->demoted = false;
+
+        for (std::size_t i = 0; i < slots.size(); i++)
+        {
+            if (!slots[i]) {
+                continue;
+            }
+
+            const auto key = offset_map.at(static_cast<int>(i));
+            if (claimed_fn_slots[i]) {
+                print_log(WARNING_LOG, "[WARNING] Fn key ", key_id_translate(key), " is already taken by an earlier module, ignored for ", link.name, "\n");
+                continue;
+            }
+
+            claimed_fn_slots[i] = true;
+            combined_interest.fn_keys[i] = 1;
+            fn_owners[key] = link.module;
+        }
+
+        for (unsigned code = 0; code < HALO_MODULE_KEY_CODES; code++)
+        {
+            if (link.module->wants(code)) {
+                HALO_MODULE_INTEREST_SET(&combined_interest, code);
+            }
+        }
+
+        print_log(INFO_LOG, "Module ", link.name, " (ABI version ", link.module->api().abi_version,
+            link.module->api().module_key_filter != nullptr ? ", filter" : "", ") budget ", budget_usec, "us\n");
+        links.push_back(std::move(link));
+    }
+}
+
+std::shared_ptr < Module > module_chain::fn_owner(const key_id_t key) const
+{
+    const auto it = fn_owners.find(key);
+    return it == fn_owners.end() ? nullptr : it->second;
+}
+
+bool module_chain::has_filters() const
+{
+    return std::ranges::any_of(links, [](const link_t & link) { return link.module->api().module_key_filter != nullptr; });
+}
+
+template < typename Call >
+void module_chain::timed(link_t & link, Call && call)
+{
+    const auto begin = latency::now();
+    call();
+    const auto took = latency::now() - begin;
+    link.stats->call_ns.record(took);
+
+    if (took <= link.budget_ns)
+    {
+        link.overruns_in_row = 0;
+        return;
+    }
+
+    link.stats->overruns.fetch_add(1, std::memory_order_relaxed);
+    if (++link.overruns_in_row >= overrun_limit) {
+        demote(link);
+    }
+}
+
+void module_chain::demote(link_t & link)
+{
+    print_log(WARNING_LOG, "[WARNING] Module ", link.name, " took longer than ", link.budget_ns / 1000, "us ",
+        overrun_limit, " times in a row, moved off the driver loop",
+        link.module->api().module_key_filter != nullptr ? ", its filter is skipped" : "", "\n");
+    link.async = std::make_unique<worker_pool>(1, async_capacity, "Mod" + link.name);
+    link.stats->demoted = true;
+    filter_demoted = filter_demoted || link.module->api().module_key_filter != nullptr;
+}
+
+namespace {
+    void track(std::bitset < KEY_CNT > & pressed, const halo_module_key_event * events, const std::size_t count)
+    {
+        for (std::size_t i = 0; i < count; i++)
+        {
+            if (events[i].key_id < KEY_CNT) {
+                pressed.set(events[i].key_id, events[i].value != 0);
+            }
+        }
+    }
+}
+
+void module_chain::deliver(link_t & link, const halo_module_key_event * events, const std::size_t count)
+{
+    const auto key_batch = link.module->api().module_key_batch;
+    if (!link.async)
+    {
+        timed(link, [&] { key_batch(events, count); });
+        return;
+    }
+
+    // one thread per demoted module keeps its batches in order, unique keys keep them from coalescing
+    auto job = [key_batch, module = link.module, stats = link.stats, batch = std::vector(events, events + count)]
+    {
+        const auto begin = latency::now();
+        key_batch(batch.data(), batch.size());
+        stats->call_ns.record(latency::now() - begin);
+    };
+
+    if (link.async->submit(link.async_jobs++, std::move(job)) == worker_pool::REJECTED) {
+        link.stats->async_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+std::span < const input_event > module_chain::filter(const std::span < const input_event > keyboard, const uint64_t time_usec)
+{
+    const auto active_filter = [](const link_t & link) {
+        return link.module->api().module_key_filter != nullptr && !link.async;
+    };
+    if (!filter_demoted && (keyboard.empty() || std::ranges::none_of(links, active_filter))) {
+        return keyboard;
+    }
+
+    halo_module_key_event events[HALO_MODULE_BATCH_MAX];
+    std::size_t count = 0;
+    for (const auto & ev : keyboard)
+    {
+        if (ev.type != EV_KEY) {
+            continue;
+        }
+
+        if (count == std::size(events))
+        {
+            // larger than any frame the core produces, passed as it is
+            for (const auto & key : keyboard)
+            {
+                if (key.type == EV_KEY && key.code < KEY_CNT)
+                {
+                    pressed_in.set(key.code, key.value != 0);
+                    pressed_out.set(key.code, key.value != 0);
+                }
+            }
+            return keyboard;
+        }
+        events[count++] = { .time_usec = time_usec, .key_id = ev.code, .value = ev.value };
+        if (ev.code < KEY_CNT) {
+            pressed_in.set(ev.code, ev.value != 0);
+        }
+    }
+
+    halo_module_key_event original[HALO_MODULE_BATCH_MAX];
+    const std::size_t original_count = count;
+    std::copy_n(events, count, original);
+
+    for (auto & link : links)
+    {
+        if (!active_filter(link)) {
+            continue;
+        }
+
+        const auto & module = *link.module;
+        if (std::none_of(events, events + count, [&](const halo_module_key_event & ev) { return module.wants(ev.key_id); })) {
+            continue;
+        }
+
+        const auto key_filter = module.api().module_key_filter;
+        timed(link, [&] { count = std::min(key_filter(events, count, std::size(events)), std::size(events)); });
+    }
+
+    track(pressed_out, events, count);
+    if (!filter_demoted && count == original_count && std::memcmp(events, original, count * sizeof(events[0])) == 0) {
+        return keyboard;
+    }
+
+    std::size_t written = 0;
+    for (std::size_t i = 0; i < count; i++)
+    {
+        if (events[i].key_id >= KEY_CNT) {
+            continue;
+        }
+
+        auto & key = rewritten[written++];
+        key = { };
+        key.type = EV_KEY;
+        key.code = static_cast<uint16_t>(events[i].key_id);
+        key.value = events[i].value;
+
+        auto & sync = rewritten[written++];
+        sync = { };
+        sync.type = EV_SYN;
+        sync.code = SYN_REPORT;
+    }
+
+    // what the demoted filter pressed in place of the keyboard would never be released once it is skipped
+    if (filter_demoted)
+    {
+        const auto held = pressed_out & ~pressed_in;
+        for (unsigned key_id = 0; key_id < KEY_CNT; key_id++)
+        {
+            if (!held.test(key_id)) {
+                continue;
+            }
+
+            auto & key = rewritten[written++];
+            key = { };
+            key.type = EV_KEY;
+            key.code = static_cast<uint16_t>(key_id);
+
+            auto & sync = rewritten[written++];
+            sync = { };
+            sync.type = EV_SYN;
+            sync.code = SYN_REPORT;
+        }
+
+        if (held.any()) {
+            print_log(WARNING_LOG, "[WARNING] Released ", held.count(), " keys held by the demoted filter\n");
+        }
+        pressed_out &= pressed_in;
+        filter_demoted = false;
+    }
+
+    return { rewritten, written };
+}
+
+void module_chain::dispatch(const std::span < const input_event > keyboard, const uint64_t time_usec)
+{
+    for (auto & link : links)
+    {
+        auto & module = *link.module;
+        if (module.api().module_key_batch == nullptr) {
+            continue;
+        }
+
+        halo_module_key_event batch[HALO_MODULE_BATCH_MAX];
+        std::size_t count = 0;
+        const auto append = [&](const unsigned int key_id, const int value)
+        {
+            batch[count++] = { .time_usec = time_usec, .key_id = key_id, .value = value };
+            if (count == std::size(batch))
+            {
+                deliver(link, batch, count);
+                count = 0;
+            }
+        };
+
+        for (const auto key_id : module.take_fn_keys()) {
+            append(key_id, 1);
+        }
+
+        for (const auto & ev : keyboard)
+        {
+            if (ev.type == EV_KEY && module.wants(ev.code)) {
+                append(ev.code, ev.value);
+            }
+        }
+
+        if (count != 0) {
+            deliver(link, batch, count);
+        }
+    }
+}
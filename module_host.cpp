@@ -0,0 +1,326 @@
+/* module_host.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "module_host.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "emit_keys.h"
+#include "execute_command.h"
+#include "log.hpp"
+#include "metrics.h"
+
+extern char ** environ;
+
+// above the fds the host expects its ends in, so the dup2()s of the spawn never clobber each other
+static int move_high(const int fd)
+{
+    const int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+    return high;
+}
+
+module_host::module_host(const std::string & host_path, const std::string & module_list)
+    : claimed_fn_slots(HALO_MODULE_FN_KEYS, false)
+{
+    shared_fd = move_high(memfd_create("halo_modhost", MFD_CLOEXEC));
+    to_host_fd = move_high(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    to_driver_fd = move_high(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (shared_fd == -1 || to_host_fd == -1 || to_driver_fd == -1 || ftruncate(shared_fd, sizeof(module_ring::shared_t)) == -1)
+    {
+        release();
+        throw std::runtime_error(std::string("Cannot set up the module host ring: ") + std::strerror(errno));
+    }
+
+    void * memory = mmap(nullptr, sizeof(module_ring::shared_t), PROT_READ | PROT_WRITE, MAP_SHARED, shared_fd, 0);
+    if (memory == MAP_FAILED)
+    {
+        release();
+        throw std::runtime_error(std::string("Cannot map the module host ring: ") + std::strerror(errno));
+    }
+
+    shared = new (memory) module_ring::shared_t { };
+    shared->magic = module_ring::magic;
+    shared->to_driver.consumer_sleeping = 1; // the driver loop always waits in epoll
+
+    const std::string driver_pid = std::to_string(getpid());
+    char * argv[] = {
+        const_cast<char *>(host_path.c_str()),
+        const_cast<char *>(driver_pid.c_str()),
+        const_cast<char *>(module_list.c_str()),
+        nullptr
+    };
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, shared_fd, module_ring::shared_fd);
+    posix_spawn_file_actions_adddup2(&actions, to_host_fd, module_ring::to_host_fd);
+    posix_spawn_file_actions_adddup2(&actions, to_driver_fd, module_ring::to_driver_fd);
+
+    // start with no blocked signals: the driver's own are handled on its loop, the host's are its own
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    const int spawn_error = posix_spawn(&child, host_path.c_str(), &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (spawn_error != 0)
+    {
+        child = -1;
+        release();
+        throw std::runtime_error("Cannot start module host " + host_path + ": " + std::strerror(spawn_error));
+    }
+
+    pidfd = open_pidfd(child);
+    if (pidfd == -1)
+    {
+        release();
+        throw std::runtime_error(std::string("pidfd_open() failed for the module host: ") + std::strerror(errno));
+    }
+
+    print_log(INFO_LOG, "Module host ", host_path, " (pid ", child, ") loads ", module_list, "\n");
+}
+
+bool module_host::poll_ready()
+{
+    if (loaded) {
+        return true;
+    }
+
+    // the host writes to_driver_fd once its modules are loaded, or exits
+    const auto state = shared->state.load(std::memory_order_acquire);
+    if (state == module_ring::STARTING)
+    {
+        pollfd fd { pidfd, POLLIN, 0 };
+        if (poll(&fd, 1, 0) == 0) {
+            return false;
+        }
+    }
+
+    if (shared->state.load(std::memory_order_acquire) != module_ring::READY)
+    {
+        std::string reason(shared->error, strnlen(shared->error, sizeof(shared->error)));
+        if (reason.empty()) {
+            reason = "exited while loading";
+        }
+        throw std::runtime_error("Module host failed to start: " + reason);
+    }
+
+    uint64_t count;
+    [[maybe_unused]] const auto ignored = read(to_driver_fd, &count, sizeof(count));
+    interest = shared->interest;
+    for (unsigned i = 0; i < HALO_MODULE_FN_KEYS; i++) {
+        claimed_fn_slots[i] = interest.fn_keys[i] != 0;
+    }
+
+    loaded = true;
+    print_log(INFO_LOG, "Module host (pid ", child, ") ready\n");
+    return true;
+}
+
+void module_host::wait_ready(const std::chrono::milliseconds timeout)
+{
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    pollfd fds[] = { { to_driver_fd, POLLIN, 0 }, { pidfd, POLLIN, 0 } };
+    while (!poll_ready())
+    {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            throw std::runtime_error("Module host failed to start: no answer");
+        }
+
+        if (poll(fds, 2, static_cast<int>(left.count())) == -1 && errno != EINTR) {
+            throw std::runtime_error(std::string("Module host failed to start: ") + std::strerror(errno));
+        }
+    }
+}
+
+module_host::~module_host()
+{
+    // the host drains what is queued and unloads its modules, a stuck one is killed after a second
+    if (shared != nullptr && child > 0 && !exited)
+    {
+        shared->stopping.store(1, std::memory_order_release);
+        constexpr uint64_t one = 1;
+        [[maybe_unused]] const auto ignored = write(to_host_fd, &one, sizeof(one));
+
+        pollfd fd { pidfd, POLLIN, 0 };
+        if (poll(&fd, 1, 1000) <= 0)
+        {
+            print_log(WARNING_LOG, "[WARNING] Module host ", child, " did not stop, killed\n");
+            kill(child, SIGKILL);
+        }
+    }
+
+    release();
+}
+
+void module_host::release() noexcept
+{
+    if (child > 0 && !exited)
+    {
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+        exited = true;
+    }
+
+    for (int * fd : { &pidfd, &shared_fd, &to_host_fd, &to_driver_fd })
+    {
+        if (*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+
+    if (shared != nullptr)
+    {
+        munmap(shared, sizeof(module_ring::shared_t));
+        shared = nullptr;
+    }
+}
+
+std::string module_host::reap()
+{
+    if (exited) {
+        return "already collected";
+    }
+
+    int status = 0;
+    if (waitpid(child, &status, WNOHANG) <= 0) {
+        return "still running";
+    }
+
+    exited = true;
+    if (WIFEXITED(status)) {
+        return "exit status " + std::to_string(WEXITSTATUS(status));
+    }
+    return WIFSIGNALED(status) ? std::string("killed by ") + strsignal(WTERMSIG(status)) : "ended";
+}
+
+void module_host::push(const uint64_t time_usec)
+{
+    if (pending_count == 0) {
+        return;
+    }
+
+    pending[pending_count - 1].flags |= module_ring::FRAME_END;
+    for (uint32_t i = 0; i < pending_count; i++) {
+        pending[i].time_usec = time_usec;
+    }
+
+    if (!shared->to_host.push(pending, pending_count)) {
+        metrics::add(metrics::MODULE_HOST_DROPS);
+    } else if (shared->to_host.needs_wakeup()) {
+        constexpr uint64_t one = 1;
+        [[maybe_unused]] const auto ignored = write(to_host_fd, &one, sizeof(one));
+    }
+
+    pending_count = 0;
+}
+
+void module_host::queue_fn_key(const key_id_t key_id)
+{
+    // a frame holds a handful of Fn presses at most, more than a batch is dropped
+    if (pending_count < std::size(pending)) {
+        pending[pending_count++] = { .time_usec = 0, .key_id = key_id, .value = 1, .flags = module_ring::FN_SLOT, .reserved = 0 };
+    }
+}
+
+void module_host::dispatch(const std::span < const input_event > keyboard, const uint64_t time_usec)
+{
+    if (exited || broken)
+    {
+        pending_count = 0;
+        return;
+    }
+
+    for (const auto & ev : keyboard)
+    {
+        if (ev.type != EV_KEY || ev.code >= HALO_MODULE_KEY_CODES || !HALO_MODULE_INTEREST_TEST(&interest, ev.code)) {
+            continue;
+        }
+
+        if (pending_count == std::size(pending)) {
+            push(time_usec);
+        }
+        pending[pending_count++] = { .time_usec = 0, .key_id = ev.code, .value = ev.value, .flags = 0, .reserved = 0 };
+    }
+
+    push(time_usec);
+}
+
+void module_host::service(const int vkbd_fd)
+{
+    uint64_t count;
+    [[maybe_unused]] const auto ignored = read(to_driver_fd, &count, sizeof(count));
+    if (broken) {
+        return;
+    }
+
+    // the ring's head lives in memory the host writes, a host that moved it past the ring is not read from again
+    auto & ring = shared->to_driver;
+    if (ring.size() > ring.capacity)
+    {
+        print_log(ERROR_LOG, "Module host ", child, " corrupted its ring, killed\n");
+        kill(child, SIGKILL);
+        broken = true;
+        return;
+    }
+
+    input_event frame[HALO_MODULE_BATCH_MAX * 2] { };
+    std::size_t written = 0;
+    module_ring::record_t record { };
+    for (uint32_t n = 0; n < ring.capacity && ring.pop(record); n++)
+    {
+        // the host is not trusted with more than key presses, releases and repeats
+        if (record.key_id < KEY_CNT && record.value >= 0 && record.value <= 2)
+        {
+            frame[written] = { };
+            frame[written].type = EV_KEY;
+            frame[written].code = static_cast<uint16_t>(record.key_id);
+            frame[written].value = record.value;
+            frame[written + 1] = { };
+            frame[written + 1].type = EV_SYN;
+            frame[written + 1].code = SYN_REPORT;
+            written += 2;
+        }
+
+        if ((record.flags & module_ring::FRAME_END) != 0 || written == std::size(frame))
+        {
+            emit_events(vkbd_fd, std::span(frame, written));
+            written = 0;
+        }
+    }
+
+    emit_events(vkbd_fd, std::span(frame, written));
+}
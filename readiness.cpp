@@ -0,0 +1,201 @@
+/* readiness.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "readiness.h"
+#include "log.hpp"
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <ranges>
+#include <set>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+    // udev is done with an input device once its event node is initialized
+    bool event_node_initialized(udev * udev, const std::string & input_syspath)
+    {
+        std::error_code ec;
+        for (const auto & entry : std::filesystem::directory_iterator(input_syspath, ec))
+        {
+            if (!entry.path().filename().string().starts_with("event")) {
+                continue;
+            }
+
+            udev_device * dev = udev_device_new_from_syspath(udev, entry.path().c_str());
+            if (dev == nullptr) {
+                continue;
+            }
+            const bool initialized = udev_device_get_is_initialized(dev) > 0;
+            udev_device_unref(dev);
+            if (initialized) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+}
+
+bool readiness::wait_for_uinput(udev * udev, const std::initializer_list<int> uinput_fds, const std::chrono::milliseconds timeout)
+{
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    // listen first, then look at what is already there, so no event can fall in between
+    udev_monitor * monitor = udev_monitor_new_from_netlink(udev, "udev");
+    if (monitor == nullptr
+        || udev_monitor_filter_add_match_subsystem_devtype(monitor, "input", nullptr) < 0
+        || udev_monitor_enable_receiving(monitor) < 0)
+    {
+        print_log(WARNING_LOG, "[WARNING] Cannot monitor udev, not waiting for the virtual devices\n");
+        if (monitor != nullptr) {
+            udev_monitor_unref(monitor);
+        }
+        return false;
+    }
+
+    std::set<std::string> pending; // sysnames of the uinput devices, inputN
+    for (const int fd : uinput_fds)
+    {
+        char sysname[64] {};
+        if (ioctl(fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+            print_log(WARNING_LOG, "[WARNING] Cannot query the name of a virtual device: ", strerror(errno), "\n");
+            continue;
+        }
+
+        if (!event_node_initialized(udev, std::string("/sys/devices/virtual/input/") + sysname)) {
+            pending.emplace(sysname);
+        }
+    }
+
+    while (!pending.empty())
+    {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        pollfd pfd { .fd = udev_monitor_get_fd(monitor), .events = POLLIN, .revents = 0 };
+        const int ret = left.count() > 0 ? poll(&pfd, 1, static_cast<int>(left.count())) : 0;
+        if (ret == 0) {
+            break;
+        }
+        if (ret < 0)
+        {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        udev_device * dev = udev_monitor_receive_device(monitor);
+        if (dev == nullptr) {
+            continue;
+        }
+
+        const char * sysname = udev_device_get_sysname(dev);
+        udev_device * parent = udev_device_get_parent(dev); // owned by dev
+        const char * parent_sysname = parent != nullptr ? udev_device_get_sysname(parent) : nullptr;
+        if (sysname != nullptr && parent_sysname != nullptr && std::string_view(sysname).starts_with("event")) {
+            pending.erase(parent_sysname);
+        }
+        udev_device_unref(dev);
+    }
+
+    udev_monitor_unref(monitor);
+    if (!pending.empty()) {
+        print_log(WARNING_LOG, "[WARNING] udev did not set up ", *pending.begin(), " in time, continuing anyway\n");
+    }
+    return pending.empty();
+}
+
+void readiness::notify(const std::string & state)
+{
+    const char * socket_path = std::getenv("NOTIFY_SOCKET");
+    if (socket_path == nullptr || socket_path[0] == '\0') {
+        return;
+    }
+
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    const std::size_t path_len = std::strlen(socket_path);
+    if (path_len >= sizeof(addr.sun_path)) {
+        print_log(WARNING_LOG, "[WARNING] NOTIFY_SOCKET too long, not notifying systemd\n");
+        return;
+    }
+    std::memcpy(addr.sun_path, socket_path, path_len);
+    if (addr.sun_path[0] == '@') {
+        addr.sun_path[0] = '\0'; // abstract namespace
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return;
+    }
+
+    if (sendto(fd, state.data(), state.size(), MSG_NOSIGNAL, reinterpret_cast<const sockaddr *>(&addr),
+            static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path_len)) < 0)
+    {
+        print_log(WARNING_LOG, "[WARNING] Cannot notify systemd: ", strerror(errno), "\n");
+    }
+    close(fd);
+}
+
+std::map < std::string, int > readiness::listen_fds()
+{
+    const char * pid_env = std::getenv("LISTEN_PID");
+    const char * fds_env = std::getenv("LISTEN_FDS");
+    if (pid_env == nullptr || fds_env == nullptr) {
+        return { };
+    }
+
+    // ours, or inherited from the instance handing over to us
+    const auto listen_pid = static_cast<pid_t>(std::strtol(pid_env, nullptr, 10));
+    const char * handover_env = std::getenv("HALO_HANDOVER");
+    const bool successor = handover_env != nullptr && std::string_view(handover_env) == "1";
+    if (listen_pid != getpid() && !(successor && listen_pid == getppid())) {
+        return { };
+    }
+
+    std::vector < std::string > names;
+    if (const char * names_env = std::getenv("LISTEN_FDNAMES"); names_env != nullptr) {
+        for (const auto name : std::string_view(names_env) | std::views::split(':')) {
+            names.emplace_back(name.begin(), name.end());
+        }
+    }
+
+    constexpr int first_fd = 3; // SD_LISTEN_FDS_START
+    const int count = static_cast<int>(std::strtol(fds_env, nullptr, 10));
+    std::map < std::string, int > fds;
+    for (int i = 0; i < count; i++)
+    {
+        const int fd = first_fd + i;
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+            continue;
+        }
+        fds.emplace(static_cast<std::size_t>(i) < names.size() ? names[i] : "unknown", fd);
+    }
+
+    setenv("LISTEN_PID", std::to_string(getpid()).c_str(), 1);
+    return fds;
+}
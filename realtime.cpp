@@ -0,0 +1,241 @@
+/* realtime.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "realtime.h"
+#include "log.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <malloc.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+thread_local bool realtime::allocations_forbidden = false;
+
+namespace {
+    constexpr std::size_t page_size = 4096;
+    constexpr std::size_t stack_prefault_bytes = 512 << 10;
+
+    // struct sched_attr of sched_setattr(2), which glibc does not wrap
+    struct sched_attr_t
+    {
+        uint32_t size;
+        uint32_t sched_policy;
+        uint64_t sched_flags;
+        int32_t sched_nice;
+        uint32_t sched_priority;
+        uint64_t sched_runtime;
+        uint64_t sched_deadline;
+        uint64_t sched_period;
+    };
+
+    constexpr uint32_t sched_deadline_policy = 6;   // SCHED_DEADLINE
+    constexpr uint64_t sched_flag_reset_on_fork = 1; // SCHED_FLAG_RESET_ON_FORK
+    constexpr int madv_populate_write = 23;         // MADV_POPULATE_WRITE, Linux 5.14
+
+    uint64_t env_number(const char * name, const uint64_t fallback)
+    {
+        const char * value = std::getenv(name);
+        return value != nullptr && *value != '\0' ? std::strtoull(value, nullptr, 10) : fallback;
+    }
+
+    [[gnu::noinline]] void prefault_stack()
+    {
+        volatile char stack[stack_prefault_bytes];
+        for (std::size_t i = 0; i < sizeof(stack); i += page_size) {
+            stack[i] = 0;
+        }
+    }
+
+    // a block as large as the hot path could ever need is faulted in and given back to malloc,
+    // which keeps it (no trimming, no mmap chunks), so later allocations land on resident pages
+    void prefault_heap(const std::size_t bytes)
+    {
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+        auto * const block = static_cast<volatile char *>(std::malloc(bytes));
+        if (block == nullptr) {
+            return;
+        }
+        for (std::size_t i = 0; i < bytes; i += page_size) {
+            block[i] = 0;
+        }
+        std::free(const_cast<char *>(block));
+    }
+
+    // what mlockall(MCL_CURRENT) does besides locking, for when it is not allowed: every writable mapping
+    // (the core's node arena and event buffers, the module host rings, latency histograms, thread blocks)
+    // is faulted in for writing. Returns the bytes populated
+    std::size_t prefault_mappings()
+    {
+        FILE * maps = std::fopen("/proc/self/maps", "re");
+        if (maps == nullptr) {
+            return 0;
+        }
+
+        std::size_t populated = 0;
+        char line[512];
+        while (std::fgets(line, sizeof(line), maps) != nullptr)
+        {
+            unsigned long begin = 0, end = 0;
+            char perms[5] { };
+            if (std::sscanf(line, "%lx-%lx %4s", &begin, &end, perms) != 3 || perms[0] != 'r' || perms[1] != 'w') {
+                continue;
+            }
+
+            if (madvise(reinterpret_cast<void *>(begin), end - begin, madv_populate_write) == 0) {
+                populated += end - begin;
+            }
+        }
+
+        std::fclose(maps);
+        return populated;
+    }
+}
+
+realtime::config_t realtime::from_env()
+{
+    config_t config;
+    const char * policy_env = std::getenv("HALO_RT");
+    if (policy_env == nullptr || *policy_env == '\0' || std::string(policy_env) == "off") {
+        return config;
+    }
+
+    if (std::string(policy_env) == "fifo") {
+        config.policy = FIFO;
+    } else if (std::string(policy_env) == "deadline") {
+        config.policy = DEADLINE;
+    } else {
+        print_log(ERROR_LOG, "Unknown HALO_RT policy \"", policy_env, "\", expected fifo, deadline or off\n");
+        throw std::runtime_error("Unknown real-time policy");
+    }
+
+    config.priority = static_cast<int>(env_number("HALO_RT_PRIORITY", static_cast<uint64_t>(config.priority)));
+    if (const char * cpu_env = std::getenv("HALO_RT_CPU"); cpu_env != nullptr && *cpu_env != '\0') {
+        config.cpu = static_cast<int>(std::strtol(cpu_env, nullptr, 10));
+    }
+    config.runtime_usec = env_number("HALO_RT_RUNTIME_US", config.runtime_usec);
+    config.period_usec = env_number("HALO_RT_PERIOD_US", config.period_usec);
+    config.heap_bytes = env_number("HALO_RT_HEAP_KB", config.heap_bytes >> 10) << 10;
+    config.check_allocations = env_number("HALO_RT_CHECK_ALLOCS", 0) != 0;
+    return config;
+}
+
+bool realtime::enter(const config_t & config)
+{
+    if (config.policy == OFF) {
+        return true;
+    }
+
+    // locking faults in everything mapped so far, buffers the core and the devices allocated up front included
+    bool ok = true;
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+    {
+        print_log(WARNING_LOG, "[WARNING] mlockall failed: ", strerror(errno), ", memory may be paged out\n");
+        const auto populated = prefault_mappings();
+        print_log(INFO_LOG, "Prefaulted ", populated >> 10, "KiB of writable mappings instead\n");
+        ok = false;
+    }
+    prefault_heap(config.heap_bytes);
+    prefault_stack();
+
+    // a SCHED_DEADLINE thread may not be narrowed to fewer cores than its root domain
+    if (config.cpu != -1 && config.policy == DEADLINE)
+    {
+        print_log(WARNING_LOG, "[WARNING] HALO_RT_CPU ignored, SCHED_DEADLINE cannot be pinned\n");
+    }
+    else if (config.cpu != -1)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(config.cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        {
+            print_log(WARNING_LOG, "[WARNING] Cannot pin the driver loop to core ", config.cpu, ": ", strerror(errno), "\n");
+            ok = false;
+        }
+    }
+
+    // reset on fork: module hosts, helpers and threads started later run at normal priority
+    if (config.policy == FIFO)
+    {
+        const sched_param param { .sched_priority = config.priority };
+        if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) == -1)
+        {
+            print_log(WARNING_LOG, "[WARNING] Cannot switch the driver loop to SCHED_FIFO: ", strerror(errno), "\n");
+            return false;
+        }
+    }
+    else
+    {
+        sched_attr_t attr {
+            .size = sizeof(sched_attr_t),
+            .sched_policy = sched_deadline_policy,
+            .sched_flags = sched_flag_reset_on_fork,
+            .sched_nice = 0,
+            .sched_priority = 0,
+            .sched_runtime = config.runtime_usec * 1000,
+            .sched_deadline = config.period_usec * 1000,
+            .sched_period = config.period_usec * 1000,
+        };
+        if (syscall(SYS_sched_setattr, 0, &attr, 0) == -1)
+        {
+            print_log(WARNING_LOG, "[WARNING] Cannot switch the driver loop to SCHED_DEADLINE: ", strerror(errno), "\n");
+            return false;
+        }
+    }
+
+    print_log(INFO_LOG, "Driver loop runs ", config.policy == FIFO ? "SCHED_FIFO" : "SCHED_DEADLINE",
+        config.cpu != -1 && config.policy == FIFO ? " on core " + std::to_string(config.cpu) : std::string(),
+        " with ", config.heap_bytes >> 10, "KiB of heap prefaulted\n");
+    return ok;
+}
+
+#if DEBUG
+// the no_allocations_t check, for every C++ allocation of the process
+static void * checked_allocation(const std::size_t size, const std::size_t alignment)
+{
+    if (realtime::allocations_forbidden)
+    {
+        realtime::allocations_forbidden = false;
+        constexpr char message[] = "Allocation on the real-time driver loop (inside realtime::no_allocations_t)\n";
+        [[maybe_unused]] const auto ignored = write(STDERR_FILENO, message, sizeof(message) - 1);
+        std::abort();
+    }
+
+    void * block = alignment == 0
+        ? std::malloc(size == 0 ? 1 : size)
+        : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void * operator new(const std::size_t size) { return checked_allocation(size, 0); }
+void * operator new[](const std::size_t size) { return checked_allocation(size, 0); }
+void * operator new(const std::size_t size, const std::align_val_t alignment) { return checked_allocation(size, static_cast<std::size_t>(alignment)); }
+void * operator new[](const std::size_t size, const std::align_val_t alignment) { return checked_allocation(size, static_cast<std::size_t>(alignment)); }
+#endif
@@ -0,0 +1,188 @@
+/* session.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "session.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ranges>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "log.hpp"
+
+std::string session::socket_path(const uid_t uid)
+{
+    if (const auto path_env = std::getenv("HALO_SESSION_SOCKET"); path_env != nullptr) {
+        return path_env;
+    }
+
+    return "/run/user/" + std::to_string(uid) + "/halo-session.sock";
+}
+
+std::string session::encode(const std::vector < std::string > & words)
+{
+    std::string line;
+    for (const auto & word : words)
+    {
+        if (!line.empty()) line += '\t';
+        line += word;
+    }
+
+    return line + '\n';
+}
+
+std::vector < std::string > session::decode(const std::string_view line)
+{
+    std::vector < std::string > words;
+    for (const auto word : line | std::views::split('\t')) {
+        words.emplace_back(word.begin(), word.end());
+    }
+
+    return words;
+}
+
+bool session::client::connect()
+{
+    sockaddr_un address { .sun_family = AF_UNIX, .sun_path = {} };
+    if (path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return false;
+    }
+
+    if (::connect(sock, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1)
+    {
+        print_log(DEBUG_LOG, "Session helper not reachable at ", path, ": ", strerror(errno), "\n");
+        disconnect();
+        return false;
+    }
+
+    // blocking only for connect(), a helper that stopped reading never stalls the driver
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    if (epoll_fd != -1)
+    {
+        epoll_event ev { .events = EPOLLIN, .data = { .ptr = epoll_tag } };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+            print_log(WARNING_LOG, "[WARNING] Cannot watch the session helper connection: ", strerror(errno), "\n");
+        }
+    }
+    print_log(INFO_LOG, "Connected to session helper at ", path, "\n");
+    return true;
+}
+
+void session::client::watch(const int epoll_fd_, void * tag)
+{
+    std::lock_guard lock(mutex);
+    epoll_fd = epoll_fd_;
+    epoll_tag = tag;
+}
+
+void session::client::disconnect()
+{
+    if (sock != -1) {
+        close(sock);
+        sock = -1;
+    }
+    replies.clear();
+}
+
+bool session::client::send(const std::string & request)
+{
+    // a request is a few dozen bytes, it goes out whole or not at all on a fresh socket buffer
+    const ssize_t sent = ::send(sock, request.data(), request.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    return sent == static_cast<ssize_t>(request.size());
+}
+
+bool session::client::launch(const std::vector < std::string > & argv)
+{
+    std::lock_guard lock(mutex);
+    std::vector < std::string > words = { "launch" };
+    words.insert(words.end(), argv.begin(), argv.end());
+    const auto request = encode(words);
+
+    // a connection kept from earlier may have lost its helper (logout, restart), retry once on a fresh one
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (sock == -1)
+        {
+            if (!connect()) {
+                return false;
+            }
+        }
+
+        if (send(request)) {
+            return true;
+        }
+
+        print_log(DEBUG_LOG, "Session helper connection lost: ", strerror(errno), "\n");
+        disconnect();
+    }
+
+    return false;
+}
+
+void session::client::service()
+{
+    std::lock_guard lock(mutex);
+    if (sock == -1) {
+        return;
+    }
+
+    char buffer[512];
+    while (true)
+    {
+        const ssize_t count = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (count > 0) {
+            replies.append(buffer, count);
+            continue;
+        }
+
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (count == 0 || errno != EAGAIN)
+        {
+            print_log(WARNING_LOG, "[WARNING] Session helper at ", path, " went away\n");
+            disconnect();
+            return;
+        }
+        break;
+    }
+
+    for (std::size_t end; (end = replies.find('\n')) != std::string::npos; replies.erase(0, end + 1))
+    {
+        const auto reply = decode(std::string_view(replies).substr(0, end));
+        if (!reply.empty() && reply.front() == "ok") {
+            print_log(DEBUG_LOG, "Session helper launched pid ", reply.size() > 1 ? reply[1] : "?", "\n");
+        } else {
+            auto message = replies.substr(0, end);
+            std::ranges::replace(message, '\t', ' ');
+            print_log(WARNING_LOG, "[WARNING] Session helper: ", message, "\n");
+        }
+    }
+}
@@ -0,0 +1,59 @@
+/* touch_record.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "touch_record.h"
+#include <cstring>
+#include <stdexcept>
+
+touch_recorder::touch_recorder(const std::string & path)
+    : ofs(path, std::ios::binary | std::ios::trunc)
+{
+    if (!ofs) {
+        throw std::runtime_error("Unable to create touch recording " + path);
+    }
+
+    ofs.write(touch_record_magic, sizeof(touch_record_magic));
+}
+
+void touch_recorder::append(const touch_event_t & touch)
+{
+    ofs.write(reinterpret_cast<const char *>(&touch), sizeof(touch));
+}
+
+std::vector<touch_event_t> read_touch_records(const std::string & path)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) {
+        throw std::runtime_error("Unable to open touch recording " + path);
+    }
+
+    char magic[sizeof(touch_record_magic)] {};
+    if (!ifs.read(magic, sizeof(magic)) || std::memcmp(magic, touch_record_magic, sizeof(magic)) != 0) {
+        throw std::invalid_argument("Not a touch recording: " + path);
+    }
+
+    std::vector<touch_event_t> records;
+    touch_event_t touch{};
+    while (ifs.read(reinterpret_cast<char *>(&touch), sizeof(touch))) {
+        records.push_back(touch);
+    }
+
+    return records;
+}
@@ -0,0 +1,102 @@
+/* worker_pool.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "worker_pool.h"
+#include <algorithm>
+#include <csignal>
+#include <optional>
+#include <pthread.h>
+#include "log.hpp"
+
+worker_pool::worker_pool(const unsigned thread_count, const std::size_t capacity_, const std::string & name)
+    : capacity(capacity_)
+{
+    // threads inherit the creator's signal mask
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (unsigned i = 0; i < thread_count; i++) {
+        threads.emplace_back(&worker_pool::run, this, name + std::to_string(i));
+    }
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+void worker_pool::run(const std::string & name)
+{
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+
+    std::unique_lock lock(mutex);
+    while (true)
+    {
+        wake.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return; // stopping, and nothing left to do
+        }
+
+        auto entry = std::make_optional(std::move(queue.front()));
+        queue.pop_front();
+
+        lock.unlock();
+        try {
+            entry->job();
+        } catch (const std::exception & e) {
+            print_log(ERROR_LOG, "Background job ", entry->key, " failed: ", e.what(), "\n");
+        }
+        // whatever the job captured (a retired module chain, a module's last reference) is torn down here,
+        // without the mutex, so submit() on the driver loop never waits on it
+        entry.reset();
+        lock.lock();
+    }
+}
+
+worker_pool::submit_result_t worker_pool::submit(const uint64_t key, job_t job)
+{
+    {
+        std::lock_guard lock(mutex);
+        if (std::ranges::any_of(queue, [key](const entry_t & entry) { return entry.key == key; })) {
+            return COALESCED;
+        }
+
+        if (stopping || queue.size() >= capacity) {
+            return REJECTED;
+        }
+
+        queue.push_back({ key, std::move(job) });
+    }
+
+    wake.notify_one();
+    return SUBMITTED;
+}
+
+void worker_pool::stop()
+{
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+
+    wake.notify_all();
+    for (auto & thread : threads)
+    {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}